@@ -1,8 +1,16 @@
 #include <virtmem.h>
+#include <alloc/mmap_alloc.h>
 #include <alloc/stdio_alloc.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cstdlib>
 #include <iostream>
+#include <vector>
+
+#ifdef VIRTMEM_THREAD_SAFE
+#include <thread>
+#endif
 
 using namespace virtmem;
 
@@ -10,10 +18,87 @@ enum
 {
     STDIO_POOLSIZE = 1024 * 128 + 128,
     STDIO_BUFSIZE = 1024 * 128,
-    STDIO_REPEATS = 50
+    STDIO_REPEATS = 50,
+
+    POLICY_POOLSIZE = 1024 * 1024 * 4,
+    POLICY_HOTSIZE = 1024 * 12, // frequently used data (e.g. an index)
+    POLICY_SCANSIZE = 1024 * 1024 * 3, // data that is only used once in a while (e.g. table scan)
+    POLICY_ROUNDS = 20,
+    POLICY_SCANSTEP = 64,
+
+    READAHEAD_POOLSIZE = 1024 * 1024 * 4,
+    READAHEAD_BUFSIZE = 1024 * 1024 * 3,
+    READAHEAD_REPEATS = 5,
+
+    ALLOC_POOLSIZE = 1024 * 1024 * 16,
+    ALLOC_BLOCKS = 2000, // live blocks
+    ALLOC_ROUNDS = 5000,
+
+    LATENCY_POOLSIZE = 1024 * 1024 * 16,
+    LATENCY_BLOCKS = 4000, // initially allocated, every other block is freed afterwards
+    LATENCY_ROUNDS = 5000,
+
+    BATCH_POOLSIZE = 1024 * 1024 * 16,
+    BATCH_BLOCKS = 5000,
+    BATCH_BLOCKSIZE = 24, // e.g. a list node
+
+    LOCALITY_POOLSIZE = 1024 * 1024 * 16,
+    LOCALITY_FRAGMENTS = 4000,
+    LOCALITY_NODES = 4000,
+    LOCALITY_NODESIZE = 32,
+    LOCALITY_ROUNDS = 20,
+
+    COMPACT_POOLSIZE = 1024 * 1024 * 16,
+    COMPACT_BLOCKS = 4000, // initially allocated, half of them are freed afterwards
+    COMPACT_STEPSIZE = 1024 * 4,
+    COMPACT_ALLOCS = 2000,
+
+    THREADS_POOLSIZE = 1024 * 1024 * 8,
+    THREADS_BUFSIZE = 1024 * 64, // per thread
+    THREADS_ACCESSES = 1024 * 1024 // total, divided over all threads
 };
 
-int main()
+struct PolicyBenchProperties
+{
+    static const uint8_t smallPageCount = 4, smallPageSize = 64;
+    static const uint8_t mediumPageCount = 4;
+    static const uint16_t mediumPageSize = 256;
+    static const uint8_t bigPageCount = 16;
+    static const uint16_t bigPageSize = 1024;
+};
+
+struct LRUBenchProperties : PolicyBenchProperties { typedef LRUPagePolicy<bigPageCount> PagePolicy; };
+struct ClockBenchProperties : PolicyBenchProperties { typedef ClockPagePolicy<bigPageCount> PagePolicy; };
+struct TwoQueueBenchProperties : PolicyBenchProperties { typedef TwoQueuePagePolicy<bigPageCount> PagePolicy; };
+
+struct SlabBenchProperties : PolicyBenchProperties { typedef SlabAllocEngine<256> AllocEngine; };
+struct TLSFBenchProperties : PolicyBenchProperties { typedef TLSFAllocEngine<> AllocEngine; };
+
+struct ReadAheadBenchProperties
+{
+    static const uint8_t smallPageCount = 4, smallPageSize = 64;
+    static const uint8_t mediumPageCount = 4;
+    static const uint16_t mediumPageSize = 256;
+    static const uint8_t bigPageCount = 32;
+    static const uint16_t bigPageSize = 1024 * 4;
+};
+
+// enough big pages for multiple cache shards (see VIRTMEM_CACHE_SHARDS)
+struct ThreadsBenchProperties
+{
+    static const uint8_t smallPageCount = 4, smallPageSize = 64;
+    static const uint8_t mediumPageCount = 4;
+    static const uint16_t mediumPageSize = 256;
+    static const uint8_t bigPageCount = 32;
+    static const uint16_t bigPageSize = 1024 * 4;
+};
+
+unsigned getTimeSince(std::chrono::high_resolution_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - time).count();
+}
+
+void benchmarkSequential()
 {
     StdioVAlloc valloc(STDIO_POOLSIZE);
 
@@ -28,12 +113,378 @@ int main()
             buf[j] = (char)j;
     }
 
-    const unsigned difftime =
-            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now() - time).count();
+    const unsigned difftime = getTimeSince(time);
 
     std::cout << "Finished in " << difftime << " ms\n";
     std::cout << "Speed: " << STDIO_REPEATS * STDIO_BUFSIZE / difftime * 1000 / 1024 << " kB/s\n";
 
-    return 0;
+    valloc.stop();
+}
+
+// Random accesses to a small hot data set, interleaved with scans over a large data set
+template <typename TA> void benchmarkPolicy(const char *name)
+{
+    TA valloc(POLICY_POOLSIZE);
+    valloc.start();
+
+    typename TA::template TVPtr<char>::type hot = valloc.template alloc<char>(POLICY_HOTSIZE);
+    typename TA::template TVPtr<char>::type scan = valloc.template alloc<char>(POLICY_SCANSIZE);
+
+    srand(0);
+    valloc.clearPages();
+#ifdef VIRTMEM_TRACE_STATS
+    valloc.resetStats();
+#endif
+
+    auto time = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<POLICY_ROUNDS; ++i)
+    {
+        for (int j=0; j<POLICY_SCANSIZE; j+=POLICY_SCANSTEP)
+        {
+            hot[rand() % POLICY_HOTSIZE] = (char)j;
+            scan[j] = (char)j;
+        }
+    }
+
+    std::cout << name << ": finished in " << getTimeSince(time) << " ms";
+#ifdef VIRTMEM_TRACE_STATS
+    const VPtrSize misses = valloc.getBigPageReads(), accesses = misses + valloc.getBigPageHits();
+    std::cout << ", page miss rate: " << (100.0 * misses / accesses) << "% (" << misses << " misses)";
+#endif
+    std::cout << "\n";
+
+    valloc.stop();
+}
+
+// Frees and allocates random blocks, mostly small ones
+template <typename TA> void benchmarkAlloc(const char *name)
+{
+    TA valloc(ALLOC_POOLSIZE);
+    valloc.start();
+
+    srand(0);
+    VPtrNum blocks[ALLOC_BLOCKS];
+    for (int i=0; i<ALLOC_BLOCKS; ++i)
+        blocks[i] = valloc.allocRaw(8 + rand() % 120);
+#ifdef VIRTMEM_TRACE_STATS
+    valloc.resetStats();
+#endif
+
+    auto time = std::chrono::high_resolution_clock::now();
+    for (int i=0; i<ALLOC_ROUNDS; ++i)
+    {
+        const int index = rand() % ALLOC_BLOCKS;
+        valloc.freeRaw(blocks[index]);
+        blocks[index] = valloc.allocRaw((rand() % 16) ? (8 + rand() % 120) : (1024 + rand() % 2048));
+    }
+
+    std::cout << name << ": finished in " << getTimeSince(time) << " ms";
+#ifdef VIRTMEM_TRACE_STATS
+    std::cout << ", " << valloc.getBigPageReads() << " page reads";
+#endif
+    std::cout << "\n";
+
+    valloc.stop();
 }
 
+// Measures the duration of single allocations and frees in a fragmented memory pool
+template <typename TA> void benchmarkLatency(const char *name)
+{
+    TA valloc(LATENCY_POOLSIZE);
+    valloc.start();
+
+    srand(0);
+    std::vector<VPtrNum> blocks;
+    for (int i=0; i<LATENCY_BLOCKS; ++i)
+        blocks.push_back(valloc.allocRaw((rand() % 8) ? (8 + rand() % 248) : (256 + rand() % 3840)));
+    for (int i=LATENCY_BLOCKS-2; i>=0; i-=2)
+    {
+        valloc.freeRaw(blocks[i]);
+        blocks.erase(blocks.begin() + i);
+    }
+
+    std::vector<unsigned> times; // us
+    for (int i=0; i<LATENCY_ROUNDS; ++i)
+    {
+        const int index = rand() % blocks.size();
+        const VPtrSize size = (rand() % 8) ? (8 + rand() % 248) : (256 + rand() % 3840);
+
+        auto time = std::chrono::high_resolution_clock::now();
+        valloc.freeRaw(blocks[index]);
+        times.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - time).count());
+
+        time = std::chrono::high_resolution_clock::now();
+        blocks[index] = valloc.allocRaw(size);
+        times.push_back(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - time).count());
+    }
+
+    std::sort(times.begin(), times.end());
+    std::cout << name << ": p99 " << times[times.size() * 99 / 100] << " us, max " << times.back() << " us\n";
+
+    valloc.stop();
+}
+
+// Allocates and frees many small blocks in a fragmented pool, per block or in batches
+template <typename TA> void benchmarkBatch(const char *name, bool batch)
+{
+    TA valloc(BATCH_POOLSIZE);
+    valloc.start();
+
+    srand(0);
+    std::vector<VPtrNum> fragments;
+    for (int i=0; i<BATCH_BLOCKS; ++i)
+        fragments.push_back(valloc.allocRaw(8 + rand() % 120));
+    for (int i=0; i<BATCH_BLOCKS; i+=2)
+        valloc.freeRaw(fragments[i]);
+
+    std::vector<VPtrNum> blocks(BATCH_BLOCKS);
+    auto time = std::chrono::high_resolution_clock::now();
+    if (batch)
+        valloc.allocRawBatch(BATCH_BLOCKS, BATCH_BLOCKSIZE, &blocks[0]);
+    else
+    {
+        for (int i=0; i<BATCH_BLOCKS; ++i)
+            blocks[i] = valloc.allocRaw(BATCH_BLOCKSIZE);
+    }
+    const unsigned alloctime = getTimeSince(time);
+
+    std::random_shuffle(blocks.begin(), blocks.end());
+    time = std::chrono::high_resolution_clock::now();
+    if (batch)
+        valloc.freeRawBatch(&blocks[0], BATCH_BLOCKS);
+    else
+    {
+        for (int i=0; i<BATCH_BLOCKS; ++i)
+            valloc.freeRaw(blocks[i]);
+    }
+
+    std::cout << name << ": alloc " << alloctime << " ms, free " << getTimeSince(time) << " ms\n";
+
+    valloc.stop();
+}
+
+// Builds a linked list in a fragmented pool, while other data is allocated in between, and traverses it
+template <typename TA> void benchmarkLocality(const char *name, bool near)
+{
+    TA valloc(LOCALITY_POOLSIZE);
+    valloc.start();
+
+    srand(0);
+    std::vector<VPtrNum> fragments;
+    for (int i=0; i<LOCALITY_FRAGMENTS; ++i)
+        fragments.push_back(valloc.allocRaw(8 + rand() % 120));
+    for (int i=0; i<LOCALITY_FRAGMENTS; ++i)
+    {
+        if (rand() % 2)
+            valloc.freeRaw(fragments[i]);
+    }
+
+    const VPtrNum head = valloc.allocRaw(LOCALITY_NODESIZE);
+    VPtrNum node = head;
+    for (int i=1; i<LOCALITY_NODES; ++i)
+    {
+        const VPtrNum next = (near) ? valloc.allocRawNear(node, LOCALITY_NODESIZE) : valloc.allocRaw(LOCALITY_NODESIZE);
+        valloc.write(node, &next, sizeof(next));
+        node = next;
+        valloc.allocRaw(8 + rand() % 120); // unrelated data
+    }
+    const VPtrNum end = 0;
+    valloc.write(node, &end, sizeof(end));
+
+    valloc.clearPages();
+#ifdef VIRTMEM_TRACE_STATS
+    valloc.resetStats();
+#endif
+
+    auto time = std::chrono::high_resolution_clock::now();
+    int count = 0;
+    for (int i=0; i<LOCALITY_ROUNDS; ++i)
+    {
+        for (node=head; node; ++count)
+            node = *static_cast<const VPtrNum *>(valloc.read(node, sizeof(node)));
+    }
+
+    std::cout << name << ": finished in " << getTimeSince(time) << " ms";
+#ifdef VIRTMEM_TRACE_STATS
+    std::cout << ", " << valloc.getBigPageReads() << " page reads";
+#endif
+    std::cout << " (" << count << " nodes)\n";
+
+    valloc.stop();
+}
+
+// Allocates blocks in a pool fragmented by relocatable blocks, optionally after compacting it
+void benchmarkCompact(bool compact)
+{
+    typedef StdioVAllocP<PolicyBenchProperties> Alloc;
+    Alloc valloc(COMPACT_POOLSIZE);
+    valloc.start();
+
+    {
+        VHandleTable<Alloc> handles;
+        srand(0);
+        std::vector<VHandleTable<Alloc>::Handle> blocks;
+        for (int i=0; i<COMPACT_BLOCKS; ++i)
+            blocks.push_back(handles.alloc(8 + rand() % 248));
+        for (int i=0; i<COMPACT_BLOCKS; ++i)
+        {
+            if (rand() % 2)
+                handles.free(blocks[i]);
+        }
+
+        if (compact)
+        {
+            auto time = std::chrono::high_resolution_clock::now();
+            int steps = 1;
+            while (!valloc.compact(COMPACT_STEPSIZE))
+                ++steps;
+            std::cout << "compacted in " << getTimeSince(time) << " ms (" << steps << " steps), ";
+        }
+        else
+            std::cout << "not compacted, ";
+
+#ifdef VIRTMEM_TRACE_STATS
+        valloc.resetStats();
+#endif
+        auto time = std::chrono::high_resolution_clock::now();
+        for (int i=0; i<COMPACT_ALLOCS; ++i)
+            valloc.allocRaw(8 + rand() % 248);
+        std::cout << "alloc " << getTimeSince(time) << " ms";
+#ifdef VIRTMEM_TRACE_STATS
+        std::cout << ", " << valloc.getBigPageReads() << " page reads";
+#endif
+        std::cout << "\n";
+    }
+
+    valloc.stop();
+}
+
+#ifdef VIRTMEM_READ_AHEAD
+void benchmarkReadAhead(VirtPageCount pages)
+{
+    StdioVAllocP<ReadAheadBenchProperties> valloc(READAHEAD_POOLSIZE);
+    valloc.setReadAhead(pages);
+    valloc.start();
+
+    StdioVAllocP<ReadAheadBenchProperties>::TVPtr<char>::type buf = valloc.alloc<char>(READAHEAD_BUFSIZE);
+    valloc.clearPages();
+#ifdef VIRTMEM_TRACE_STATS
+    valloc.resetStats();
+#endif
+
+    auto time = std::chrono::high_resolution_clock::now();
+    int sum = 0;
+    for (int i=0; i<READAHEAD_REPEATS; ++i)
+    {
+        for (int j=0; j<READAHEAD_BUFSIZE; ++j)
+            sum += buf[j];
+    }
+
+    std::cout << "read-ahead " << pages << " pages: finished in " << getTimeSince(time) << " ms";
+#ifdef VIRTMEM_TRACE_STATS
+    std::cout << ", " << valloc.getBigPageReads() << " page misses, " << valloc.getReadAheadHits() << " read-ahead hits, " <<
+                 valloc.getWastedPrefetches() << " wasted prefetches";
+#endif
+    std::cout << " (" << sum << ")\n";
+
+    valloc.stop();
+}
+#endif
+
+#ifdef VIRTMEM_THREAD_SAFE
+// Random accesses by multiple threads, each to its own buffer
+void benchmarkThreads(int threadcount)
+{
+    typedef StdioVAllocP<ThreadsBenchProperties> Alloc;
+    Alloc valloc(THREADS_POOLSIZE);
+    valloc.start();
+
+    auto time = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int t=0; t<threadcount; ++t)
+    {
+        threads.push_back(std::thread([&valloc, threadcount, t] {
+            Alloc::TVPtr<char>::type buf = valloc.alloc<char>(THREADS_BUFSIZE);
+            unsigned seed = t;
+            for (int i=0; i<THREADS_ACCESSES / threadcount; ++i)
+            {
+                seed = seed * 1103515245 + 12345;
+                // mostly local access: pages are shared by threads that access nearby data
+                const int index = (i * 16 + (seed >> 16) % 256) % THREADS_BUFSIZE;
+                if (seed & 1)
+                    buf[index] = (char)i;
+                else
+                    seed += buf[index];
+            }
+            valloc.free(buf);
+        }));
+    }
+
+    for (size_t t=0; t<threads.size(); ++t)
+        threads[t].join();
+
+    const unsigned difftime = getTimeSince(time);
+    std::cout << threadcount << " threads: finished in " << difftime << " ms, " <<
+                 (THREADS_ACCESSES / 1000) / (difftime ? difftime : 1) << " M accesses/s\n";
+
+    valloc.stop();
+}
+#endif
+
+int main()
+{
+    benchmarkSequential();
+
+#ifdef VIRTMEM_READ_AHEAD
+    std::cout << "\nSequential read with read-ahead:\n";
+    benchmarkReadAhead(0);
+    benchmarkReadAhead(4);
+    benchmarkReadAhead(16);
+#endif
+
+    std::cout << "\nPage replacement policies (hot set + scans):\n";
+    benchmarkPolicy<StdioVAllocP<PolicyBenchProperties> >("FIFO (default)");
+    benchmarkPolicy<StdioVAllocP<LRUBenchProperties> >("LRU");
+    benchmarkPolicy<StdioVAllocP<ClockBenchProperties> >("CLOCK");
+    benchmarkPolicy<StdioVAllocP<TwoQueueBenchProperties> >("2Q");
+
+    std::cout << "\nMemory pool backends (hot set + scans):\n";
+    benchmarkPolicy<StdioVAllocP<PolicyBenchProperties> >("stdio");
+    benchmarkPolicy<MmapVAllocP<PolicyBenchProperties> >("mmap");
+
+    std::cout << "\nAllocation engines (random alloc/free):\n";
+    benchmarkAlloc<StdioVAllocP<PolicyBenchProperties> >("free list (default)");
+    benchmarkAlloc<StdioVAllocP<SlabBenchProperties> >("slabs");
+    benchmarkAlloc<StdioVAllocP<TLSFBenchProperties> >("TLSF");
+
+    std::cout << "\nAllocation latency (fragmented pool):\n";
+    benchmarkLatency<StdioVAllocP<PolicyBenchProperties> >("free list (default)");
+    benchmarkLatency<StdioVAllocP<SlabBenchProperties> >("slabs");
+    benchmarkLatency<StdioVAllocP<TLSFBenchProperties> >("TLSF");
+
+    std::cout << "\nBatch allocation (" << (int)BATCH_BLOCKS << " small blocks, fragmented pool):\n";
+    benchmarkBatch<StdioVAllocP<PolicyBenchProperties> >("free list, per block", false);
+    benchmarkBatch<StdioVAllocP<PolicyBenchProperties> >("free list, batch", true);
+    benchmarkBatch<StdioVAllocP<TLSFBenchProperties> >("TLSF, per block", false);
+    benchmarkBatch<StdioVAllocP<TLSFBenchProperties> >("TLSF, batch", true);
+
+    std::cout << "\nList traversal (" << (int)LOCALITY_NODES << " nodes, fragmented pool):\n";
+    benchmarkLocality<StdioVAllocP<PolicyBenchProperties> >("free list, alloc", false);
+    benchmarkLocality<StdioVAllocP<PolicyBenchProperties> >("free list, allocNear", true);
+    benchmarkLocality<StdioVAllocP<SlabBenchProperties> >("slabs, alloc", false);
+    benchmarkLocality<StdioVAllocP<SlabBenchProperties> >("slabs, allocNear", true);
+    benchmarkLocality<StdioVAllocP<TLSFBenchProperties> >("TLSF, alloc", false);
+    benchmarkLocality<StdioVAllocP<TLSFBenchProperties> >("TLSF, allocNear", true);
+
+    std::cout << "\nCompaction (" << (int)COMPACT_ALLOCS << " allocations, fragmented pool):\n";
+    benchmarkCompact(false);
+    benchmarkCompact(true);
+
+#ifdef VIRTMEM_THREAD_SAFE
+    std::cout << "\nScalability (random access from multiple threads):\n";
+    for (int t=1; t<=8; t*=2)
+        benchmarkThreads(t);
+#endif
+
+    return 0;
+}
@@ -15,4 +15,5 @@ DEPENDPATH += $$PWD/../virtmem/src
 LIBS += -L$$PWD/../virtmem/src/ -lvirtmem
 unix:!macx: PRE_TARGETDEPS += $$PWD/../virtmem/src/libvirtmem.a
 
-QMAKE_CXXFLAGS +=  -std=gnu++11
+QMAKE_CXXFLAGS +=  -std=gnu++11 -pthread
+QMAKE_LFLAGS +=  -pthread
@@ -4,6 +4,9 @@
 #include "gtest/gtest.h"
 
 #include <inttypes.h>
+#include <string.h>
+#include <utility>
+#include <vector>
 
 using namespace virtmem;
 
@@ -29,6 +32,33 @@ public:
     VPtrFixture(void) : vptr() { } // UNDONE: we need this for proper construction, problem?
 };
 
+// Allocator that keeps its pool in RAM and counts accesses to it
+template <typename Properties> class CountingVAllocP : public VAlloc<Properties, CountingVAllocP<Properties> >
+{
+    std::vector<char> data;
+
+    void doStart(void) { data.assign(this->getPoolSize(), 0); accesses = reads = written = trimmed = 0; writes.clear(); }
+    void doSuspend(void) { }
+    void doStop(void) { data.clear(); }
+    void doRead(void *d, VPtrSize offset, VPtrSize size) { memcpy(d, &data[offset], size); ++accesses; ++reads; }
+    void doWrite(const void *d, VPtrSize offset, VPtrSize size)
+    {
+        memcpy(&data[offset], d, size);
+        ++accesses;
+        written += size;
+        writes.push_back(std::make_pair(offset, size));
+    }
+    bool doGrow(VPtrSize newsize) { data.resize(newsize); return true; }
+    void doTrim(VPtrSize, VPtrSize size) { trimmed += size; }
+
+public:
+    VPtrSize accesses, reads, written, trimmed;
+    std::vector<std::pair<VPtrSize, VPtrSize> > writes; // offset and size of each write
+
+    CountingVAllocP(VPtrSize ps=1024 * 1024) : accesses(0), reads(0), written(0), trimmed(0) { this->setPoolSize(ps); }
+    ~CountingVAllocP(void) { doStop(); }
+};
+
 #if 0
 // From http://stackoverflow.com/a/17236988
 inline void print128int(__uint128_t x)
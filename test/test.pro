@@ -6,7 +6,9 @@ CONFIG -= qt
 SOURCES += \
     test_alloc.cpp \
     test_wrapper.cpp \
-    test_utils.cpp
+    test_utils.cpp \
+    test_policy.cpp \
+    test_engine.cpp
 
 HEADERS += \
     test.h
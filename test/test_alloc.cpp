@@ -1,7 +1,10 @@
 #include "virtmem.h"
+#include "alloc/mmap_alloc.h"
 #include "alloc/stdio_alloc.h"
 #include "test.h"
 
+#include <map>
+#include <thread>
 #include <vector>
 
 
@@ -60,6 +63,25 @@ TEST_F(VAllocFixture, MultiAllocTest)
     }
 }
 
+TEST_F(VAllocFixture, MergeFreeTest)
+{
+    const VPtrSize size = 64;
+    VPtrNum ptrs[6];
+    for (int i=0; i<6; ++i)
+        ASSERT_NE(ptrs[i] = valloc.allocRaw(size), 0u);
+
+    // adjacent free blocks are merged, so that a larger block fits in their place. The blocks are freed
+    // in both orders, so both the lower and higher neighbor is merged.
+    for (int i=0; i<6; i+=3)
+    {
+        valloc.freeRaw(ptrs[i + (i == 0)]);
+        valloc.freeRaw(ptrs[i + (i != 0)]);
+        const VPtrNum p = valloc.allocRaw(size * 2);
+        EXPECT_GE(p, private_utils::minimal(ptrs[i], ptrs[i + 1]));
+        EXPECT_LT(p, private_utils::maximal(ptrs[i], ptrs[i + 1]) + size);
+    }
+}
+
 TEST_F(VAllocFixture, SimplePageTest)
 {
     EXPECT_EQ(valloc.getFreeBigPages(), valloc.getBigPageCount());
@@ -194,3 +216,961 @@ TEST_F(VAllocFixture, LargeRandomDataTest)
     }
 }
 
+
+TEST_F(VAllocFixture, PartialLockWriteTest)
+{
+    const VPtrSize size = valloc.getSmallPageSize() * 4;
+    const VPtrNum vbuffer = valloc.allocRaw(size);
+    const VPtrNum lockptr = vbuffer + size / 2;
+
+    // create a small lock, which stays around (unused) after releasing it
+    valloc.makeDataLock(lockptr, 1);
+    valloc.releaseLock(lockptr);
+
+    // write data that starts before and ends beyond the lock
+    std::vector<char> buffer(size);
+    for (VPtrSize i=0; i<size; ++i)
+        buffer[i] = i;
+    valloc.write(vbuffer, &buffer[0], size);
+
+    EXPECT_EQ(memcmp(valloc.read(vbuffer, size), &buffer[0], size), 0);
+    valloc.clearPages();
+    EXPECT_EQ(memcmp(valloc.read(vbuffer, size), &buffer[0], size), 0);
+}
+
+TEST_F(VAllocFixture, MultiInstanceTest)
+{
+    typedef StdioVAlloc::TVPtr<int>::type IntVPtr;
+
+    StdioVAlloc valloc2(1024 * 1024);
+    valloc2.start();
+    EXPECT_EQ(StdioVAlloc::getInstance(), &valloc);
+
+    IntVPtr vptr = valloc.alloc<int>();
+    *vptr = 1;
+    {
+        StdioVAlloc::Scope scope(valloc2);
+        EXPECT_EQ(StdioVAlloc::getInstance(), &valloc2);
+        IntVPtr vptr2 = valloc2.alloc<int>();
+        ASSERT_EQ(vptr2, vptr); // same address, different pool
+        *vptr2 = 2;
+        valloc2.clearPages();
+        EXPECT_EQ(*vptr2, 2);
+    }
+    EXPECT_EQ(StdioVAlloc::getInstance(), &valloc);
+    valloc.clearPages();
+    EXPECT_EQ(*vptr, 1);
+
+    // each thread uses its own instance
+    std::vector<std::thread> threads;
+    bool ok[4];
+    for (int t=0; t<4; ++t)
+    {
+        threads.push_back(std::thread([t, &ok] {
+            StdioVAlloc tvalloc(1024 * 1024);
+            tvalloc.start();
+            tvalloc.makeCurrent();
+
+            IntVPtr buf = tvalloc.alloc<int>(sizeof(int) * 1024 * 16);
+            for (int i=0; i<1024 * 16; ++i)
+                buf[i] = i * t;
+            tvalloc.clearPages();
+            ok[t] = true;
+            for (int i=0; i<1024 * 16; ++i)
+                ok[t] = ok[t] && (buf[i] == i * t);
+
+            StdioVAlloc::resetCurrent();
+            tvalloc.stop();
+        }));
+    }
+    for (int t=0; t<4; ++t)
+    {
+        threads[t].join();
+        EXPECT_TRUE(ok[t]);
+    }
+    EXPECT_EQ(StdioVAlloc::getInstance(), &valloc);
+
+    valloc2.stop();
+}
+
+TEST_F(VAllocFixture, ArenaTest)
+{
+    typedef StdioVAlloc::TVPtr<int>::type IntVPtr;
+
+#ifdef VIRTMEM_TRACE_STATS
+    valloc.resetStats();
+#endif
+    {
+        VArena<StdioVAlloc> arena(256);
+
+        // allocations are placed next to each other
+        IntVPtr first = arena.alloc<int>(), second = arena.alloc<int>();
+        ASSERT_NE(first, NILL);
+        EXPECT_EQ(second.getRawNum(), first.getRawNum() + 8);
+        *first = 1; *second = 2;
+
+        IntVPtr next;
+        {
+            VArena<StdioVAlloc>::Scope scope(arena);
+            for (int i=0; i<100; ++i)
+                *arena.alloc<int>() = i; // needs multiple extents
+            IntVPtr large = arena.alloc<int>(sizeof(int) * 1000);
+            ASSERT_NE(large, NILL);
+            large[999] = 3;
+
+            {
+                VArena<StdioVAlloc>::Scope nested(arena);
+                next = arena.alloc<int>();
+            }
+            EXPECT_EQ(arena.alloc<int>(), next); // memory from nested scope is re-used
+        }
+
+        // all memory of the scope is freed
+        EXPECT_EQ(arena.alloc<int>().getRawNum(), second.getRawNum() + 8);
+        EXPECT_EQ(*first, 1);
+        EXPECT_EQ(*second, 2);
+    }
+#ifdef VIRTMEM_TRACE_STATS
+    EXPECT_EQ(valloc.getMemUsed(), 0u);
+#endif
+}
+
+TEST_F(VAllocFixture, CompactTest)
+{
+    typedef VHandleTable<StdioVAlloc> Table;
+    enum { COUNT = 200 };
+
+    Table handles(16);
+    Table::Handle h[COUNT];
+    VPtrNum fixed[COUNT / 50], addr[COUNT], end = 0;
+    for (int i=0; i<COUNT; ++i)
+    {
+        const VPtrSize size = 16 + (i * 37) % 400;
+        ASSERT_NE(h[i] = handles.alloc(size), 0u);
+        addr[i] = handles.getRaw(h[i]);
+        valloc.write(addr[i], &i, sizeof(i));
+        valloc.write(addr[i] + size - sizeof(i), &i, sizeof(i));
+        end = private_utils::maximal(end, addr[i] + size);
+        if ((i % 50) == 25)
+        {
+            // blocks that are not relocatable stay in place
+            ASSERT_NE(fixed[i / 50] = valloc.allocRaw(32), 0u);
+            valloc.write(fixed[i / 50], &i, sizeof(i));
+        }
+    }
+    for (int i=0; i<COUNT; i+=2)
+    {
+        handles.free(h[i]);
+        h[i] = 0;
+    }
+
+#ifdef VIRTMEM_TRACE_STATS
+    const VPtrSize used = valloc.getMemUsed();
+#endif
+    int steps = 1;
+    while (!valloc.compact(256))
+        ++steps;
+    EXPECT_GT(steps, 1);
+#ifdef VIRTMEM_TRACE_STATS
+    EXPECT_EQ(valloc.getMemUsed(), used);
+#endif
+
+    int moved = 0;
+    for (int i=1; i<COUNT; i+=2)
+    {
+        const VPtrSize size = 16 + (i * 37) % 400;
+        const VPtrNum p = handles.getRaw(h[i]);
+        EXPECT_LE(p, addr[i]);
+        if (p != addr[i])
+            ++moved;
+        int end; // NOTE: may be unaligned
+        valloc.read(p + size - sizeof(end), &end, sizeof(end));
+        EXPECT_EQ(*(int *)valloc.read(p, sizeof(int)), i);
+        EXPECT_EQ(end, i);
+        EXPECT_EQ(*handles.get<int>(h[i]), i);
+    }
+    EXPECT_GT(moved, COUNT / 4);
+    for (int i=0; i<COUNT/50; ++i)
+        EXPECT_EQ(*(int *)valloc.read(fixed[i], sizeof(int)), i * 50 + 25);
+
+    // free memory at the end of the pool was released
+    const VPtrNum p = valloc.allocRaw(1024);
+    EXPECT_LT(p, end);
+
+    // handles stay valid when resized
+    ASSERT_TRUE(handles.realloc(h[1], 4096));
+    EXPECT_EQ(*handles.get<int>(h[1]), 1);
+    handles.free(h[3]);
+    EXPECT_TRUE(valloc.compact(1024 * 1024));
+    EXPECT_EQ(*handles.get<int>(h[1]), 1);
+    EXPECT_EQ(*handles.get<int>(h[5]), 5);
+}
+
+#ifdef VIRTMEM_ALIGNED_PAGES
+TEST_F(VAllocFixture, AlignedPagesTest)
+{
+    const VPtrSize pagesize = valloc.getBigPageSize();
+    const VPtrNum vbuffer = valloc.allocRaw(pagesize * 4);
+    const VPtrNum frame = vbuffer - (vbuffer % pagesize) + pagesize * 2;
+
+    valloc.clearPages();
+    const char *data = (const char *)valloc.read(frame + pagesize / 2, 1);
+    EXPECT_EQ(valloc.getFreeBigPages(), valloc.getBigPageCount() - 1);
+
+    // the whole frame should be loaded now
+    EXPECT_EQ((const char *)valloc.read(frame, 1), data - pagesize / 2);
+    EXPECT_EQ((const char *)valloc.read(frame + pagesize - 1, 1), data + pagesize / 2 - 1);
+    EXPECT_EQ(valloc.getFreeBigPages(), valloc.getBigPageCount() - 1);
+
+    // data straddling frames
+    std::vector<char> buffer(pagesize);
+    for (VPtrSize i=0; i<pagesize; ++i)
+        buffer[i] = rand();
+    valloc.write(frame + pagesize / 2, &buffer[0], pagesize);
+    EXPECT_EQ(memcmp(valloc.read(frame + pagesize / 2, pagesize), &buffer[0], pagesize), 0);
+    valloc.clearPages();
+    EXPECT_EQ(memcmp(valloc.read(frame + pagesize, pagesize / 2), &buffer[pagesize / 2], pagesize / 2), 0);
+    EXPECT_EQ(memcmp(valloc.read(frame + pagesize / 2, pagesize), &buffer[0], pagesize), 0);
+
+    // unaligned locks shouldn't end up as cache
+    valloc.clearPages();
+    valloc.makeDataLock(frame + 1, pagesize);
+    valloc.releaseLock(frame + 1);
+    EXPECT_EQ(valloc.getFreeBigPages(), valloc.getBigPageCount());
+}
+#endif
+
+#ifdef VIRTMEM_WIDE_PAGES
+// Page settings that require wide page types: > 127 pages of > 64 kB
+struct WidePageProperties
+{
+    static const uint32_t smallPageCount = 200, smallPageSize = 64;
+    static const uint32_t mediumPageCount = 4, mediumPageSize = 1024 * 32;
+    static const uint32_t bigPageCount = 160, bigPageSize = 1024 * 80;
+};
+
+TEST(WidePagesTest, LargeCacheTest)
+{
+    typedef StdioVAllocP<WidePageProperties> Alloc;
+    static Alloc alloc(1024 * 1024 * 32); // too large for the stack
+    Alloc *valloc = &alloc;
+    valloc->start();
+
+    const VirtPageCount pagecount = WidePageProperties::bigPageCount;
+    const VirtPageSize pagesize = WidePageProperties::bigPageSize;
+
+    EXPECT_EQ(valloc->getBigPageCount(), pagecount);
+    EXPECT_EQ(valloc->getBigPageSize(), pagesize);
+
+    const VPtrSize size = 1024 * 1024 * 20; // more than fits in the cache
+    const VPtrNum vbuffer = valloc->allocRaw(size);
+    std::vector<char> buffer(size);
+    for (VPtrSize i=0; i<size; ++i)
+        buffer[i] = rand();
+
+    const VPtrSize chunk = 1024 * 4;
+    for (VPtrSize i=0; i<size; i+=chunk)
+        valloc->write(vbuffer + i, &buffer[i], chunk);
+
+    valloc->clearPages();
+    EXPECT_EQ(valloc->getFreeBigPages(), pagecount);
+
+    for (VPtrSize i=0; i<size; i+=chunk)
+        ASSERT_EQ(memcmp(valloc->read(vbuffer + i, chunk), &buffer[i], chunk), 0);
+
+    // locks larger than 64 kB
+    const VPtrNum lockptr = vbuffer + size / 2 + 3;
+    VirtPageSize locksize = pagesize;
+    char *data = (char *)valloc->makeFittingLock(lockptr, locksize, false);
+    ASSERT_EQ(locksize, pagesize);
+    EXPECT_EQ(memcmp(data, &buffer[lockptr - vbuffer], locksize), 0);
+    memset(data, 'x', locksize);
+    memset(&buffer[lockptr - vbuffer], 'x', locksize);
+    valloc->releaseLock(lockptr);
+
+    valloc->clearPages();
+    for (VPtrSize i=0; i<size; i+=chunk)
+        ASSERT_EQ(memcmp(valloc->read(vbuffer + i, chunk), &buffer[i], chunk), 0);
+
+    valloc->stop();
+}
+#endif
+
+#ifdef VIRTMEM_WIDE_ADDRESSES
+// Allocator that only stores the parts of its (huge) pool that were actually written to
+template <typename Properties> class SparseVAllocP : public VAlloc<Properties, SparseVAllocP<Properties> >
+{
+    enum { CHUNK_SIZE = 4096 };
+    typedef std::map<VPtrNum, std::vector<char> > ChunkMap;
+    ChunkMap chunks;
+
+    void doStart(void) { }
+    void doSuspend(void) { }
+    void doStop(void) { chunks.clear(); }
+
+    void doRead(void *data, VPtrSize offset, VPtrSize size)
+    {
+        for (VPtrSize i=0; i<size; ++i)
+        {
+            ChunkMap::iterator it = chunks.find((offset + i) / CHUNK_SIZE);
+            ((char *)data)[i] = (it == chunks.end()) ? 0 : it->second[(offset + i) % CHUNK_SIZE];
+        }
+    }
+
+    void doWrite(const void *data, VPtrSize offset, VPtrSize size)
+    {
+        for (VPtrSize i=0; i<size; ++i)
+        {
+            std::vector<char> &chunk = chunks[(offset + i) / CHUNK_SIZE];
+            chunk.resize(CHUNK_SIZE);
+            chunk[(offset + i) % CHUNK_SIZE] = ((const char *)data)[i];
+        }
+    }
+
+public:
+    SparseVAllocP(VPtrSize ps) { this->setPoolSize(ps); }
+};
+
+typedef SparseVAllocP<DefaultAllocProperties> SparseVAlloc;
+
+// NOTE: compact headers limit the used part of the pool to 4 GB
+#ifdef VIRTMEM_COMPACT_HEADERS
+struct SparseSlabProperties : DefaultAllocProperties { typedef SlabAllocEngine<16> AllocEngine; };
+
+TEST(WideAddressTest, CompactLimitTest)
+{
+    // NOTE: an allocation engine is used, since the default engine asserts when it runs out of memory
+    const VPtrSize gb = 1024ull * 1024ull * 1024ull;
+    SparseVAllocP<SparseSlabProperties> valloc(gb * 12);
+    valloc.start();
+
+    const VPtrNum block = valloc.allocRaw(gb * 3);
+    ASSERT_NE(block, 0u);
+    EXPECT_EQ(valloc.allocRaw(gb * 2), 0u);
+
+    // the last block cannot be extended past the limit either
+    EXPECT_EQ(valloc.reallocRaw(block, gb * 5), 0u);
+    EXPECT_NE(valloc.reallocRaw(block, gb * 3 + 1024), 0u);
+
+    valloc.stop();
+}
+#else
+TEST(WideAddressTest, LargePoolTest)
+{
+    const VPtrSize gb = 1024ull * 1024ull * 1024ull;
+    SparseVAlloc valloc(gb * 12);
+    valloc.start();
+
+    // allocate past the 4 GB boundary
+    const VPtrNum block1 = valloc.allocRaw(gb * 3), block2 = valloc.allocRaw(gb * 3);
+    ASSERT_NE(block1, 0u);
+    ASSERT_NE(block2, 0u);
+    EXPECT_GT(block2 + gb * 3, gb * 4);
+
+    typedef SparseVAlloc::TVPtr<int>::type IntVPtr;
+    IntVPtr p1, p2;
+    p1.setRawNum(block1 + gb * 3 - sizeof(int) * 8);
+    p2.setRawNum(block2 + gb * 3 - sizeof(int) * 8);
+    for (int i=0; i<8; ++i)
+    {
+        p1[i] = i;
+        p2[i] = -i;
+    }
+
+    valloc.clearPages();
+    for (int i=0; i<8; ++i)
+    {
+        EXPECT_EQ((int)p1[i], i);
+        EXPECT_EQ((int)p2[i], -i);
+    }
+
+    // memory blocks of > 4 GB
+    valloc.freeRaw(block1);
+    valloc.freeRaw(block2);
+    const VPtrNum block3 = valloc.allocRaw(gb * 5);
+    ASSERT_NE(block3, 0u);
+    const char val = 55;
+    valloc.write(block3 + gb * 5 - 1, &val, sizeof(val));
+    valloc.clearPages();
+    EXPECT_EQ(*(const char *)valloc.read(block3 + gb * 5 - 1, sizeof(val)), val);
+
+    valloc.stop();
+}
+#endif
+#endif
+
+#if defined(VIRTMEM_WIDE_ADDRESSES) && !defined(VIRTMEM_COMPACT_HEADERS) && VIRTMEM_ZERO_MAP_SIZE > 0
+TEST(ZeroMapTest, LargeStdioPoolTest)
+{
+    // the pool file is sparse, so it can be much larger than the available disk space
+    StdioVAlloc valloc(1024ull * 1024ull * 1024ull * 64ull);
+    valloc.start();
+
+    const VPtrNum p = valloc.allocRaw(valloc.getPoolSize() / 2);
+    ASSERT_NE(p, 0u);
+    const char val = 55;
+    valloc.write(p + valloc.getPoolSize() / 2 - 1, &val, sizeof(val));
+    valloc.clearPages();
+    EXPECT_EQ(*(const char *)valloc.read(p + valloc.getPoolSize() / 2 - 1, sizeof(val)), val);
+    EXPECT_EQ(*(const char *)valloc.read(p + valloc.getPoolSize() / 4, sizeof(val)), 0);
+
+    valloc.stop();
+}
+#endif
+
+TEST(GrowPoolTest, StdioTest)
+{
+    StdioVAlloc valloc(1024 * 32);
+    valloc.setMaxPoolSize(1024 * 1024);
+    valloc.start();
+
+    // allocations that don't fit in the initial pool
+    typedef StdioVAlloc::TVPtr<char>::type CharVPtr;
+    CharVPtr p1 = valloc.alloc<char>(1024 * 100), p2 = valloc.alloc<char>(1024 * 500);
+    ASSERT_NE(p1, NILL);
+    ASSERT_NE(p2, NILL);
+    EXPECT_GE(valloc.getPoolSize(), 1024u * 600);
+
+    p1[1024 * 100 - 1] = 1;
+    p2[1024 * 500 - 1] = 2;
+    valloc.clearPages();
+    EXPECT_EQ(p1[1024 * 100 - 1], 1);
+    EXPECT_EQ(p2[1024 * 500 - 1], 2);
+    EXPECT_LE(valloc.getPoolSize(), 1024u * 1024);
+
+    valloc.stop();
+}
+
+TEST(PersistentPoolTest, ReopenTest)
+{
+    struct Node { VPtrNum next; int value; };
+    const char *file = "virtmem_persistent_test.vm";
+    enum { COUNT = 200 };
+    VPtrNum blocks[COUNT];
+#ifdef VIRTMEM_TRACE_STATS
+    VPtrSize used;
+#endif
+
+    {
+        StdioVAlloc valloc(1024 * 64);
+        valloc.setFileName(file);
+        valloc.setMaxPoolSize(1024 * 1024);
+        valloc.setPersistent(true);
+        valloc.start();
+        EXPECT_EQ(valloc.getRootRaw(), 0u);
+
+        // a list, with other blocks in between that are partially freed
+        VPtrNum head = 0;
+        for (int i=0; i<COUNT; ++i)
+        {
+            const Node node = { head, i };
+            ASSERT_NE(head = valloc.allocRaw(sizeof(Node)), 0u);
+            valloc.write(head, &node, sizeof(node));
+            ASSERT_NE(blocks[i] = valloc.allocRaw(100 + i * 10), 0u);
+        }
+        valloc.setRootRaw(head);
+        for (int i=0; i<COUNT; i+=2)
+            valloc.freeRaw(blocks[i]);
+#ifdef VIRTMEM_TRACE_STATS
+        used = valloc.getMemUsed();
+#endif
+        valloc.stop();
+    }
+
+    typedef StdioVAlloc::TVPtr<int>::type IntVPtr;
+    IntVPtr root;
+    {
+        StdioVAlloc valloc(1024 * 64);
+        valloc.setFileName(file);
+        valloc.setMaxPoolSize(1024 * 1024);
+        valloc.setPersistent(true);
+        valloc.start();
+        EXPECT_GT(valloc.getPoolSize(), 1024u * 64); // grown size is kept
+#ifdef VIRTMEM_TRACE_STATS
+        EXPECT_EQ(valloc.getMemUsed(), used);
+#endif
+
+        // the free list is restored: new blocks don't overlap the list
+        for (int i=0; i<COUNT; i+=2)
+        {
+            ASSERT_NE(blocks[i] = valloc.allocRaw(100 + i * 10), 0u);
+            const std::vector<char> data(100 + i * 10, 1);
+            valloc.write(blocks[i], &data[0], data.size());
+        }
+        int count = 0;
+        for (VPtrNum p=valloc.getRootRaw(); p; ++count)
+        {
+            const Node node = *(const Node *)valloc.read(p, sizeof(Node));
+            ASSERT_EQ(node.value, COUNT - 1 - count);
+            p = node.next;
+        }
+        EXPECT_EQ(count, COUNT);
+
+        // changes after the last checkpoint are lost if the allocator isn't stopped
+        root = valloc.alloc<int>();
+        *root = 42;
+        valloc.setRoot(root);
+        valloc.checkpoint();
+        valloc.setRootRaw(0);
+    }
+
+    {
+        StdioVAlloc valloc(1024 * 64);
+        valloc.setFileName(file);
+        valloc.setPersistent(true);
+        valloc.start();
+        EXPECT_EQ(valloc.getRoot<int>(), root);
+        EXPECT_EQ(*valloc.getRoot<int>(), 42);
+
+        // changes that were partially written invalidate the pool
+        *root = 43;
+        valloc.clearPages();
+    }
+
+    StdioVAlloc valloc(1024 * 64);
+    valloc.setFileName(file);
+    valloc.setPersistent(true);
+    valloc.start();
+    EXPECT_EQ(valloc.getRootRaw(), 0u);
+    valloc.setRoot(root);
+    valloc.stop();
+    valloc.start();
+    EXPECT_EQ(valloc.getRoot<int>(), root);
+    valloc.stop();
+
+    // without persistence the pool is cleared
+    valloc.setPersistent(false);
+    valloc.start();
+    EXPECT_EQ(valloc.getRootRaw(), 0u);
+    valloc.stop();
+    remove(file);
+}
+
+TEST(PersistentPoolTest, StaleFileTest)
+{
+    const char *file = "virtmem_stale_test.vm";
+    FILE *f = fopen(file, "wb");
+    ASSERT_TRUE(f != 0);
+    const std::vector<char> stale(1024 * 64, (char)0xAA);
+    fwrite(&stale[0], stale.size(), 1, f);
+    fclose(f);
+
+    // the old data of a named file is discarded if the pool isn't persistent
+    StdioVAlloc valloc(1024 * 64);
+    valloc.setFileName(file);
+    valloc.start();
+    valloc.allocRaw(256);
+    const VPtrNum p = valloc.allocRaw(256);
+    ASSERT_NE(p, 0u);
+    const char c = 1;
+    valloc.write(p, &c, 1);
+    valloc.flush();
+    valloc.clearPages();
+
+    const char *data = (const char *)valloc.read(p, 256);
+    EXPECT_EQ(data[0], 1);
+    for (int i=1; i<256; ++i)
+        ASSERT_EQ(data[i], 0);
+    valloc.stop();
+    remove(file);
+}
+
+TEST(MmapVAllocTest, RandomDataTest)
+{
+    MmapVAlloc valloc(1024 * 1024 * 4);
+#ifdef VIRTMEM_READ_AHEAD
+    valloc.setReadAhead(2); // requested with madvise()
+#endif
+    valloc.start();
+
+    const VPtrSize size = 1024 * 1024 * 2; // more than fits in the cache
+    const VirtPageSize pagesize = valloc.getBigPageSize();
+    const VPtrNum vbuffer = valloc.allocRaw(size);
+    ASSERT_NE(vbuffer, 0u);
+    std::vector<char> buffer(size), data(pagesize);
+
+    for (int i=0; i<5000; ++i)
+    {
+        const VPtrSize offset = rand() % (size - pagesize);
+        VirtPageSize n = 1 + rand() % pagesize;
+        switch (i % 4)
+        {
+        case 0:
+            for (VirtPageSize j=0; j<n; ++j)
+                data[j] = rand();
+            valloc.write(vbuffer + offset, &data[0], n);
+            memcpy(&buffer[offset], &data[0], n);
+            break;
+        case 1:
+        {
+            char *lock = (char *)valloc.makeFittingLock(vbuffer + offset, n, false);
+            ASSERT_EQ(memcmp(lock, &buffer[offset], n), 0);
+            memset(lock, i, n);
+            memset(&buffer[offset], i, n);
+            valloc.releaseLock(vbuffer + offset);
+            break;
+        }
+        case 2:
+            ASSERT_EQ(memcmp(valloc.read(vbuffer + offset, n), &buffer[offset], n), 0);
+            break;
+        case 3:
+            if ((i % 128) == 3)
+                valloc.clearPages();
+            else
+            {
+                // small locks use copies of the data
+                n = private_utils::minimal(n, valloc.getSmallPageSize());
+                char *lock = (char *)valloc.makeDataLock(vbuffer + offset, n);
+                ASSERT_EQ(memcmp(lock, &buffer[offset], n), 0);
+                lock[0] = buffer[offset] = i;
+                valloc.releaseLock(vbuffer + offset);
+            }
+            break;
+        }
+    }
+
+    valloc.clearPages();
+    for (VPtrSize i=0; i<size; i+=pagesize)
+        ASSERT_EQ(memcmp(valloc.read(vbuffer + i, pagesize), &buffer[i], pagesize), 0);
+
+    valloc.stop();
+}
+
+TEST(MmapVAllocTest, InPlaceTest)
+{
+    const char *file = "virtmem_mmap_test.vm";
+    remove(file);
+
+    MmapVAlloc valloc(1024 * 256);
+    valloc.setFileName(file);
+    valloc.start();
+
+    const VirtPageSize pagesize = valloc.getBigPageSize();
+    const VPtrNum p = valloc.allocRaw(pagesize * 2);
+    ASSERT_NE(p, 0u);
+    FILE *f = fopen(file, "rb");
+    ASSERT_TRUE(f != 0);
+    setbuf(f, 0); // always read the current data
+    int val = 0;
+
+    // big pages are part of the file, so data is stored without writing back pages
+    const int data = 42;
+    valloc.write(p, &data, sizeof(data));
+    fseek(f, p, SEEK_SET);
+    ASSERT_EQ(fread(&val, sizeof(val), 1, f), 1u);
+    EXPECT_EQ(val, data);
+
+    int *lock = (int *)valloc.makeDataLock(p + sizeof(int), pagesize);
+    *lock = 43;
+    fseek(f, p + sizeof(int), SEEK_SET);
+    ASSERT_EQ(fread(&val, sizeof(val), 1, f), 1u);
+    EXPECT_EQ(val, 43);
+    valloc.releaseLock(p + sizeof(int));
+
+    fclose(f);
+    valloc.stop();
+
+    // the file is emptied when started again
+    valloc.start();
+    EXPECT_EQ(*(int *)valloc.read(p, sizeof(int)), 0);
+    valloc.stop();
+    remove(file);
+}
+
+TEST(MmapVAllocTest, CompactTest)
+{
+    MmapVAlloc valloc(1024 * 256);
+    valloc.start();
+
+    typedef VHandleTable<MmapVAlloc> Table;
+    enum { COUNT = 100 };
+    Table handles(16, &valloc);
+    Table::Handle h[COUNT];
+    for (int i=0; i<COUNT; ++i)
+    {
+        ASSERT_NE(h[i] = handles.alloc(16 + i * 20), 0u);
+        valloc.write(handles.getRaw(h[i]), &i, sizeof(i));
+    }
+    for (int i=0; i<COUNT; i+=2)
+        handles.free(h[i]);
+
+    EXPECT_TRUE(valloc.compact(1024 * 1024));
+    valloc.clearPages();
+    for (int i=1; i<COUNT; i+=2)
+        EXPECT_EQ(*handles.get<int>(h[i]), i);
+
+    handles.reset();
+    valloc.stop();
+}
+
+TEST(MmapVAllocTest, PersistentTest)
+{
+    const char *file = "virtmem_mmap_persistent_test.vm";
+    remove(file);
+    enum { COUNT = 100, BLOCK_SIZE = 1024 * 4 };
+
+    {
+        MmapVAlloc valloc(1024 * 64);
+        valloc.setMaxPoolSize(1024 * 1024);
+        valloc.setFileName(file);
+        valloc.setPersistent(true);
+        valloc.start();
+
+        // table with addresses of blocks that don't fit in the initial pool
+        const VPtrNum table = valloc.allocRaw(COUNT * sizeof(VPtrNum));
+        ASSERT_NE(table, 0u);
+        for (int i=0; i<COUNT; ++i)
+        {
+            const VPtrNum p = valloc.allocRaw(BLOCK_SIZE);
+            ASSERT_NE(p, 0u);
+            valloc.write(p + BLOCK_SIZE - sizeof(i), &i, sizeof(i));
+            valloc.write(table + i * sizeof(VPtrNum), &p, sizeof(p));
+        }
+        valloc.setRootRaw(table);
+        valloc.stop();
+    }
+
+    {
+        MmapVAlloc valloc(1024 * 64);
+        valloc.setMaxPoolSize(1024 * 1024);
+        valloc.setFileName(file);
+        valloc.setPersistent(true);
+        valloc.start();
+
+        const VPtrNum table = valloc.getRootRaw();
+        ASSERT_NE(table, 0u);
+        EXPECT_GT(valloc.getPoolSize(), 1024u * 64);
+        for (int i=0; i<COUNT; ++i)
+        {
+            const VPtrNum p = *(VPtrNum *)valloc.read(table + i * sizeof(VPtrNum), sizeof(VPtrNum));
+            ASSERT_EQ(*(int *)valloc.read(p + BLOCK_SIZE - sizeof(int), sizeof(int)), i);
+        }
+
+        // modified in place and not stopped properly: the state is invalid
+        const int val = -1;
+        valloc.write(table, &val, sizeof(val));
+    }
+
+    MmapVAlloc valloc(1024 * 64);
+    valloc.setFileName(file);
+    valloc.setPersistent(true);
+    valloc.start();
+    EXPECT_EQ(valloc.getRootRaw(), 0u);
+    valloc.stop();
+    remove(file);
+}
+
+#ifdef VIRTMEM_THREAD_SAFE
+TEST_F(VAllocFixture, ThreadTest)
+{
+    typedef StdioVAlloc::TVPtr<int>::type IntVPtr;
+    enum { THREADS = 4, SIZE = 1024 * 32 };
+    bool ok[THREADS];
+
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads.push_back(std::thread([this, t, &ok] {
+            std::vector<int> buffer(SIZE);
+            IntVPtr vbuffer = valloc.alloc<int>(SIZE * sizeof(int));
+            for (int i=0; i<SIZE; ++i)
+                vbuffer[i] = buffer[i] = rand();
+
+            ok[t] = true;
+            for (int i=0; i<SIZE && ok[t]; ++i)
+            {
+                const int index = rand() % SIZE;
+                if (rand() % 2)
+                    ok[t] = (vbuffer[index] == buffer[index]);
+                else
+                    vbuffer[index] = buffer[index] = rand();
+
+                // locked data should stay valid while other threads access memory
+                if ((i % 256) == 0)
+                {
+                    VPtrLock<IntVPtr> lock(vbuffer + index, 64 * sizeof(int));
+                    const int count = private_utils::minimal((int)(lock.getLockSize() / sizeof(int)), SIZE - index);
+                    for (int j=0; j<count; ++j)
+                        (*lock)[j] = buffer[index + j] = -j;
+                    for (int j=0; j<10000; ++j)
+                        ok[t] = ok[t] && ((*lock)[j % count] == -(j % count));
+                }
+            }
+
+            for (int i=0; i<SIZE && ok[t]; ++i)
+                ok[t] = (vbuffer[i] == buffer[i]);
+            valloc.free(vbuffer);
+        }));
+    }
+
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads[t].join();
+        EXPECT_TRUE(ok[t]);
+    }
+}
+
+TEST_F(VAllocFixture, ThreadAllocTest)
+{
+    enum { THREADS = 4, BLOCKS = 64, ROUNDS = 2000 };
+    bool ok[THREADS];
+
+    // block headers are read and written while other threads swap pages
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads.push_back(std::thread([this, t, &ok] {
+            VPtrNum ptrs[BLOCKS] = { };
+            ok[t] = true;
+            for (int i=0; i<ROUNDS && ok[t]; ++i)
+            {
+                const int b = rand() % BLOCKS;
+                if (ptrs[b])
+                {
+                    int val;
+                    valloc.read(ptrs[b], &val, sizeof(val));
+                    ok[t] = (val == b + t * BLOCKS);
+                    valloc.freeRaw(ptrs[b]);
+                    ptrs[b] = 0;
+                }
+                else
+                {
+                    const int val = b + t * BLOCKS;
+                    ptrs[b] = valloc.allocRaw(sizeof(val) + (rand() % 256));
+                    valloc.write(ptrs[b], &val, sizeof(val));
+                }
+            }
+            for (int b=0; b<BLOCKS; ++b)
+            {
+                if (ptrs[b])
+                    valloc.freeRaw(ptrs[b]);
+            }
+        }));
+    }
+
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads[t].join();
+        EXPECT_TRUE(ok[t]);
+    }
+}
+// Enough big pages for four cache shards, each caching regions of 16 kB (see VIRTMEM_CACHE_SHARDS)
+struct ShardProperties
+{
+    static const uint32_t smallPageCount = 4, smallPageSize = 64;
+    static const uint32_t mediumPageCount = 4, mediumPageSize = 256;
+    static const uint32_t bigPageCount = 64, bigPageSize = 1024;
+};
+
+TEST(ShardedCacheTest, RegionTest)
+{
+    typedef StdioVAllocP<ShardProperties> Alloc;
+    Alloc valloc(1024 * 256);
+    valloc.start();
+
+    const VirtPageCount pagecount = ShardProperties::bigPageCount;
+    const VirtPageSize pagesize = ShardProperties::bigPageSize;
+    const VPtrSize size = 1024 * 128; // more than fits in the cache
+    const VPtrNum vbuffer = valloc.allocRaw(size);
+    std::vector<char> buffer(size);
+    for (VPtrSize i=0; i<size; ++i)
+        buffer[i] = rand();
+
+    // odd sizes, so that some writes cross a region
+    const VPtrSize chunk = 700;
+    for (VPtrSize i=0; i<size; i+=chunk)
+        valloc.write(vbuffer + i, &buffer[i], private_utils::minimal(chunk, size - i));
+
+    valloc.clearPages();
+    EXPECT_EQ(valloc.getFreeBigPages(), pagecount);
+
+    std::vector<char> copy(size);
+    for (VPtrSize i=0; i<size; i+=chunk)
+        valloc.read(vbuffer + i, &copy[i], private_utils::minimal(chunk, size - i));
+    EXPECT_EQ(memcmp(&copy[0], &buffer[0], size), 0);
+
+    // data that crosses a region, read through a pointer and locked
+    const VPtrSize region = 1024 * 16;
+    for (VPtrNum p=((vbuffer / region) + 1) * region; (p + region) < (vbuffer + size); p+=region)
+    {
+        const VirtPageSize readsize = 700;
+        ASSERT_EQ(memcmp(valloc.read(p - 300, readsize), &buffer[p - 300 - vbuffer], readsize), 0);
+
+        VirtPageSize locksize = pagesize;
+        char *data = (char *)valloc.makeFittingLock(p - 500, locksize, false);
+        ASSERT_EQ(locksize, pagesize);
+        EXPECT_EQ(memcmp(data, &buffer[p - 500 - vbuffer], locksize), 0);
+        memset(data, 'x', locksize);
+        memset(&buffer[p - 500 - vbuffer], 'x', locksize);
+        valloc.releaseLock(p - 500);
+    }
+
+    valloc.clearPages();
+    EXPECT_EQ(valloc.getFreeBigPages(), pagecount);
+    for (VPtrSize i=0; i<size; i+=pagesize)
+        ASSERT_EQ(memcmp(valloc.read(vbuffer + i, pagesize), &buffer[i], pagesize), 0);
+
+    valloc.stop();
+}
+
+TEST(ShardedCacheTest, ThreadTest)
+{
+    typedef StdioVAllocP<ShardProperties> Alloc;
+    enum { THREADS = 4, SIZE = 1024 * 64, ROUNDS = 20000 };
+    Alloc valloc(1024 * 512);
+    valloc.start();
+
+    // all threads use the same buffer, each updates its own bytes of it
+    std::vector<char> buffer(SIZE);
+    for (int i=0; i<SIZE; ++i)
+        buffer[i] = rand();
+    const VPtrNum vbuffer = valloc.allocRaw(SIZE);
+    for (int i=0; i<SIZE; i+=1024)
+        valloc.write(vbuffer + i, &buffer[i], 1024);
+
+    bool ok[THREADS];
+    std::vector<std::thread> threads;
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads.push_back(std::thread([&valloc, &buffer, vbuffer, t, &ok] {
+            ok[t] = true;
+            for (int i=0; i<ROUNDS && ok[t]; ++i)
+            {
+                const int index = ((rand() % (SIZE / THREADS)) * THREADS) + t;
+                char c;
+                if (rand() % 2)
+                {
+                    valloc.read(vbuffer + index, &c, 1);
+                    ok[t] = (c == buffer[index]);
+                }
+                else
+                {
+                    c = buffer[index] = rand();
+                    valloc.write(vbuffer + index, &c, 1);
+                }
+
+                // larger reads that may cross regions of other shards
+                if ((i % 64) == 0)
+                {
+                    const int start = rand() % (SIZE - 1024);
+                    char data[1024];
+                    valloc.read(vbuffer + start, data, sizeof(data));
+                    for (int j=t-(start%THREADS); j<(int)sizeof(data) && ok[t]; j+=THREADS)
+                        ok[t] = (j < 0 || data[j] == buffer[start + j]);
+                }
+            }
+        }));
+    }
+
+    for (int t=0; t<THREADS; ++t)
+    {
+        threads[t].join();
+        EXPECT_TRUE(ok[t]);
+    }
+
+    valloc.clearPages();
+    for (int i=0; i<SIZE; i+=1024)
+        ASSERT_EQ(memcmp(valloc.read(vbuffer + i, 1024), &buffer[i], 1024), 0);
+    valloc.stop();
+}
+#endif
@@ -0,0 +1,540 @@
+#include "virtmem.h"
+#include "alloc/stdio_alloc.h"
+#include "test.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace {
+
+struct EngineProperties
+{
+    static const uint8_t smallPageCount = 2, smallPageSize = 32;
+    static const uint8_t mediumPageCount = 2, mediumPageSize = 64;
+    static const uint8_t bigPageCount = 4;
+    static const uint16_t bigPageSize = 256;
+};
+
+struct SlabProperties : EngineProperties { typedef SlabAllocEngine<32, 1024> AllocEngine; };
+struct TinySlabProperties : EngineProperties { typedef SlabAllocEngine<32, 1024, 4> AllocEngine; };
+struct TLSFProperties : EngineProperties { typedef TLSFAllocEngine<4, 1024> AllocEngine; };
+
+template <typename TA> class EngineFixture: public ::testing::Test
+{
+protected:
+    TA valloc;
+
+public:
+    void SetUp(void) { valloc.start(); }
+    void TearDown(void) { valloc.stop(); }
+};
+
+typedef ::testing::Types<CountingVAllocP<EngineProperties>, CountingVAllocP<SlabProperties>,
+                         CountingVAllocP<TinySlabProperties>, CountingVAllocP<TLSFProperties> > EngineTypes;
+TYPED_TEST_CASE(EngineFixture, EngineTypes);
+
+}
+
+TYPED_TEST(EngineFixture, RandomAllocTest)
+{
+    // live blocks: start --> (size, fill value)
+    std::map<VPtrNum, std::pair<VPtrSize, char> > blocks;
+
+    for (int i=0; i<3000; ++i)
+    {
+        if (blocks.empty() || (rand() % 3))
+        {
+            const VPtrSize size = (rand() % 8) ? (1 + rand() % 200) : (1 + rand() % 3000);
+            const VPtrNum p = this->valloc.allocRaw(size);
+            ASSERT_NE(p, 0u);
+
+            // no overlap with other blocks
+            typename std::map<VPtrNum, std::pair<VPtrSize, char> >::iterator it = blocks.lower_bound(p);
+            if (it != blocks.end())
+            {
+                ASSERT_LE(p + size, it->first);
+            }
+            if (it != blocks.begin())
+            {
+                --it;
+                ASSERT_LE(it->first + it->second.first, p);
+            }
+
+            const char val = i;
+            for (VPtrSize j=0; j<size; ++j)
+                this->valloc.write(p + j, &val, 1);
+            blocks[p] = std::make_pair(size, val);
+        }
+        else
+        {
+            typename std::map<VPtrNum, std::pair<VPtrSize, char> >::iterator it = blocks.begin();
+            std::advance(it, rand() % blocks.size());
+            for (VPtrSize j=0; j<it->second.first; j+=7)
+                ASSERT_EQ(*(char *)this->valloc.read(it->first + j, 1), it->second.second);
+            this->valloc.freeRaw(it->first);
+            blocks.erase(it);
+        }
+    }
+}
+
+TYPED_TEST(EngineFixture, ReallocTest)
+{
+    // live blocks: start --> (size, fill value)
+    std::map<VPtrNum, std::pair<VPtrSize, char> > blocks;
+
+    for (int i=0; i<2000; ++i)
+    {
+        const VPtrSize size = (rand() % 8) ? (1 + rand() % 200) : (1 + rand() % 3000);
+        const char val = i;
+
+        if (blocks.size() < 20)
+        {
+            const VPtrNum p = this->valloc.allocRaw(size);
+            ASSERT_NE(p, 0u);
+            for (VPtrSize j=0; j<size; ++j)
+                this->valloc.write(p + j, &val, 1);
+            blocks[p] = std::make_pair(size, val);
+        }
+        else
+        {
+            typename std::map<VPtrNum, std::pair<VPtrSize, char> >::iterator it = blocks.begin();
+            std::advance(it, rand() % blocks.size());
+            const std::pair<VPtrSize, char> old = it->second;
+
+            const VPtrNum p = this->valloc.reallocRaw(it->first, size);
+            ASSERT_NE(p, 0u);
+            blocks.erase(it);
+
+            // contents are kept
+            for (VPtrSize j=0; j<private_utils::minimal(size, old.first); ++j)
+                ASSERT_EQ(*(char *)this->valloc.read(p + j, 1), old.second);
+
+            for (VPtrSize j=0; j<size; ++j)
+                this->valloc.write(p + j, &val, 1);
+            blocks[p] = std::make_pair(size, val);
+        }
+    }
+
+    // no overlap between blocks
+    for (typename std::map<VPtrNum, std::pair<VPtrSize, char> >::iterator it=blocks.begin(); it!=blocks.end(); ++it)
+    {
+        for (VPtrSize j=0; j<it->second.first; ++j)
+            ASSERT_EQ(*(char *)this->valloc.read(it->first + j, 1), it->second.second);
+    }
+}
+
+TYPED_TEST(EngineFixture, ReallocInPlaceTest)
+{
+    const VPtrNum p = this->valloc.allocRaw(2000);
+    ASSERT_NE(p, 0u);
+    const char val = 55;
+    this->valloc.write(p + 999, &val, 1);
+    this->valloc.write(p + 1999, &val, 1);
+
+    // the last block can grow, any block can shrink
+    EXPECT_EQ(this->valloc.reallocRaw(p, 3000), p);
+    EXPECT_EQ(*(char *)this->valloc.read(p + 1999, 1), val);
+    EXPECT_EQ(this->valloc.reallocRaw(p, 1000), p);
+    EXPECT_EQ(*(char *)this->valloc.read(p + 999, 1), val);
+}
+
+TYPED_TEST(EngineFixture, BatchTest)
+{
+    enum { COUNT = 100, SIZE = 24 };
+    VPtrNum ptrs[COUNT];
+
+    for (int round=0; round<3; ++round)
+    {
+        ASSERT_TRUE(this->valloc.allocRawBatch(COUNT, SIZE, ptrs));
+
+        std::map<VPtrNum, int> blocks;
+        for (int i=0; i<COUNT; ++i)
+        {
+            ASSERT_NE(ptrs[i], 0u);
+            this->valloc.write(ptrs[i], &i, sizeof(i));
+            this->valloc.write(ptrs[i] + SIZE - sizeof(i), &i, sizeof(i));
+            blocks[ptrs[i]] = i;
+        }
+
+        // no overlap
+        for (std::map<VPtrNum, int>::iterator it=blocks.begin(), next=it; ++next!=blocks.end(); it=next)
+            ASSERT_LE(it->first + SIZE, next->first);
+        for (int i=0; i<COUNT; ++i)
+        {
+            EXPECT_EQ(*(int *)this->valloc.read(ptrs[i], sizeof(int)), i);
+            EXPECT_EQ(*(int *)this->valloc.read(ptrs[i] + SIZE - sizeof(i), sizeof(int)), i);
+        }
+
+        // mix with regular allocations
+        const VPtrNum p = this->valloc.allocRaw(SIZE * 2);
+        std::random_shuffle(ptrs, ptrs + COUNT);
+        this->valloc.freeRawBatch(ptrs, COUNT);
+        this->valloc.freeRaw(p);
+    }
+
+    // typed interface
+    typename TypeParam::template TVPtr<int>::type vptrs[COUNT];
+    ASSERT_TRUE(this->valloc.allocBatch(COUNT, sizeof(int), vptrs));
+    for (int i=0; i<COUNT; ++i)
+        *vptrs[i] = i;
+    for (int i=0; i<COUNT; ++i)
+        EXPECT_EQ(*vptrs[i], i);
+    this->valloc.freeBatch(vptrs, COUNT);
+    EXPECT_EQ(vptrs[0], NILL);
+    EXPECT_EQ(vptrs[COUNT - 1], NILL);
+}
+
+TEST(BatchTest, SortedFreeTest)
+{
+    enum { COUNT = 256, SIZE = 100 };
+    CountingVAllocP<EngineProperties> valloc;
+    valloc.start();
+
+    // every other block stays, so the free list does not collapse while the batch is freed
+    typedef CountingVAllocP<EngineProperties>::TVPtr<char>::type CharVPtr;
+    CharVPtr keep[COUNT], vptrs[COUNT];
+    VPtrNum ptrs[COUNT];
+    std::vector<int> order(COUNT);
+    for (int i=0; i<COUNT; ++i)
+        order[i] = i;
+    std::random_shuffle(order.begin(), order.end());
+
+    VPtrSize reads[2];
+    for (int round=0; round<2; ++round)
+    {
+        for (int i=0; i<COUNT; ++i)
+        {
+            vptrs[i] = valloc.alloc<char>(SIZE);
+            keep[i] = valloc.alloc<char>(SIZE);
+        }
+        for (int i=0; i<COUNT; ++i)
+            ptrs[i] = vptrs[order[i]].getRawNum();
+        for (int i=0; i<COUNT; ++i)
+            vptrs[i].setRawNum(ptrs[i]);
+
+        valloc.clearPages();
+        const VPtrSize r = valloc.reads;
+        if (round == 0)
+            valloc.freeRawBatch(ptrs, COUNT);
+        else
+            valloc.freeBatch(vptrs, COUNT); // sorted as a whole, not per chunk
+        reads[round] = valloc.reads - r;
+        valloc.freeBatch(keep, COUNT);
+    }
+
+    EXPECT_LE(reads[1], reads[0] + reads[0] / 4);
+    valloc.stop();
+}
+
+TYPED_TEST(EngineFixture, GrowTest)
+{
+    const VPtrSize maxsize = 1024 * 1024;
+    this->valloc.stop();
+    this->valloc.setPoolSize(1024 * 16);
+    this->valloc.setMaxPoolSize(maxsize);
+    this->valloc.start();
+
+    // use most of the maximum size
+    std::vector<VPtrNum> ptrs;
+    for (VPtrSize i=0; i<800; ++i)
+    {
+        const VPtrNum p = this->valloc.allocRaw(1000);
+        ASSERT_NE(p, 0u);
+        this->valloc.write(p, &i, sizeof(i));
+        ptrs.push_back(p);
+    }
+
+    EXPECT_GT(this->valloc.getPoolSize(), 800u * 1000);
+    EXPECT_LE(this->valloc.getPoolSize(), maxsize);
+    for (VPtrSize i=0; i<ptrs.size(); ++i)
+        ASSERT_EQ(*(VPtrSize *)this->valloc.read(ptrs[i], sizeof(i)), i);
+}
+
+TYPED_TEST(EngineFixture, TrimTest)
+{
+    const VPtrSize pagesize = EngineProperties::bigPageSize, size = pagesize * 16;
+    const std::vector<char> data(pagesize, 1);
+    const VPtrNum p = this->valloc.allocRaw(size);
+    ASSERT_NE(p, 0u);
+    for (VPtrSize i=0; i<size; i+=pagesize)
+        this->valloc.write(p + i, &data[0], pagesize);
+
+    this->valloc.freeRaw(p);
+    EXPECT_GE(this->valloc.trimmed, size - pagesize * 2);
+
+    // trimmed memory can be re-used
+    const VPtrNum p2 = this->valloc.allocRaw(size);
+    ASSERT_NE(p2, 0u);
+    this->valloc.write(p2 + size - 1, &data[0], 1);
+    this->valloc.clearPages();
+    EXPECT_EQ(*(char *)this->valloc.read(p2 + size - 1, 1), 1);
+}
+
+TYPED_TEST(EngineFixture, NearTest)
+{
+    enum { COUNT = 300, SMALL_SIZE = 24, LARGE_SIZE = 200, HINT = 150 };
+    VPtrNum ptrs[COUNT];
+
+    // fragment the pool with holes everywhere
+    for (int i=0; i<COUNT; ++i)
+    {
+        ptrs[i] = this->valloc.allocRaw((i % 2) ? LARGE_SIZE : SMALL_SIZE);
+        ASSERT_NE(ptrs[i], 0u);
+        this->valloc.write(ptrs[i], &i, sizeof(i));
+    }
+    for (int i=0; i<COUNT; ++i)
+    {
+        if ((i % 6) == 2 || i == (HINT + 1))
+        {
+            this->valloc.freeRaw(ptrs[i]);
+            ptrs[i] = 0;
+        }
+    }
+
+    const VPtrNum hint = ptrs[HINT];
+    const VPtrNum p = this->valloc.allocRawNear(hint, SMALL_SIZE);
+    ASSERT_NE(p, 0u);
+    EXPECT_LT((p > hint) ? (p - hint) : (hint - p), 1024u);
+    const int val = -1;
+    this->valloc.write(p, &val, sizeof(val));
+    this->valloc.write(p + SMALL_SIZE - sizeof(val), &val, sizeof(val));
+
+    // without hint or memory nearby the block is allocated elsewhere
+    const VPtrNum p2 = this->valloc.allocRawNear(0, SMALL_SIZE), p3 = this->valloc.allocRawNear(hint, 4000);
+    EXPECT_NE(p2, 0u);
+    EXPECT_NE(p3, 0u);
+
+    for (int i=0; i<COUNT; ++i)
+    {
+        if (ptrs[i])
+        {
+            ASSERT_EQ(*(int *)this->valloc.read(ptrs[i], sizeof(int)), i);
+        }
+    }
+    EXPECT_EQ(*(int *)this->valloc.read(p, sizeof(int)), val);
+
+    // typed interface
+    typename TypeParam::template TVPtr<int>::type vptr = this->valloc.template alloc<int>();
+    typename TypeParam::template TVPtr<int>::type near = this->valloc.template allocNear<int>(vptr);
+    typename TypeParam::Cluster cluster(this->valloc, near);
+    typename TypeParam::template TVPtr<int>::type clustered[10];
+    for (int i=0; i<10; ++i)
+    {
+        clustered[i] = cluster.template alloc<int>();
+        *clustered[i] = i;
+    }
+    for (int i=0; i<10; ++i)
+        EXPECT_EQ(*clustered[i], i);
+    EXPECT_NE(near, NILL);
+}
+
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+// NOTE: without header cache, freeing a block may swap out the pages of its data
+TEST(TrimPoolTest, NoWriteBackTest)
+{
+    CountingVAllocP<EngineProperties> valloc;
+    valloc.start();
+
+    const VPtrSize pagesize = EngineProperties::bigPageSize, size = pagesize * 16;
+    const std::vector<char> data(pagesize, 1);
+    const VPtrNum p = valloc.allocRaw(size);
+    for (VPtrSize i=0; i<size; i+=pagesize)
+        valloc.write(p + i, &data[0], pagesize);
+
+    // cached pages of freed memory are dropped without writing them
+    const VPtrSize written = valloc.written;
+    valloc.freeRaw(p);
+    valloc.clearPages();
+    EXPECT_LE(valloc.written - written, pagesize * 2);
+
+    valloc.stop();
+}
+#endif
+
+TEST(SlabEngineTest, FaultFreeTest)
+{
+    CountingVAllocP<SlabProperties> valloc;
+    valloc.start();
+
+    std::vector<VPtrNum> ptrs;
+    for (int i=0; i<200; ++i)
+        ptrs.push_back(valloc.allocRaw(1 + (i % 512)));
+    for (int i=0; i<200; i+=2)
+        valloc.freeRaw(ptrs[i]);
+    for (int i=0; i<100; ++i)
+        EXPECT_NE(valloc.allocRaw(1 + (i % 512)), 0u);
+
+    // small blocks are managed in RAM
+    EXPECT_EQ(valloc.accesses, 0u);
+
+    valloc.stop();
+}
+
+TEST(SlabEngineTest, ReuseTest)
+{
+    CountingVAllocP<SlabProperties> valloc;
+    valloc.start();
+
+    // freed memory is re-used, also for other sizes
+    for (int i=0; i<100; ++i)
+    {
+        std::vector<VPtrNum> ptrs;
+        for (int j=0; j<50; ++j)
+        {
+            ptrs.push_back(valloc.allocRaw((i % 2) ? 16 : 2000));
+            ASSERT_NE(ptrs.back(), 0u);
+        }
+        for (int j=0; j<50; ++j)
+            valloc.freeRaw(ptrs[j]);
+    }
+
+    valloc.stop();
+}
+
+TEST(SlabEngineTest, TinyBlockTest)
+{
+    CountingVAllocP<TinySlabProperties> valloc;
+    valloc.start();
+
+    // tiny blocks have no header and are packed next to each other
+    std::vector<VPtrNum> ptrs;
+    for (int i=0; i<100; ++i)
+    {
+        ptrs.push_back(valloc.allocRaw(sizeof(int)));
+        valloc.write(ptrs.back(), &i, sizeof(i));
+    }
+    std::sort(ptrs.begin(), ptrs.end());
+    EXPECT_LT(ptrs.back() - ptrs.front(), 1024u);
+    for (int i=1; i<100; ++i)
+        EXPECT_GE(ptrs[i] - ptrs[i-1], sizeof(int));
+
+    ptrs.push_back(valloc.allocRaw(12)); // 16 byte class
+    EXPECT_EQ(ptrs.back() % 16, 0u);
+
+    valloc.stop();
+}
+
+TEST(SlabEngineTest, BestFitTest)
+{
+    CountingVAllocP<SlabProperties> valloc;
+    valloc.start();
+
+    // free blocks of the same bin, separated by used blocks
+    const VPtrSize sizes[3] = { 2100, 3000, 2200 };
+    VPtrNum ptrs[3], used[3];
+    for (int i=0; i<3; ++i)
+    {
+        ptrs[i] = valloc.allocRaw(sizes[i]);
+        used[i] = valloc.allocRaw(1000);
+    }
+    for (int i=0; i<3; ++i)
+        valloc.freeRaw(ptrs[i]);
+
+    // the whole bin is searched, not just its first block
+    EXPECT_EQ(valloc.allocRaw(2100), ptrs[0]);
+    EXPECT_EQ(valloc.allocRaw(2150), ptrs[2]);
+
+    for (int i=0; i<3; ++i)
+        valloc.freeRaw(used[i]);
+    valloc.stop();
+}
+
+TEST(SlabEngineTest, CoalesceTest)
+{
+    CountingVAllocP<SlabProperties> valloc;
+    valloc.start();
+
+    // fill the complete pool with large blocks
+    std::vector<VPtrNum> ptrs;
+    VPtrNum p;
+    while ((p = valloc.allocRaw(1000)) != 0)
+        ptrs.push_back(p);
+    ASSERT_GT(ptrs.size(), 500u);
+
+    // free in mixed order, so blocks are merged with both neighbours
+    for (size_t i=0; i<ptrs.size(); i+=2)
+        valloc.freeRaw(ptrs[i]);
+    for (size_t i=1; i<ptrs.size(); i+=2)
+        valloc.freeRaw(ptrs[i]);
+
+    // all memory is available as a single block again
+    p = valloc.allocRaw(ptrs.size() * 900);
+    EXPECT_NE(p, 0u);
+    valloc.freeRaw(p);
+
+    valloc.stop();
+}
+
+TEST(TLSFEngineTest, CoalesceTest)
+{
+    CountingVAllocP<TLSFProperties> valloc;
+    valloc.start();
+
+    // fill the complete pool
+    std::vector<VPtrNum> ptrs;
+    VPtrNum p;
+    while ((p = valloc.allocRaw(1000)) != 0)
+        ptrs.push_back(p);
+    ASSERT_GT(ptrs.size(), 500u);
+
+    // free in mixed order, so blocks are merged with both neighbours
+    for (size_t i=0; i<ptrs.size(); i+=2)
+        valloc.freeRaw(ptrs[i]);
+    for (size_t i=1; i<ptrs.size(); i+=2)
+        valloc.freeRaw(ptrs[i]);
+
+    // all memory is available as a single block again
+    p = valloc.allocRaw(ptrs.size() * 900);
+    EXPECT_NE(p, 0u);
+    valloc.freeRaw(p);
+
+    valloc.stop();
+}
+
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+TEST(HeaderCacheTest, NoPageAccessTest)
+{
+    CountingVAllocP<EngineProperties> valloc;
+    valloc.start();
+
+    std::vector<VPtrNum> ptrs;
+    for (int i=0; i<50; ++i)
+        ptrs.push_back(valloc.allocRaw(16));
+    for (int i=0; i<50; i+=2)
+        valloc.freeRaw(ptrs[i]);
+    for (int i=0; i<25; ++i)
+        valloc.allocRaw(16);
+    EXPECT_EQ(valloc.accesses, 0u); // all headers are in RAM
+
+    // headers are written by flush()
+    valloc.flush();
+    EXPECT_GT(valloc.accesses, 0u);
+
+    valloc.stop();
+}
+#endif
+
+#if VIRTMEM_ZERO_MAP_SIZE > 0
+TEST(ZeroMapTest, NoReadTest)
+{
+    CountingVAllocP<EngineProperties> valloc;
+    valloc.start();
+
+    // fresh memory is never read from the pool
+    const VPtrNum p = valloc.allocRaw(64 * 1024);
+    ASSERT_NE(p, 0u);
+    for (VPtrSize i=0; i<64*1024; i+=100)
+        EXPECT_EQ(*(const char *)valloc.read(p + i, 1), 0);
+    EXPECT_EQ(valloc.reads, 0u);
+
+    // written data is read from the pool
+    const char val = 55;
+    valloc.write(p + 1000, &val, sizeof(val));
+    valloc.clearPages();
+    EXPECT_EQ(*(const char *)valloc.read(p + 1000, sizeof(val)), val);
+    EXPECT_GT(valloc.reads, 0u);
+
+    valloc.stop();
+}
+#endif
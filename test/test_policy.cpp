@@ -0,0 +1,409 @@
+#include "virtmem.h"
+#include "alloc/stdio_alloc.h"
+#include "test.h"
+
+#include <vector>
+
+namespace {
+
+struct PolicyProperties
+{
+    static const uint8_t smallPageCount = 2, smallPageSize = 32;
+    static const uint8_t mediumPageCount = 2, mediumPageSize = 64;
+    static const uint8_t bigPageCount = 4;
+    static const uint16_t bigPageSize = 256;
+};
+
+struct LRUProperties : PolicyProperties { typedef LRUPagePolicy<bigPageCount> PagePolicy; };
+struct ClockProperties : PolicyProperties { typedef ClockPagePolicy<bigPageCount> PagePolicy; };
+struct TwoQueueProperties : PolicyProperties { typedef TwoQueuePagePolicy<bigPageCount> PagePolicy; };
+
+template <typename TA> struct PolicyTester
+{
+    TA valloc;
+    VPtrNum frames;
+
+    PolicyTester(void) : valloc(1024 * 64), frames(0) { }
+
+    void start(void)
+    {
+        valloc.start();
+        const VPtrNum p = valloc.allocRaw(PolicyProperties::bigPageSize * 64);
+        frames = p - (p % PolicyProperties::bigPageSize) + PolicyProperties::bigPageSize;
+        // memory that was never written is not read from the pool (see VIRTMEM_ZERO_MAP_SIZE)
+        const std::vector<char> data(PolicyProperties::bigPageSize, 1);
+        for (int i=0; i<64; ++i)
+            valloc.write(p + i * data.size(), &data[0], data.size());
+        valloc.clearPages();
+        valloc.reads = 0;
+        valloc.writes.clear();
+    }
+    void stop(void) { valloc.stop(); }
+
+    // start of a region (frame) that fits exactly in a big page
+    VPtrNum frame(int n) const { return frames + n * PolicyProperties::bigPageSize; }
+    void touch(int n) { valloc.read(frame(n), 1); }
+    void modify(int n)
+    {
+        const std::vector<char> data(PolicyProperties::bigPageSize, n);
+        valloc.write(frame(n), &data[0], data.size());
+    }
+};
+
+template <typename TA> class PolicyFixture: public ::testing::Test, public PolicyTester<TA>
+{
+public:
+    void SetUp(void) { this->start(); }
+    void TearDown(void) { this->stop(); }
+};
+
+typedef ::testing::Types<CountingVAllocP<DefaultAllocProperties>, CountingVAllocP<PolicyProperties>,
+                         CountingVAllocP<LRUProperties>, CountingVAllocP<ClockProperties>,
+                         CountingVAllocP<TwoQueueProperties> > PolicyTypes;
+TYPED_TEST_CASE(PolicyFixture, PolicyTypes);
+
+}
+
+TYPED_TEST(PolicyFixture, RandomDataTest)
+{
+    const VPtrSize size = PolicyProperties::bigPageSize * 32;
+    std::vector<char> buffer(size);
+    const VPtrNum vbuffer = this->frame(0) + 3;
+
+    for (VPtrSize i=0; i<size; ++i)
+    {
+        buffer[i] = rand();
+        this->valloc.write(vbuffer + i, &buffer[i], 1);
+    }
+
+    for (int i=0; i<2000; ++i)
+    {
+        const VPtrSize index = rand() % (size - sizeof(int));
+        if (rand() % 4)
+            ASSERT_EQ(memcmp(this->valloc.read(vbuffer + index, sizeof(int)), &buffer[index], sizeof(int)), 0);
+        else
+        {
+            buffer[index] = rand();
+            this->valloc.write(vbuffer + index, &buffer[index], 1);
+        }
+
+        // mix in some locks, which temporarily take pages from the cache
+        if ((i % 50) == 0)
+        {
+            char *data = (char *)this->valloc.makeDataLock(vbuffer + index, PolicyProperties::bigPageSize, true);
+            ASSERT_EQ(memcmp(data, &buffer[index], private_utils::minimal(size - index, (VPtrSize)PolicyProperties::bigPageSize)), 0);
+            this->valloc.releaseLock(vbuffer + index);
+        }
+    }
+
+    this->valloc.clearPages();
+    for (VPtrSize i=0; i<size; ++i)
+        ASSERT_EQ(*(char *)this->valloc.read(vbuffer + i, 1), buffer[i]);
+}
+
+template <typename TA> class WriteBackFixture: public PolicyFixture<TA> { };
+typedef ::testing::Types<CountingVAllocP<PolicyProperties>, CountingVAllocP<LRUProperties>,
+                         CountingVAllocP<ClockProperties>, CountingVAllocP<TwoQueueProperties> > WriteBackTypes;
+TYPED_TEST_CASE(WriteBackFixture, WriteBackTypes);
+
+TYPED_TEST(WriteBackFixture, FlushOrderTest)
+{
+    const int frames[] = { 2, 0, 3, 1 };
+    for (int i=0; i<4; ++i)
+        this->modify(frames[i]);
+
+    this->valloc.flush();
+    ASSERT_EQ(this->valloc.writes.size(), 4u);
+    for (int i=0; i<4; ++i)
+        EXPECT_EQ(this->valloc.writes[i].first, this->frame(i));
+}
+
+TYPED_TEST(WriteBackFixture, MergedWriteTest)
+{
+    // pages are taken in order, so both their frames and pools are adjacent
+    for (int i=0; i<4; ++i)
+        this->modify(i);
+
+    this->valloc.clearPages();
+    ASSERT_EQ(this->valloc.writes.size(), 1u);
+    EXPECT_EQ(this->valloc.writes[0].first, this->frame(0));
+    EXPECT_EQ(this->valloc.writes[0].second, (VPtrSize)PolicyProperties::bigPageSize * 4);
+
+    // pages that are swapped out are written together with their adjacent dirty neighbours
+    for (int i=0; i<4; ++i)
+        this->modify(i);
+    this->valloc.writes.clear();
+    this->touch(5);
+    ASSERT_EQ(this->valloc.writes.size(), 1u);
+    EXPECT_EQ(this->valloc.writes[0].second, (VPtrSize)PolicyProperties::bigPageSize * 4);
+    this->valloc.flush();
+    EXPECT_EQ(this->valloc.writes.size(), 1u); // nothing left
+}
+
+TYPED_TEST(WriteBackFixture, DirtyRangeTest)
+{
+    const char c = 'a';
+    this->touch(0);
+    this->valloc.write(this->frame(0) + 10, &c, 1);
+    this->valloc.write(this->frame(0) + 20, &c, 1);
+    this->valloc.flush();
+    ASSERT_EQ(this->valloc.writes.size(), 1u);
+    EXPECT_EQ(this->valloc.writes[0].first, this->frame(0) + 10);
+    EXPECT_EQ(this->valloc.writes[0].second, 11u);
+
+    // small changes in adjacent pages are not merged
+    this->touch(1);
+    this->valloc.write(this->frame(1) - 1, &c, 1);
+    this->valloc.write(this->frame(1) + 1, &c, 1);
+    this->valloc.writes.clear();
+    this->valloc.clearPages();
+    ASSERT_EQ(this->valloc.writes.size(), 2u);
+    EXPECT_EQ(this->valloc.writes[0].first, this->frame(1) - 1);
+    EXPECT_EQ(this->valloc.writes[0].second, 1u);
+    EXPECT_EQ(this->valloc.writes[1].first, this->frame(1) + 1);
+    EXPECT_EQ(this->valloc.writes[1].second, 1u);
+
+    // locked data: only write what was changed through the allocator
+    const VPtrNum lockp = this->frame(4) + 10;
+    this->valloc.makeDataLock(lockp, PolicyProperties::mediumPageSize, true);
+    this->valloc.write(lockp + 5, &c, 1);
+    this->valloc.releaseLock(lockp);
+    this->valloc.writes.clear();
+    // lock with different size, so the old lock is synchronized and removed
+    this->valloc.makeDataLock(lockp, PolicyProperties::smallPageSize, true);
+    this->valloc.releaseLock(lockp);
+    this->valloc.clearPages();
+    ASSERT_FALSE(this->valloc.writes.empty());
+    for (size_t i=0; i<this->valloc.writes.size(); ++i)
+        EXPECT_EQ(this->valloc.writes[i].second, 1u);
+    EXPECT_EQ(*(char *)this->valloc.read(lockp + 5, 1), c);
+}
+
+template <typename TA> class LRUFixture: public PolicyFixture<TA> { };
+typedef ::testing::Types<CountingVAllocP<LRUProperties>, CountingVAllocP<ClockProperties> > LRUTypes;
+TYPED_TEST_CASE(LRUFixture, LRUTypes);
+
+TYPED_TEST(LRUFixture, RecentPageTest)
+{
+    for (int i=0; i<4; ++i)
+        this->touch(i);
+    EXPECT_EQ(this->valloc.reads, 4u);
+
+    this->touch(0); // should not be evicted now
+    this->touch(4);
+    this->touch(0);
+    EXPECT_EQ(this->valloc.reads, 5u);
+}
+
+TEST(TwoQueuePolicyTest, ScanResistanceTest)
+{
+    PolicyTester<CountingVAllocP<TwoQueueProperties> > f2q;
+    f2q.start();
+    PolicyTester<CountingVAllocP<LRUProperties> > flru;
+    flru.start();
+
+    // hot page, which is evicted once and then used again
+    for (int i=0; i<5; ++i)
+    {
+        f2q.touch(i);
+        flru.touch(i);
+    }
+    f2q.touch(0);
+    flru.touch(0);
+
+    // one-off scan
+    for (int i=10; i<40; ++i)
+    {
+        f2q.touch(i);
+        flru.touch(i);
+    }
+
+    const VPtrSize reads2q = f2q.valloc.reads, readslru = flru.valloc.reads;
+    f2q.touch(0);
+    flru.touch(0);
+    EXPECT_EQ(f2q.valloc.reads, reads2q); // survived the scan
+    EXPECT_EQ(flru.valloc.reads, readslru + 1);
+
+    f2q.stop();
+    flru.stop();
+}
+
+#ifdef VIRTMEM_READ_AHEAD
+
+namespace {
+
+struct ReadAheadProperties : PolicyProperties
+{
+    static const uint8_t bigPageCount = 8;
+};
+
+class ReadAheadFixture: public ::testing::Test, public PolicyTester<CountingVAllocP<ReadAheadProperties> >
+{
+protected:
+    std::vector<char> buffer;
+
+public:
+    void SetUp(void)
+    {
+        start();
+        buffer.resize(PolicyProperties::bigPageSize * 32);
+        for (size_t i=0; i<buffer.size(); ++i)
+        {
+            buffer[i] = rand();
+            valloc.write(frame(0) + i, &buffer[i], 1);
+        }
+        valloc.clearPages();
+        valloc.reads = 0;
+#ifdef VIRTMEM_TRACE_STATS
+        valloc.resetStats();
+#endif
+    }
+    void TearDown(void) { stop(); }
+};
+
+}
+
+TEST_F(ReadAheadFixture, DisabledTest)
+{
+    for (size_t i=0; i<buffer.size(); ++i)
+        ASSERT_EQ(*(char *)valloc.read(frame(0) + i, 1), buffer[i]);
+    EXPECT_EQ(valloc.reads, 32u);
+}
+
+TEST_F(ReadAheadFixture, AscendingTest)
+{
+    valloc.setReadAhead(4);
+    for (size_t i=0; i<buffer.size(); ++i)
+        ASSERT_EQ(*(char *)valloc.read(frame(0) + i, 1), buffer[i]);
+
+    EXPECT_LT(valloc.reads, 16u);
+#ifdef VIRTMEM_TRACE_STATS
+    EXPECT_GT(valloc.getReadAheadHits(), 16u);
+    EXPECT_EQ(valloc.getWastedPrefetches(), 0u);
+#endif
+}
+
+#ifdef VIRTMEM_ALIGNED_PAGES
+// NOTE: without aligned pages, pages always start at the accessed data, so they don't follow each other when
+// data is accessed in descending order
+TEST_F(ReadAheadFixture, DescendingTest)
+{
+    valloc.setReadAhead(4);
+    for (size_t i=buffer.size(); i>0; --i)
+        ASSERT_EQ(*(char *)valloc.read(frame(0) + i - 1, 1), buffer[i - 1]);
+
+    EXPECT_LT(valloc.reads, 16u);
+#ifdef VIRTMEM_TRACE_STATS
+    EXPECT_GT(valloc.getReadAheadHits(), 16u);
+#endif
+}
+#endif
+
+TEST_F(ReadAheadFixture, MixedTest)
+{
+    valloc.setReadAhead(4);
+
+    // two interleaved streams, writes and random access
+    const VPtrSize half = buffer.size() / 2;
+    for (VPtrSize i=0; i<half; ++i)
+    {
+        ASSERT_EQ(*(char *)valloc.read(frame(0) + i, 1), buffer[i]);
+        buffer[buffer.size() - i - 1] = rand();
+        valloc.write(frame(0) + buffer.size() - i - 1, &buffer[buffer.size() - i - 1], 1);
+
+        if ((i % 100) == 0)
+        {
+            const VPtrSize index = rand() % buffer.size();
+            ASSERT_EQ(*(char *)valloc.read(frame(0) + index, 1), buffer[index]);
+        }
+    }
+
+    valloc.clearPages();
+    for (size_t i=0; i<buffer.size(); ++i)
+        ASSERT_EQ(*(char *)valloc.read(frame(0) + i, 1), buffer[i]);
+}
+
+#endif
+
+#ifdef VIRTMEM_ASYNC_IO
+
+namespace {
+
+template <typename TA> class AsyncIOFixture: public ::testing::Test, public PolicyTester<TA>
+{
+public:
+    void SetUp(void)
+    {
+        this->valloc.setAsyncIO(true);
+#ifdef VIRTMEM_READ_AHEAD
+        this->valloc.setReadAhead(2);
+#endif
+        this->start();
+    }
+    void TearDown(void) { this->stop(); }
+};
+
+TYPED_TEST_CASE(AsyncIOFixture, WriteBackTypes);
+
+}
+
+TYPED_TEST(AsyncIOFixture, DataTest)
+{
+    const VPtrSize size = PolicyProperties::bigPageSize * 32;
+    std::vector<char> buffer(size);
+    const VPtrNum vbuffer = this->frame(0) + 3;
+
+    for (VPtrSize i=0; i<size; ++i)
+    {
+        buffer[i] = rand();
+        this->valloc.write(vbuffer + i, &buffer[i], 1);
+    }
+
+    // sequential reads (loaded in the background if read-ahead is enabled) mixed with writes and locks
+    for (int n=0; n<3; ++n)
+    {
+        for (VPtrSize i=0; i<size; ++i)
+        {
+            ASSERT_EQ(*(char *)this->valloc.read(vbuffer + i, 1), buffer[i]);
+            if ((i % 64) == 0)
+            {
+                const VPtrSize index = rand() % size;
+                buffer[index] = rand();
+                this->valloc.write(vbuffer + index, &buffer[index], 1);
+            }
+            if ((i % 500) == 0)
+            {
+                const VPtrSize index = rand() % (size - PolicyProperties::bigPageSize);
+                char *data = (char *)this->valloc.makeDataLock(vbuffer + index, PolicyProperties::bigPageSize, true);
+                ASSERT_EQ(memcmp(data, &buffer[index], PolicyProperties::bigPageSize), 0);
+                this->valloc.releaseLock(vbuffer + index);
+            }
+        }
+    }
+
+    this->valloc.clearPages();
+    for (VPtrSize i=0; i<size; ++i)
+        ASSERT_EQ(*(char *)this->valloc.read(vbuffer + i, 1), buffer[i]);
+}
+
+TYPED_TEST(AsyncIOFixture, SyncTest)
+{
+    for (int i=0; i<8; ++i)
+        this->modify(i);
+
+    // dirty pages that were swapped out are written after a sync
+    this->valloc.sync();
+    VPtrSize written = 0;
+    for (size_t i=0; i<this->valloc.writes.size(); ++i)
+        written += this->valloc.writes[i].second;
+    EXPECT_GE(written, PolicyProperties::bigPageSize * 4u);
+
+    // flush waits for all writes
+    this->valloc.flush();
+    written = 0;
+    for (size_t i=0; i<this->valloc.writes.size(); ++i)
+        written += this->valloc.writes[i].second;
+    EXPECT_EQ(written, PolicyProperties::bigPageSize * 8u);
+}
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef VIRTMEM_MMAP_ALLOC_H
+#define VIRTMEM_MMAP_ALLOC_H
+
+/**
+  * @file
+  * @brief This file contains the memory mapped file virtual memory allocator
+  */
+
+#include "internal/alloc.h"
+#include "internal/utils.h"
+#include "config/config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace virtmem {
+
+/**
+ * @brief Virtual memory allocator that maps a regular file in memory (via `mmap()`) as memory pool.
+ *
+ * This class can only be used on systems supporting POSIX memory mapping (e.g. Linux and macOS). Unlike
+ * StdioVAllocP, data is not copied into *big* pages: these point directly into the mapped file (see
+ * BaseVAlloc::setMappedPool()), so that loading, locking and writing back pages does not cost any system
+ * calls or copies. The operating system loads and stores the data of the file as needed. Data that is read
+ * ahead (see BaseVAlloc::setReadAhead()) is requested with `madvise()`.
+ *
+ * The memory pool can grow on demand (see BaseVAlloc::setMaxPoolSize()), the file is mapped with its maximum
+ * size at start. Disk space of large freed memory blocks is released if supported by the OS. By default a
+ * temporary file is used, a named file is emptied unless the memory pool is persistent (see setFileName()).
+ *
+ * @tparam Properties Allocator properties, see DefaultAllocProperties
+ *
+ * @note Data obtained for reading only should not be modified (see BaseVAlloc::setMappedPool()).
+ * @sa @ref bUsing
+ */
+template <typename Properties = DefaultAllocProperties>
+class MmapVAllocP : public VAlloc<Properties, MmapVAllocP<Properties> >
+{
+    int fd;
+    uint8_t *mapping;
+    VPtrSize mapSize;
+    const char *fileName;
+
+    void doStart(void)
+    {
+        if (!fileName)
+        {
+            // the temporary file is already removed, the duplicated descriptor keeps it open
+            FILE *f = tmpfile();
+            fd = (f) ? dup(fileno(f)) : -1;
+            if (f)
+                fclose(f);
+        }
+        else
+            fd = open(fileName, O_RDWR | O_CREAT, 0644);
+
+        if (fd == -1)
+        {
+            fprintf(stderr, "Unable to open ram file!");
+            return;
+        }
+
+        VPtrSize fsize = 0;
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+            fsize = st.st_size;
+        if (fsize && !this->getPersistent() && ftruncate(fd, 0) == 0)
+            fsize = 0; // discard old data
+        if (fsize < this->getPoolSize() && ftruncate(fd, this->getPoolSize()) != 0)
+            fprintf(stderr, "didn't resize correctly: %s\n", strerror(errno));
+
+        // map the maximum pool size, so that the mapping never moves. Big pages at the end of the pool may
+        // extend beyond it.
+        mapSize = private_utils::maximal(private_utils::maximal(this->getPoolSize(), this->getMaxPoolSize()), fsize) +
+                  Properties::bigPageSize;
+        void *m = mmap(0, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (m == MAP_FAILED)
+            fprintf(stderr, "mmap error: %s\n", strerror(errno));
+        else
+        {
+            mapping = static_cast<uint8_t *>(m);
+            this->setMappedPool(mapping);
+        }
+    }
+
+    bool doGrow(VPtrSize newsize) { return ftruncate(fd, newsize) == 0; }
+
+    // Frees disk space of unused data. Elsewhere, only unused data at the end of the file is freed.
+    void doTrim(VPtrSize offset, VPtrSize size)
+    {
+#ifdef MADV_REMOVE
+        // frees both the memory and disk space, but only for whole pages of the OS
+        if ((offset % getOSPageSize()) == 0 && (size % getOSPageSize()) == 0 &&
+            madvise(mapping + offset, size, MADV_REMOVE) == 0)
+            return;
+#endif
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+            return;
+#endif
+        if ((offset + size) >= this->getPoolSize() && ftruncate(fd, offset) == 0 &&
+            ftruncate(fd, this->getPoolSize()) != 0)
+            fprintf(stderr, "didn't resize correctly: %s\n", strerror(errno)); // NOTE: the mapping is invalid past the end
+    }
+
+    void doFlush(void)
+    {
+        if (msync(mapping, this->getPoolSize(), MS_SYNC) != 0)
+            fprintf(stderr, "msync error: %s\n", strerror(errno));
+    }
+
+    void doPrefetch(VPtrSize offset, VPtrSize size)
+    {
+        const VPtrSize start = offset - (offset % getOSPageSize()); // madvise() requires an aligned address
+        madvise(mapping + start, size + (offset - start), MADV_WILLNEED);
+    }
+
+    void doSuspend(void) { }
+    void doStop(void)
+    {
+        if (mapping)
+        {
+            this->setMappedPool(0);
+            munmap(mapping, mapSize);
+            mapping = 0;
+        }
+        if (fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // NOTE: the data may be a page that points to the same memory
+    void doRead(void *data, VPtrSize offset, VPtrSize size) { memmove(data, mapping + offset, size); }
+    void doWrite(const void *data, VPtrSize offset, VPtrSize size) { memmove(mapping + offset, data, size); }
+
+    static VPtrSize getOSPageSize(void) { return sysconf(_SC_PAGESIZE); }
+
+public:
+    /**
+     * @brief Constructs (but not initializes) the allocator.
+     * @param ps Total amount of bytes of the memory pool.
+     * @sa setPoolSize
+     */
+    MmapVAllocP(VPtrSize ps=VIRTMEM_DEFAULT_POOLSIZE) : fd(-1), mapping(0), mapSize(0), fileName(0) { this->setPoolSize(ps); }
+    ~MmapVAllocP(void) { doStop(); }
+
+    /**
+     * @brief Uses a named file as memory pool.
+     *
+     * The file is created if it does not exist, and is kept when the allocator is stopped. Its data is
+     * discarded when the allocator is started, unless the memory pool is persistent (see
+     * BaseVAlloc::setPersistent()).
+     * @param name The path of the file, which should remain valid while the allocator is used. If zero (the
+     * default), a temporary file is used.
+     * @note This function should always be called before \ref start().
+     */
+    void setFileName(const char *name) { fileName = name; }
+};
+
+typedef MmapVAllocP<> MmapVAlloc; //!< Shortcut to MmapVAllocP with default template arguments
+
+}
+
+#endif // VIRTMEM_MMAP_ALLOC_H
@@ -10,6 +10,8 @@
 
 #include <SdFat.h>
 
+#include <string.h>
+
 namespace virtmem {
 
 /**
@@ -20,7 +22,10 @@ namespace virtmem {
  * and therefore has to be installed.
  *
  * When the allocator is initialized (i.e. by calling start()) it will create a file called
- * 'ramfile.vm' in the root directory. Existing files will be reused and resized if necessary.
+ * 'ramfile.vm' in the root directory. Existing files will be reused and emptied, unless the memory pool is
+ * persistent (see BaseVAlloc::setPersistent()). The file grows when data beyond its end is written, hence,
+ * initializing does not depend on the size of the memory pool. For the same reason, the memory pool can grow
+ * on demand (see BaseVAlloc::setMaxPoolSize()).
  *
  * @tparam Properties Allocator properties, see DefaultAllocProperties
  *
@@ -35,21 +40,12 @@ class SDVAllocP : public VAlloc<Properties, SDVAllocP<Properties> >
 
     void doStart(void)
     {
-        // file does not exist yet (can we create it)?
-        if (sdFile.open("ramfile.vm", O_CREAT | O_EXCL))
-            this->writeZeros(0, this->getPoolSize()); // make it the right size
-        else // already exists, check size
+        // NOTE: the file is extended when needed by doWrite(), so that data beyond its end is zero
+        if (!sdFile.open("ramfile.vm", O_CREAT | O_RDWR) || (!this->getPersistent() && !sdFile.truncate(0)))
         {
-            if (!sdFile.open("ramfile.vm", O_CREAT | O_RDWR))
-            {
-                Serial.println("opening ram file failed");
-                while (true)
-                    ;
-            }
-
-            const uint32_t size = sdFile.fileSize();
-            if (size < this->getPoolSize())
-                this->writeZeros(size, this->getPoolSize() - size);
+            Serial.println("opening ram file failed");
+            while (true)
+                ;
         }
     }
 
@@ -57,17 +53,48 @@ class SDVAllocP : public VAlloc<Properties, SDVAllocP<Properties> >
     {
         sdFile.close();
     }
+    void doFlush(void) { sdFile.sync(); }
     void doRead(void *data, VPtrSize offset, VPtrSize size)
     {
 //        const uint32_t t = micros();
+        // data beyond the end of the file was never written
+        const uint32_t fsize = sdFile.fileSize();
+        if ((offset + size) > fsize)
+        {
+            const VPtrSize avail = (offset < fsize) ? (fsize - offset) : 0;
+            memset((uint8_t *)data + avail, 0, size - avail);
+            size = avail;
+        }
+        if (!size)
+            return;
+
         sdFile.seekSet(offset);
         sdFile.read(data, size);
 //        Serial.print("read: "); Serial.print(size); Serial.print("/"); Serial.println(micros() - t);
     }
 
+    bool doGrow(VPtrSize) { return true; } // the file already grows when written
+
+    void doTrim(VPtrSize offset, VPtrSize size)
+    {
+        // unused data at the end of the file is removed, doWrite() extends the file again if needed
+        if ((offset + size) >= sdFile.fileSize())
+            sdFile.truncate(offset);
+    }
+
     void doWrite(const void *data, VPtrSize offset, VPtrSize size)
     {
 //        const uint32_t t = micros();
+        // fill any gap after the end of the file
+        const uint32_t fsize = sdFile.fileSize();
+        if (offset > fsize)
+        {
+            static const uint8_t zeros[32] = { 0 };
+            sdFile.seekSet(fsize);
+            for (VPtrSize i=fsize; i<offset; i+=sizeof(zeros))
+                sdFile.write(zeros, private_utils::minimal((VPtrSize)sizeof(zeros), offset - i));
+        }
+
         sdFile.seekSet(offset);
         sdFile.write(data, size);
 //        Serial.print("write: "); Serial.print(size); Serial.print("/"); Serial.println(micros() - t);
@@ -13,12 +13,25 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#endif
+
 namespace virtmem {
 
 /**
  * @brief Virtual memory allocator that uses a regular file (via stdio) as memory pool.
  *
  * This class is meant for debugging and can only be used on systems supporting stdio (e.g. PCs).
+ * The memory pool can grow on demand (see BaseVAlloc::setMaxPoolSize()). Disk space of large freed memory
+ * blocks is released if supported by the OS. By default a temporary file is used, a named file can be kept
+ * and reopened (see setFileName()).
  *
  * @tparam Properties Allocator properties, see DefaultAllocProperties
  *
@@ -28,20 +41,78 @@ template <typename Properties = DefaultAllocProperties>
 class StdioVAllocP : public VAlloc<Properties, StdioVAllocP<Properties> >
 {
     FILE *ramFile;
+    const char *fileName;
 
     void doStart(void)
     {
-        ramFile = tmpfile();
+        VPtrSize fsize = 0;
+        if (!fileName)
+            ramFile = tmpfile();
+        else if ((ramFile = fopen(fileName, "r+b")) != 0)
+        {
+            fsize = getFileSize();
+            if (fsize && !this->getPersistent() && resize(0))
+                fsize = 0; // discard old data
+        }
+        else
+            ramFile = fopen(fileName, "w+b");
+
         if (!ramFile)
             fprintf(stderr, "Unable to open ram file!");
-        this->writeZeros(0, this->getPoolSize()); // make sure it gets the right size
+        else if (fsize < this->getPoolSize() && !resize(this->getPoolSize()))
+            this->writeZeros(fsize, this->getPoolSize() - fsize); // make sure it gets the right size
+    }
+
+    VPtrSize getFileSize(void)
+    {
+#ifdef _WIN32
+        return (_fseeki64(ramFile, 0, SEEK_END) == 0) ? _ftelli64(ramFile) : 0;
+#else
+        return (fseeko(ramFile, 0, SEEK_END) == 0) ? ftello(ramFile) : 0;
+#endif
+    }
+
+    // Sets the file size. Most file systems do not allocate disk space for the new (zeroed) data until
+    // it is written, so this is fast regardless of the pool size.
+    bool resize(VPtrSize size)
+    {
+#ifdef _WIN32
+        return _chsize_s(_fileno(ramFile), size) == 0;
+#else
+        return ftruncate(fileno(ramFile), size) == 0;
+#endif
     }
 
+    // fseek() takes a long, which may be too small for large pools
+    bool seek(VPtrNum offset)
+    {
+#ifdef _WIN32
+        return _fseeki64(ramFile, offset, SEEK_SET) == 0;
+#else
+        return fseeko(ramFile, offset, SEEK_SET) == 0;
+#endif
+    }
+
+    bool doGrow(VPtrSize newsize) { return fflush(ramFile) == 0 && resize(newsize); }
+
+    // Frees disk space of unused data. Elsewhere, only unused data at the end of the file is freed.
+    void doTrim(VPtrSize offset, VPtrSize size)
+    {
+        if (fflush(ramFile) != 0)
+            return;
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+        if (fallocate(fileno(ramFile), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+            return;
+#endif
+        if ((offset + size) >= this->getPoolSize() && resize(offset))
+            resize(this->getPoolSize());
+    }
+    void doFlush(void) { fflush(ramFile); }
     void doSuspend(void) { }
     void doStop(void) { if (ramFile) { fclose(ramFile); ramFile = 0; } }
     void doRead(void *data, VPtrSize offset, VPtrSize size)
     {
-        if (fseek(ramFile, offset, SEEK_SET) != 0)
+        if (!seek(offset))
             fprintf(stderr, "fseek error: %s\n", strerror(errno));
 
         fread(data, size, 1, ramFile);
@@ -52,7 +123,7 @@ class StdioVAllocP : public VAlloc<Properties, StdioVAllocP<Properties> >
 
     void doWrite(const void *data, VPtrSize offset, VPtrSize size)
     {
-        if (fseek(ramFile, offset, SEEK_SET) != 0)
+        if (!seek(offset))
             fprintf(stderr, "fseek error: %s\n", strerror(errno));
 
         fwrite(data, size, 1, ramFile);
@@ -66,8 +137,20 @@ public:
      * @param ps Total amount of bytes of the memory pool.
      * @sa setPoolSize
      */
-    StdioVAllocP(VPtrSize ps=VIRTMEM_DEFAULT_POOLSIZE) : ramFile(0) { this->setPoolSize(ps); }
+    StdioVAllocP(VPtrSize ps=VIRTMEM_DEFAULT_POOLSIZE) : ramFile(0), fileName(0) { this->setPoolSize(ps); }
     ~StdioVAllocP(void) { doStop(); }
+
+    /**
+     * @brief Uses a named file as memory pool.
+     *
+     * The file is created if it does not exist, and is kept when the allocator is stopped. Its data is
+     * discarded when the allocator is started, unless the memory pool is persistent (see
+     * BaseVAlloc::setPersistent()).
+     * @param name The path of the file, which should remain valid while the allocator is used. If zero (the
+     * default), a temporary file is used.
+     * @note This function should always be called before \ref start().
+     */
+    void setFileName(const char *name) { fileName = name; }
 };
 
 typedef StdioVAllocP<> StdioVAlloc; //!< Shortcut to StdioVAllocP with default template arguments
@@ -0,0 +1,151 @@
+/**
+  @file
+  @brief Background I/O for allocators (see VIRTMEM_ASYNC_IO)
+*/
+
+#include "internal/async_io.h"
+
+#ifdef VIRTMEM_ASYNC_IO
+
+#include <string.h>
+
+namespace virtmem {
+
+namespace private_utils {
+
+AsyncIO::AsyncIO(BaseVAlloc *a) : allocator(a), pendingBytes(0), quit(false)
+{
+    worker = std::thread(&AsyncIO::run, this);
+}
+
+AsyncIO::~AsyncIO()
+{
+    sync();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    requestCondition.notify_all();
+    worker.join();
+}
+
+void AsyncIO::run()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true)
+    {
+        requestCondition.wait(lock, [this] { return quit || !requests.empty(); });
+        if (requests.empty())
+            break; // quit
+
+        // NOTE: only this thread removes requests, so the reference stays valid
+        Request &request = requests.front();
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> iolock(ioMutex);
+            if (request.data)
+                allocator->doRead(request.data, request.start, request.size);
+            else
+                allocator->doWrite(&request.buffer[0], request.start, request.size);
+        }
+        lock.lock();
+
+        pendingBytes -= request.buffer.size();
+        requests.pop_front();
+        doneCondition.notify_all();
+    }
+}
+
+// Checks for requests that access the given range of the memory pool. If all is false, only writes are checked.
+bool AsyncIO::isPending(VPtrNum start, VPtrSize size, bool all) const
+{
+    for (std::list<Request>::const_iterator it=requests.begin(); it!=requests.end(); ++it)
+    {
+        if ((all || !it->data) && it->start < (start + size) && start < (it->start + it->size))
+            return true;
+    }
+    return false;
+}
+
+// Checks for reads that write to the given memory
+bool AsyncIO::isLoading(const uint8_t *data, VPtrSize size) const
+{
+    for (std::list<Request>::const_iterator it=requests.begin(); it!=requests.end(); ++it)
+    {
+        if (it->data && it->data < (data + size) && data < (it->data + it->size))
+            return true;
+    }
+    return false;
+}
+
+void AsyncIO::queueRead(void *data, VPtrNum start, VPtrSize size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        requests.push_back(Request());
+        Request &request = requests.back();
+        request.start = start;
+        request.size = size;
+        request.data = static_cast<uint8_t *>(data);
+    }
+    requestCondition.notify_one();
+}
+
+void AsyncIO::queueWrite(const void *data, VPtrNum start, VPtrSize size)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        // limit memory used by write buffers
+        doneCondition.wait(lock, [this, size] { return requests.empty() || (pendingBytes + size) <= VIRTMEM_ASYNC_IO_BUFFER_SIZE; });
+
+        requests.push_back(Request());
+        Request &request = requests.back();
+        request.start = start;
+        request.size = size;
+        request.data = 0;
+        request.buffer.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+        pendingBytes += size;
+    }
+    requestCondition.notify_one();
+}
+
+// Reads data directly, but only after pending writes to the same data were finished
+void AsyncIO::read(void *data, VPtrNum start, VPtrSize size)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        doneCondition.wait(lock, [this, start, size] { return !isPending(start, size, false); });
+    }
+
+    std::lock_guard<std::mutex> iolock(ioMutex);
+    allocator->doRead(data, start, size);
+}
+
+// Waits until all requests that access the given range of the memory pool are finished
+void AsyncIO::wait(VPtrNum start, VPtrSize size)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this, start, size] { return !isPending(start, size, true); });
+}
+
+// Waits until all reads to the given memory are finished
+void AsyncIO::waitForData(const void *data, VPtrSize size)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this, data, size] { return !isLoading(static_cast<const uint8_t *>(data), size); });
+}
+
+void AsyncIO::sync()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    doneCondition.wait(lock, [this] { return requests.empty(); });
+}
+
+}
+
+}
+
+#endif
@@ -8,9 +8,14 @@
  * https://github.com/eliben/code-for-blog/tree/master/2008/memmgr
  */
 
+#include "internal/alloc_engine.h"
+#include "internal/async_io.h"
 #include "internal/base_alloc.h"
+#include "internal/page_policy.h"
 #include "internal/utils.h"
 
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
 //#define PRINTF_STATS
@@ -19,10 +24,76 @@
 #include <stdio.h>
 #endif
 
+#ifdef VIRTMEM_THREAD_SAFE
+#define LOCK_CACHE CacheLock cachelock(this)
+#define LOCK_CACHE_RANGE(p, size) CacheLock cachelock(this, p, size)
+#define LOCK_ALLOC std::lock_guard<std::recursive_mutex> alloclock(allocMutex)
+#define LOCK_READ_AHEAD std::lock_guard<std::recursive_mutex> readaheadlock(readAheadMutex)
+#define LOCK_POOL std::lock_guard<std::recursive_mutex> poollock(poolMutex)
+#else
+#define LOCK_CACHE
+#define LOCK_CACHE_RANGE(p, size)
+#define LOCK_ALLOC
+#define LOCK_READ_AHEAD
+#define LOCK_POOL
+#endif
+
 namespace virtmem {
 
+#ifdef VIRTMEM_THREAD_SAFE
+// Keeps cache shards locked while it exists. Shards are always locked in ascending order, so that threads
+// locking multiple shards cannot deadlock.
+class BaseVAlloc::CacheLock
+{
+    BaseVAlloc *allocator;
+    uint32_t shards; // one bit per locked shard
+
+    void lock(uint32_t s)
+    {
+        for (uint8_t i=0; i<allocator->shardCount; ++i)
+        {
+            if (s & ((uint32_t)1 << i))
+                allocator->cacheShards[i].mutex.lock();
+        }
+        shards = s;
+    }
+
+    void unlock(void)
+    {
+        for (uint8_t i=allocator->shardCount; i; --i)
+        {
+            if (shards & ((uint32_t)1 << (i - 1)))
+                allocator->cacheShards[i - 1].mutex.unlock();
+        }
+        shards = 0;
+    }
+
+public:
+    // locks all shards
+    CacheLock(BaseVAlloc *a) : allocator(a), shards(0) { lock((uint32_t)-1 >> (32 - a->shardCount)); }
+
+    // locks the shards of a range. Locked pages overlapping with the range may be accessed as well (see read()
+    // and write()), so their shards are also locked.
+    CacheLock(BaseVAlloc *a, VPtrNum p, VPtrSize size) : allocator(a), shards(0)
+    {
+        for (uint32_t s=a->getShardMask(p, size); ; )
+        {
+            lock(s);
+            // NOTE: locked pages only change while all shards are locked
+            const uint32_t lockshards = a->getLockedPageShards(p, size);
+            if (!(lockshards & ~s))
+                break;
+            unlock();
+            s |= lockshards;
+        }
+    }
+
+    ~CacheLock(void) { unlock(); }
+};
+#endif
+
 
-void BaseVAlloc::initPages(PageInfo *info, LockPage *pages, uint8_t *pool, uint8_t pcount, VirtPageSize psize)
+void BaseVAlloc::initPages(PageInfo *info, LockPage *pages, uint8_t *pool, VirtPageCount pcount, VirtPageSize psize)
 {
     info->pages = pages;
     info->count = pcount;
@@ -30,7 +101,7 @@ void BaseVAlloc::initPages(PageInfo *info, LockPage *pages, uint8_t *pool, uint8
     info->freeIndex = 0;
     info->lockedIndex = -1;
 
-    for (uint8_t i=0; i<pcount; ++i)
+    for (VirtPageCount i=0; i<pcount; ++i)
     {
 #ifndef NVALGRIND
         const int start = i * (psize + valgrindPad * 2);
@@ -42,19 +113,253 @@ void BaseVAlloc::initPages(PageInfo *info, LockPage *pages, uint8_t *pool, uint8
     }
 }
 
+void BaseVAlloc::initPageIndex(PageIndex *index, LockPage **buckets, VPtrSize bcount)
+{
+    ASSERT(bcount && !(bcount & (bcount - 1))); // must be power of two
+    index->buckets = buckets;
+    index->mask = bcount - 1;
+    for (VPtrSize i=0; i<bcount; ++i)
+        index->buckets[i] = 0;
+}
+
+void BaseVAlloc::initPageIndices(LockPage **lbuckets, VPtrSize lcount, LockPage **bbuckets, VPtrSize bcount)
+{
+    initPageIndex(&lockedPageIndex, lbuckets, lcount);
+    initPageIndex(&bigPageIndex, bbuckets, bcount);
+
+    // Keys are page addresses divided by the largest power of two that fits in a big page. Since no page
+    // is larger than a big page, any page spans at most three keys.
+    for (indexShift=0; ((VPtrSize)2 << indexShift) <= bigPages.size; ++indexShift)
+        ;
+
+    // Use as many shards as possible, but leave at least eight big pages to each of them, so that the
+    // replacement policy and read-ahead keep working within a shard. Each shard owns an equal part of the index
+    // buckets, which are selected by the lowest bits of their keys. Therefore, keys with the same high bits
+    // belong to the same shard (see CacheShard), and pages are indexed as before. Since there are at least as
+    // many buckets as big pages, a region spans at least eight keys.
+    for (shardCount=1; (shardCount * 2) <= CACHE_SHARDS && (shardCount * 16) <= bigPages.count &&
+         (shardCount * 2) <= bcount; shardCount *= 2)
+        ;
+    shardShift = indexShift + private_utils::floorLog2(bcount / shardCount);
+    shardPages = bigPages.count / shardCount;
+    for (uint8_t i=0; i<CACHE_SHARDS; ++i)
+    {
+        cacheShards[i].firstPage = private_utils::minimal((VirtPageCount)(i * shardPages), bigPages.count);
+        cacheShards[i].endPage = (i == (shardCount - 1)) ? bigPages.count : private_utils::minimal((VirtPageCount)((i + 1) * shardPages), bigPages.count);
+        cacheShards[i].pagePolicy = 0;
+    }
+}
+
+// Checks if a range lies within a single region of a cache shard (see CacheShard)
+bool BaseVAlloc::isShardRange(VPtrNum p, VPtrSize size) const
+{
+    return shardCount == 1 || ((p ^ (p + private_utils::maximal(size, (VPtrSize)1) - 1)) >> shardShift) == 0;
+}
+
+#ifdef VIRTMEM_THREAD_SAFE
+// Returns the shards of all regions that overlap with the given range, one bit per shard
+uint32_t BaseVAlloc::getShardMask(VPtrNum p, VPtrSize size) const
+{
+    const VPtrNum first = p >> shardShift, last = (p + private_utils::maximal(size, (VPtrSize)1) - 1) >> shardShift;
+    if ((last - first) >= shardCount)
+        return (uint32_t)-1 >> (32 - shardCount);
+
+    uint32_t ret = 0;
+    for (VPtrNum r=first; r<=last; ++r)
+        ret |= (uint32_t)1 << (r & (shardCount - 1));
+    return ret;
+}
+
+// Returns the shards of all locked pages that overlap with the given range (see getShardMask())
+uint32_t BaseVAlloc::getLockedPageShards(VPtrNum p, VPtrSize size) const
+{
+    uint32_t ret = 0;
+    if (shardCount == 1)
+        return ret;
+
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&lockedPageIndex, p, size, key); k; --k, ++key)
+    {
+        for (const LockPage *page=getIndexBucket(&lockedPageIndex, key); page; page=page->indexNext)
+        {
+            if (page->start < (p + size) && p < (page->start + page->size))
+                ret |= getShardMask(page->start, page->size);
+        }
+    }
+    return ret;
+}
+#endif
+
+// Returns the first unlocked big page of a shard that follows the given page in the list of unlocked pages,
+// wrapping around at the end. If index is -1 the first unlocked page of the shard is returned. Returns -1
+// if all pages of the shard are locked.
+VirtPageIndex BaseVAlloc::getNextShardPage(uint8_t shard, VirtPageIndex index) const
+{
+    for (VirtPageIndex i=(index == -1) ? bigPages.freeIndex : bigPages.pages[index].next; i!=-1; i=bigPages.pages[i].next)
+    {
+        if (getPageShard(i) == shard)
+            return i;
+    }
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    {
+        if (getPageShard(i) == shard)
+            return i;
+    }
+    return -1;
+}
+
+// Selects the shard that provides the big page for a new lock: the shard of the locked data, unless another
+// shard has more unlocked pages left. This way locks are spread over all shards.
+uint8_t BaseVAlloc::getLockShard(VPtrNum ptr) const
+{
+    uint8_t ret = getRegionShard(ptr);
+    if (shardCount == 1)
+        return ret;
+
+    VirtPageCount unlocked[CACHE_SHARDS] = { 0 };
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+        ++unlocked[getPageShard(i)];
+    for (uint8_t i=0; i<shardCount; ++i)
+    {
+        if (unlocked[i] > unlocked[ret])
+            ret = i;
+    }
+    return ret;
+}
+
+void BaseVAlloc::indexPage(PageIndex *index, LockPage *page)
+{
+    ASSERT(page->start != 0);
+    LockPage *&bucket = index->buckets[(page->start >> indexShift) & index->mask];
+    page->indexNext = bucket;
+    bucket = page;
+}
+
+void BaseVAlloc::unindexPage(PageIndex *index, LockPage *page)
+{
+    LockPage **p = &index->buckets[(page->start >> indexShift) & index->mask];
+    for (; *p != page; p = &(*p)->indexNext)
+        ASSERT(*p);
+    *p = page->indexNext;
+    page->indexNext = 0;
+}
+
+// Returns the amount of consecutive keys (starting at firstkey) of buckets that may contain pages
+// overlapping with the given range
+VPtrSize BaseVAlloc::getIndexKeys(const PageIndex *index, VPtrNum p, VPtrSize size, VPtrNum &firstkey) const
+{
+    // pages are never larger than a big page, hence, only those starting within (p - bigsize, p + size) can overlap
+    VPtrNum low = (p >= bigPages.size) ? (p - bigPages.size + 1) : 0;
+    // ...and big pages never extend from another region (see CacheShard), whose buckets may be locked by others
+    if (index == &bigPageIndex && shardCount > 1)
+        low = private_utils::maximal(low, (p >> shardShift) << shardShift);
+    const VPtrNum lastkey = (p + private_utils::maximal(size, (VPtrSize)1) - 1) >> indexShift;
+    firstkey = low >> indexShift;
+    // don't visit buckets twice
+    return private_utils::minimal(lastkey - firstkey + 1, (VPtrNum)index->mask + 1);
+}
+
+void BaseVAlloc::linkPage(PageInfo *pinfo, VirtPageIndex &head, VirtPageIndex index)
+{
+    pinfo->pages[index].prev = -1;
+    pinfo->pages[index].next = head;
+    if (head != -1)
+        pinfo->pages[head].prev = index;
+    head = index;
+}
+
+void BaseVAlloc::unlinkPage(PageInfo *pinfo, VirtPageIndex &head, VirtPageIndex index)
+{
+    LockPage *page = &pinfo->pages[index];
+    if (page->prev != -1)
+        pinfo->pages[page->prev].next = page->next;
+    else
+    {
+        ASSERT(head == index);
+        head = page->next;
+    }
+    if (page->next != -1)
+        pinfo->pages[page->next].prev = page->prev;
+}
+
+// Adds a big page to the cache, i.e. makes its data available for regular IO
+void BaseVAlloc::cacheBigPage(LockPage *page)
+{
+    if (mappedPool)
+        page->pool = mappedPool + page->start;
+    indexPage(&bigPageIndex, page);
+    BasePagePolicy *policy = cacheShards[getPageShard(page - bigPages.pages)].pagePolicy;
+    if (policy)
+        policy->pageInserted(page - bigPages.pages, page->start);
+}
+
+void BaseVAlloc::uncacheBigPage(LockPage *page)
+{
+    waitForPage(page); // the pool may be reused afterwards
+    unindexPage(&bigPageIndex, page);
+    CacheShard *shard = &cacheShards[getPageShard(page - bigPages.pages)];
+    if (shard->pagePolicy)
+        shard->pagePolicy->pageRemoved(page - bigPages.pages);
+
+#ifdef VIRTMEM_READ_AHEAD
+    if (page->prefetched)
+    {
+        // swapped out before it was used: read less ahead
+        LOCK_READ_AHEAD;
+        page->prefetched = false;
+        readAheadWindow = private_utils::maximal((VirtPageCount)(readAheadWindow / 2), (VirtPageCount)1);
+#ifdef VIRTMEM_TRACE_STATS
+        ++wastedPrefetches;
+#endif
+    }
+#endif
+}
+
+void BaseVAlloc::setLockedPageStart(LockPage *page, VPtrNum start)
+{
+    unindexPage(&lockedPageIndex, page);
+    page->start = start;
+    if (mappedPool && page >= bigPages.pages && page < &bigPages.pages[bigPages.count])
+        page->pool = mappedPool + start;
+    indexPage(&lockedPageIndex, page);
+}
+
+// Makes sure that the memory pool extends to the given address, growing it if allowed (see setMaxPoolSize())
+bool BaseVAlloc::growPool(VPtrNum end)
+{
+    if (end <= poolSize)
+        return true;
+    if (end > maxPoolSize)
+        return false;
+
+    LOCK_CACHE;
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+        asyncIO->sync(); // don't resize while writing
+#endif
+
+    const VPtrSize newsize = private_utils::minimal(private_utils::maximal(end, poolSize * 2), maxPoolSize);
+    if (!doGrow(newsize))
+        return false;
+    poolSize = newsize;
+    return true;
+}
+
 VPtrNum BaseVAlloc::getMem(VPtrSize size)
 {
     size = private_utils::maximal(size, (VPtrSize)MIN_ALLOC_SIZE);
     const VPtrSize totalsize = size * sizeof(UMemHeader);
 
-    if ((poolFreePos + totalsize) <= poolSize)
+    // NOTE: headers may not be able to address the complete pool (see VIRTMEM_COMPACT_HEADERS)
+    if ((poolFreePos + totalsize) > poolFreePos && (poolFreePos + totalsize) <= (VPtrNum)(THeaderNum)-1 &&
+        growPool(poolFreePos + totalsize))
     {
 //        std::cout << "new mem at " << poolFreePos << "/" << (poolFreePos + sizeof(UMemHeader)) << std::endl;
 
         UMemHeader h;
         h.s.size = size;
         h.s.next = 0;
-        write(poolFreePos, &h, sizeof(UMemHeader));
+        updateHeader(poolFreePos, &h);
 #ifdef VIRTMEM_TRACE_STATS
         // HACK: increase here to balance the subtraction by free()
         memUsed += totalsize;
@@ -68,6 +373,145 @@ VPtrNum BaseVAlloc::getMem(VPtrSize size)
     return freePointer;
 }
 
+// Takes memory from the unused end of the memory pool (used by allocation engines)
+VPtrNum BaseVAlloc::getPoolMem(VPtrSize size, VPtrSize align)
+{
+    // NOTE: as for getMem(), the pool is only used as far as headers can address it (see VIRTMEM_COMPACT_HEADERS)
+    const VPtrNum start = (poolFreePos + align - 1) & ~(VPtrNum)(align - 1);
+    if (start < poolFreePos || (start + size) < start || (start + size) > (VPtrNum)(THeaderNum)-1 ||
+        !growPool(start + size))
+        return 0;
+
+    poolFreePos = start + size;
+    return start;
+}
+
+// Extends the memory that ends at the unused part of the memory pool
+bool BaseVAlloc::extendPoolMem(VPtrNum end, VPtrSize size)
+{
+    // NOTE: blocks that are extended may be split or freed later, so their headers must remain addressable
+    if (end != poolFreePos || (end + size) < end || (end + size) > (VPtrNum)(THeaderNum)-1 || !growPool(end + size))
+        return false;
+
+    poolFreePos += size;
+    return true;
+}
+
+void BaseVAlloc::setAllocEngine(BaseAllocEngine *e)
+{
+    allocEngine = e;
+    if (e)
+        e->allocator = this;
+}
+
+// Checks if a big page is used as cache, i.e. it contains data and is not locked
+bool BaseVAlloc::isCachedBigPage(const LockPage *page) const
+{
+    if (page->start == 0)
+        return false;
+
+    for (const LockPage *p=getIndexBucket(&bigPageIndex, page->start >> indexShift); p; p=p->indexNext)
+    {
+        if (p == page)
+            return true;
+    }
+    return false;
+}
+
+// Checks if the dirty data of two big pages can be written at once, which is the case if the second page
+// directly follows the first, both in the memory pool and in RAM, and their modified data is adjacent
+bool BaseVAlloc::canMergeBigPages(const LockPage *first, const LockPage *second) const
+{
+    return first->dirty && second->dirty && first->dirtyEnd == first->size && second->dirtyStart == 0 &&
+            (first->start + first->size) == second->start && (first->pool + first->size) == second->pool &&
+            isCachedBigPage(first) && isCachedBigPage(second);
+}
+
+#if VIRTMEM_ZERO_MAP_SIZE > 0
+// Checks if data was never written (see VIRTMEM_ZERO_MAP_SIZE)
+bool BaseVAlloc::isZeroData(VPtrNum offset, VPtrSize size) const
+{
+    const VPtrNum last = (offset + size - 1) >> zeroMapShift;
+    for (VPtrNum r=offset >> zeroMapShift; r<=last; ++r)
+    {
+        if (r >= (VPtrNum)(VIRTMEM_ZERO_MAP_SIZE * 8) || !(zeroMap[r / 8] & (1 << (r % 8))))
+            return false;
+    }
+    return true;
+}
+
+// Marks data as written
+void BaseVAlloc::clearZeroData(VPtrNum offset, VPtrSize size)
+{
+    const VPtrNum last = (offset + size - 1) >> zeroMapShift;
+    for (VPtrNum r=offset >> zeroMapShift; r<=last && r<(VPtrNum)(VIRTMEM_ZERO_MAP_SIZE * 8); ++r)
+        zeroMap[r / 8] &= ~(1 << (r % 8));
+}
+#endif
+
+// Reads from the memory pool. Any data that is still being written in the background is waited for.
+void BaseVAlloc::readData(void *data, VPtrNum offset, VPtrSize size)
+{
+    LOCK_POOL;
+    if (isZeroData(offset, size))
+    {
+        memset(data, 0, size);
+        return;
+    }
+
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+    {
+        asyncIO->read(data, offset, size);
+        return;
+    }
+#endif
+    doRead(data, offset, size);
+}
+
+// Writes to the memory pool. The data is written in the background if asynchronous I/O is enabled.
+void BaseVAlloc::writeData(const void *data, VPtrNum offset, VPtrSize size)
+{
+    LOCK_POOL;
+    if (stateStored)
+        invalidateState();
+    clearZeroData(offset, size);
+
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+    {
+        asyncIO->queueWrite(data, offset, size);
+        return;
+    }
+#endif
+    doWrite(data, offset, size);
+}
+
+#ifdef VIRTMEM_ASYNC_IO
+// Waits until data that is read ahead in the background is available in a big page
+void BaseVAlloc::waitForPage(LockPage *page)
+{
+    if (page->loading)
+    {
+        asyncIO->waitForData(page->pool, bigPages.size);
+        page->loading = false;
+    }
+}
+#endif
+
+void BaseVAlloc::writeBigPageData(const uint8_t *pool, VPtrNum start, VPtrSize size)
+{
+    if (mappedPool)
+        return; // modified in place
+    size = private_utils::minimal(poolSize - start, size);
+    writeData(pool, start, size);
+#ifdef VIRTMEM_TRACE_STATS
+    bytesWritten += size;
+#endif
+}
+
+// Writes back the modified data of a big page. Other dirty pages that can be merged with this page
+// (see canMergeBigPages()) are written back in the same write.
 void BaseVAlloc::syncBigPage(LockPage *page)
 {
     ASSERT(page->start != 0);
@@ -75,54 +519,374 @@ void BaseVAlloc::syncBigPage(LockPage *page)
     if (page->dirty)
     {
 //        std::cout << "dirty page\n";
-        const VirtPageSize wrsize = private_utils::minimal((poolSize - page->start), (VPtrSize)bigPages.size);
-        doWrite(page->pool, page->start, wrsize);
-        page->dirty = false;
-        page->cleanSkips = 0;
+        // NOTE: pages with adjacent pools have adjacent indices. Only pages of the same shard are merged, as
+        // other shards may be used by other threads.
+        const CacheShard *shard = &cacheShards[getPageShard(page - bigPages.pages)];
+        LockPage *first = page, *last = page;
+        while (first > &bigPages.pages[shard->firstPage] && canMergeBigPages(first - 1, first))
+            --first;
+        while (last < &bigPages.pages[shard->endPage - 1] && canMergeBigPages(last, last + 1))
+            ++last;
+
+        writeBigPageData(first->pool + first->dirtyStart, first->start + first->dirtyStart,
+                         (last->start + last->dirtyEnd) - (first->start + first->dirtyStart));
+
+        for (LockPage *p=first; p<=last; ++p)
+        {
+            p->dirty = false;
+            p->cleanSkips = 0;
 #ifdef VIRTMEM_TRACE_STATS
-        ++bigPageWrites;
-        bytesWritten += wrsize;
+            ++bigPageWrites;
 #endif
+        }
     }
 }
 
-void BaseVAlloc::copyRawData(void *dest, VPtrNum p, VPtrSize size)
+// Writes back all dirty big pages in order of their address, so that they are written (nearly) sequentially
+void BaseVAlloc::syncBigPages()
 {
-    // First check if we should copy data from loaded big pages
-    // Note that the size of these pages are never smaller than the copy size,
-    // so it is impossible that more than two pages overlap
+    for (VPtrNum next=0; ; )
+    {
+        LockPage *page = 0;
+        for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+        {
+            LockPage *p = &bigPages.pages[i];
+            if (p->start != 0 && p->dirty && p->start >= next && (!page || p->start < page->start))
+                page = p;
+        }
 
-    for (int8_t i=bigPages.freeIndex; i!=-1 && size; i=bigPages.pages[i].next)
+        if (!page)
+            break;
+
+        next = page->start + page->size;
+        syncBigPage(page);
+    }
+}
+
+#ifdef VIRTMEM_READ_AHEAD
+// Returns the stream that is continued by loading the given page, or zero if the page does not continue
+// any stream. In the latter case the page is tracked as the start of a new stream.
+BaseVAlloc::ReadAheadStream *BaseVAlloc::getReadAheadStream(VPtrNum start, VirtPageSize size)
+{
+    const VPtrNum end = start + size;
+
+    for (uint8_t i=0; i<VIRTMEM_READ_AHEAD_STREAMS; ++i)
     {
-        if (!bigPages.pages[i].start)
+        ReadAheadStream *stream = &readAheadStreams[i];
+        if (stream->direction >= 0 && start == stream->high)
+            stream->direction = 1;
+        else if (stream->direction <= 0 && end == stream->low)
+            stream->direction = -1;
+        else
             continue;
 
-        const VPtrNum pageend = bigPages.pages[i].start + bigPages.size;
-        if (p >= bigPages.pages[i].start && p < pageend) // start address within this page?
+        stream->low = start;
+        stream->high = end;
+        return stream;
+    }
+
+    ReadAheadStream *stream = &readAheadStreams[nextReadAheadStream];
+    nextReadAheadStream = (nextReadAheadStream + 1) % VIRTMEM_READ_AHEAD_STREAMS;
+    stream->low = start;
+    stream->high = end;
+    stream->direction = 0;
+    return 0;
+}
+
+// Determines the next memory region that should be read ahead for a stream of a shard. Returns zero if there is
+// none, which includes regions of other shards.
+VPtrNum BaseVAlloc::getReadAheadRegion(uint8_t shard, const ReadAheadStream *stream, VirtPageSize &size) const
+{
+    VPtrNum start;
+
+    if (stream->direction > 0)
+    {
+        if (stream->high >= poolSize)
+            return 0;
+        start = getBigPageStart(stream->high, 1, false, size);
+    }
+    else
+    {
+        if (stream->low <= START_OFFSET)
+            return 0;
+#ifdef VIRTMEM_ALIGNED_PAGES
+        start = getBigPageStart(stream->low - 1, 1, false, size);
+#else
+        start = (stream->low > (START_OFFSET + bigPages.size)) ? (stream->low - bigPages.size) : START_OFFSET;
+        size = stream->low - start;
+#endif
+    }
+
+    // stop at other shards and at data that is already available
+    if (!isShardRange(start, size) || getRegionShard(start) != shard || isBigPageCached(start, size))
+        return 0;
+
+    return start;
+}
+
+// Checks if a big page may be overwritten by read-ahead. This is only the case for unused and clean pages.
+bool BaseVAlloc::canPrefetchInPage(VirtPageIndex index, VirtPageIndex exclude) const
+{
+    const LockPage *page = &bigPages.pages[index];
+
+    if (index == exclude || page->prefetched)
+        return false;
+    if (page->start == 0)
+        return true; // NOTE: locked pages always have a start address
+
+    return !page->dirty && isCachedBigPage(page);
+}
+
+// Finds a page for read-ahead. The page next to the previous page (in the direction of the stream) is preferred,
+// as their pools are adjacent, which allows reading both pages at once. Otherwise the first page from where
+// following pages may be adjacent again is returned.
+VirtPageIndex BaseVAlloc::findPrefetchPage(uint8_t shard, VirtPageIndex previndex, int8_t direction, VirtPageIndex exclude) const
+{
+    const VirtPageIndex preferred = previndex + direction;
+    if (preferred >= cacheShards[shard].firstPage && preferred < cacheShards[shard].endPage &&
+        canPrefetchInPage(preferred, exclude))
+        return preferred;
+
+    VirtPageIndex ret = -1;
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    {
+        if (getPageShard(i) == shard && (ret == -1 || (direction > 0) == (i < ret)) && canPrefetchInPage(i, exclude))
+            ret = i;
+    }
+
+    return ret;
+}
+#endif
+
+// Reads data for big pages. Data that is read ahead may be loaded in the background.
+void BaseVAlloc::readBigPageData(uint8_t *pool, VPtrNum start, VPtrSize size, bool prefetch)
+{
+    size = private_utils::minimal(poolSize - start, size);
+    if (mappedPool)
+    {
+        // the data is accessed in place
+        if (prefetch)
+            doPrefetch(start, size);
+        return;
+    }
+#ifdef VIRTMEM_ASYNC_IO
+    LOCK_POOL;
+    if (prefetch && asyncIO && !isZeroData(start, size))
+        asyncIO->queueRead(pool, start, size);
+    else
+#endif
+        readData(pool, start, size);
+#ifdef VIRTMEM_TRACE_STATS
+    bytesRead += size;
+#endif
+}
+
+// Reads in the data of a (cached) big page. If the page continues a sequential access stream, the pages that
+// follow are read ahead (see setReadAhead()).
+void BaseVAlloc::loadBigPage(VirtPageIndex index)
+{
+    LockPage *page = &bigPages.pages[index];
+
+    // data that can be read at once: pages that are adjacent in both the memory pool and RAM
+    VPtrNum rdstart = page->start;
+    uint8_t *rdpool = page->pool;
+    VPtrSize rdsize = page->size;
+    bool prefetchrun = false; // whether the data only belongs to pages that are read ahead
+
+#ifdef VIRTMEM_READ_AHEAD
+    if (maxReadAhead)
+    {
+        LOCK_READ_AHEAD;
+        // NOTE: the page may be about to be locked, and then belong to another shard (see getLockShard())
+        const uint8_t shardindex = getRegionShard(page->start);
+        const CacheShard *shard = &cacheShards[shardindex];
+        ReadAheadStream *stream = getReadAheadStream(page->start, page->size);
+        if (stream)
+        {
+            // read requested page now and the rest in the background, or only prefetch the rest of a mapped pool
+            bool splitrun = (mappedPool != 0);
+#ifdef VIRTMEM_ASYNC_IO
+            splitrun = splitrun || asyncIO;
+#endif
+            if (splitrun)
+            {
+                readBigPageData(rdpool, rdstart, rdsize, false);
+                rdsize = 0;
+                prefetchrun = true;
+            }
+
+            const VirtPageCount maxpages = private_utils::minimal(maxReadAhead, (VirtPageCount)((shard->endPage - shard->firstPage) / 2));
+            VirtPageIndex previndex = index;
+
+            for (VirtPageCount n=private_utils::minimal(readAheadWindow, maxpages); n; --n)
+            {
+                VirtPageSize size;
+                const VPtrNum start = getReadAheadRegion(shardindex, stream, size);
+                if (!start)
+                    break;
+
+                const VirtPageIndex i = findPrefetchPage(shardindex, previndex, stream->direction, index);
+                if (i == -1)
+                    break;
+
+                LockPage *ppage = &bigPages.pages[i];
+                if (ppage->start != 0)
+                    uncacheBigPage(ppage); // NOTE: clean, so no need to sync
+                ppage->start = start;
+                ppage->size = size;
+                ppage->prefetched = true;
+                ppage->cleanSkips = 0;
+#ifdef VIRTMEM_ASYNC_IO
+                ppage->loading = (asyncIO != 0);
+#endif
+                cacheBigPage(ppage);
+
+                if (stream->direction > 0)
+                {
+                    stream->high = start + size;
+                    if (start == (rdstart + rdsize) && ppage->pool == (rdpool + rdsize))
+                    {
+                        rdsize += size;
+                        previndex = i;
+                        continue;
+                    }
+                }
+                else
+                {
+                    stream->low = start;
+                    if ((start + size) == rdstart && (ppage->pool + size) == rdpool)
+                    {
+                        rdstart = start;
+                        rdpool = ppage->pool;
+                        rdsize += size;
+                        previndex = i;
+                        continue;
+                    }
+                }
+
+                // not adjacent, read what we got so far
+                if (rdsize)
+                    readBigPageData(rdpool, rdstart, rdsize, prefetchrun);
+                rdstart = start;
+                rdpool = ppage->pool;
+                rdsize = size;
+                prefetchrun = true;
+                previndex = i;
+            }
+
+            // stream continues: read more ahead next time
+            readAheadWindow = private_utils::minimal((VirtPageCount)(readAheadWindow * 2), maxpages);
+        }
+    }
+#endif
+
+    if (rdsize)
+        readBigPageData(rdpool, rdstart, rdsize, prefetchrun);
+#ifdef VIRTMEM_TRACE_STATS
+    ++bigPageReads;
+#endif
+}
+
+// Determines the memory region that a big page should cover to contain the given range
+VPtrNum BaseVAlloc::getBigPageStart(VPtrNum p, VPtrSize size, bool forcestart, VirtPageSize &pagesize) const
+{
+    pagesize = bigPages.size;
+    VPtrNum ret = p;
+
+#ifdef VIRTMEM_ALIGNED_PAGES
+    if (!forcestart)
+    {
+        const VPtrNum frame = p - (p % bigPages.size);
+        if ((p + size) <= (frame + bigPages.size))
+        {
+            if (frame == 0)
+            {
+                // zero marks unused pages and the first bytes are never used anyway
+                pagesize -= START_OFFSET;
+                ret = START_OFFSET;
+            }
+            else
+                ret = frame;
+        }
+        else
         {
-            const VPtrSize offset = p - bigPages.pages[i].start;
-            const VPtrSize copysize = private_utils::minimal(size, bigPages.pages[i].size - offset);
-            memcpy(dest, bigPages.pages[i].pool + offset, copysize);
+            // data straddles two frames: use a page starting at the data, but try to keep it aligned
+            const VPtrNum alignp = p - (p & (sizeof(TAlign) - 1));
+            if ((alignp + bigPages.size) >= (p + size))
+                ret = alignp;
+        }
+    }
+#else
+    (void)forcestart;
+#endif
 
-            // move start to end of this page
-            dest = (uint8_t *)dest + copysize;
-            p += copysize;
-            size -= copysize;
+    // the page may not extend to other regions of cache shards (see CacheShard), unless the data itself does
+    if (shardCount > 1 && isShardRange(p, size))
+    {
+        const VPtrNum end = private_utils::minimal(ret + pagesize, getRegionEnd(p));
+        ret = private_utils::maximal(ret, (p >> shardShift) << shardShift);
+        pagesize = end - ret;
+    }
+
+    return ret;
+}
+
+// Checks if any unlocked big page contains data from the given range
+bool BaseVAlloc::isBigPageCached(VPtrNum p, VPtrSize size) const
+{
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&bigPageIndex, p, size, key); k; --k, ++key)
+    {
+        for (LockPage *page=getIndexBucket(&bigPageIndex, key); page; page=page->indexNext)
+        {
+            if (page->start < (p + size) && p < (page->start + page->size))
+                return true;
         }
-        // end overlaps?
-        else if (p < bigPages.pages[i].start && (p + size) > bigPages.pages[i].start)
+    }
+
+    return false;
+}
+
+void BaseVAlloc::copyRawData(void *dest, VPtrNum p, VPtrSize size)
+{
+    // First check if we should copy data from loaded big pages
+    // Note that the size of these pages are never smaller than the copy size,
+    // so it is impossible that more than two pages overlap
+
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&bigPageIndex, p, size, key); k && size; --k, ++key)
+    {
+        for (LockPage *page=getIndexBucket(&bigPageIndex, key); page && size; page=page->indexNext)
         {
-            const VPtrSize offset = bigPages.pages[i].start - p;
-            const VPtrSize copysize = private_utils::minimal(size - offset, (VPtrSize)bigPages.pages[i].size);
-            memcpy((uint8_t *)dest + offset, bigPages.pages[i].pool, copysize);
-            size = offset;
+            const VPtrNum pageend = page->start + page->size;
+            if (p >= page->start && p < pageend) // start address within this page?
+            {
+                const VPtrSize offset = p - page->start;
+                const VPtrSize copysize = private_utils::minimal(size, page->size - offset);
+                waitForPage(page);
+                memmove(dest, page->pool + offset, copysize); // NOTE: may be the same data if the pool is mapped
+
+                // move start to end of this page
+                dest = (uint8_t *)dest + copysize;
+                p += copysize;
+                size -= copysize;
+            }
+            // end overlaps?
+            else if (p < page->start && (p + size) > page->start)
+            {
+                const VPtrSize offset = page->start - p;
+                const VPtrSize copysize = private_utils::minimal(size - offset, (VPtrSize)page->size);
+                waitForPage(page);
+                memmove((uint8_t *)dest + offset, page->pool, copysize);
+                size = offset;
+            }
         }
     }
 
     if (size > 0)
     {
         // read in rest of the data
-        doRead(dest, p, size);
+        readData(dest, p, size);
 #ifdef VIRTMEM_TRACE_STATS
         bytesRead += size;
 #endif
@@ -132,50 +896,53 @@ void BaseVAlloc::copyRawData(void *dest, VPtrNum p, VPtrSize size)
 // This function is the reverse of copyRawData()
 void BaseVAlloc::saveRawData(void *src, VPtrNum p, VPtrSize size)
 {
-    for (int8_t i=bigPages.freeIndex; i!=-1 && size; i=bigPages.pages[i].next)
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&bigPageIndex, p, size, key); k && size; --k, ++key)
     {
-        if (!bigPages.pages[i].start)
-            continue;
-
-        const VPtrNum pageend = bigPages.pages[i].start + bigPages.size;
-        if (p >= bigPages.pages[i].start && p < pageend) // start address within this page?
+        for (LockPage *page=getIndexBucket(&bigPageIndex, key); page && size; page=page->indexNext)
         {
-            const VPtrSize offset = p - bigPages.pages[i].start;
-            const VPtrSize copysize = private_utils::minimal(size, bigPages.pages[i].size - offset);
-
-            // only copy data if regular page is already dirty or data changed
-            if (bigPages.pages[i].dirty || memcmp(bigPages.pages[i].pool + offset, src, copysize) != 0)
+            const VPtrNum pageend = page->start + page->size;
+            if (p >= page->start && p < pageend) // start address within this page?
             {
-                memcpy(bigPages.pages[i].pool + offset, src, copysize);
-                bigPages.pages[i].dirty = true;
-            }
+                const VPtrSize offset = p - page->start;
+                const VPtrSize copysize = private_utils::minimal(size, page->size - offset);
+                waitForPage(page);
 
-            // move start to end of this page
-            src = (uint8_t *)src + copysize;
-            p += copysize;
-            size -= copysize;
-        }
-        // end overlaps?
-        else if (p < bigPages.pages[i].start && (p + size) > bigPages.pages[i].start)
-        {
-            const VPtrSize offset = bigPages.pages[i].start - p;
-            const VPtrSize copysize = private_utils::minimal(size - offset, (VPtrSize)bigPages.pages[i].size);
+                // only copy data if regular page is already dirty or data changed
+                if (page->dirty || memcmp(page->pool + offset, src, copysize) != 0)
+                {
+                    setPageDirty(page, offset, copysize);
+                    memmove(page->pool + offset, src, copysize); // NOTE: may be the same data if the pool is mapped
+                }
 
-            // only copy data if regular page is already dirty or data changed
-            if (bigPages.pages[i].dirty || memcmp(bigPages.pages[i].pool, (uint8_t *)src + offset, copysize) != 0)
-            {
-                memcpy(bigPages.pages[i].pool, (uint8_t *)src + offset, copysize);
-                bigPages.pages[i].dirty = true;
+                // move start to end of this page
+                src = (uint8_t *)src + copysize;
+                p += copysize;
+                size -= copysize;
             }
+            // end overlaps?
+            else if (p < page->start && (p + size) > page->start)
+            {
+                const VPtrSize offset = page->start - p;
+                const VPtrSize copysize = private_utils::minimal(size - offset, (VPtrSize)page->size);
+                waitForPage(page);
 
-            size = offset;
+                // only copy data if regular page is already dirty or data changed
+                if (page->dirty || memcmp(page->pool, (uint8_t *)src + offset, copysize) != 0)
+                {
+                    setPageDirty(page, 0, copysize);
+                    memmove(page->pool, (uint8_t *)src + offset, copysize);
+                }
+
+                size = offset;
+            }
         }
     }
 
     if (size > 0)
     {
         // read in rest of the data
-        doWrite(src, p, size);
+        writeData(src, p, size);
 #ifdef VIRTMEM_TRACE_STATS
         bytesWritten += size;
 #endif
@@ -191,52 +958,106 @@ void *BaseVAlloc::pullRawData(VPtrNum p, VPtrSize size, bool readonly, bool forc
      * other overlapping pages.
      * Otherwise if an empty page is found use it but keep searching for the above.
      * Otherwise if a 'clean' page is found use that but keep searching for the above.
-     * Otherwise look for dirty pages in a FIFO way. */
+     * Otherwise look for dirty pages in a FIFO way.
+     * If a replacement policy is set, it selects the page instead of the last two steps.
+     * Only pages of the shard of the new page are considered (see CacheShard). */
+
+    VirtPageIndex pageindex = -1;
+    enum { STATE_GOTFULL, STATE_GOTPARTIAL, STATE_GOTEMPTY, STATE_GOTCLEAN, STATE_GOTDIRTY, STATE_GOTVICTIM, STATE_GOTNONE } pagefindstate = STATE_GOTNONE;
 
-    int8_t pageindex = -1;
-    enum { STATE_GOTFULL, STATE_GOTPARTIAL, STATE_GOTEMPTY, STATE_GOTCLEAN, STATE_GOTDIRTY, STATE_GOTNONE } pagefindstate = STATE_GOTNONE;
+    VPtrNum pagestart = 0;
+    VirtPageSize pagesize = 0;
+    CacheShard *shard = 0;
 
     // Start by looking for fitting pages, the ideal situation
-    if ((pageindex = findFreePage(&bigPages, p, size, forcestart)) != -1)
+    if ((pageindex = findFreePage(p, size, forcestart)) != -1)
+    {
         pagefindstate = STATE_GOTFULL;
+        BasePagePolicy *policy = cacheShards[getPageShard(pageindex)].pagePolicy;
+        if (policy)
+            policy->pageAccessed(pageindex);
+        waitForPage(&bigPages.pages[pageindex]);
+#ifdef VIRTMEM_READ_AHEAD
+        if (bigPages.pages[pageindex].prefetched)
+        {
+            bigPages.pages[pageindex].prefetched = false;
+#ifdef VIRTMEM_TRACE_STATS
+            ++readAheadHits;
+#endif
+        }
+#endif
+#ifdef VIRTMEM_TRACE_STATS
+        ++bigPageHits;
+#endif
+    }
     else
     {
-        const VPtrNum newpageend = p + bigPages.size;
-
-        for (int8_t i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+        pagestart = getBigPageStart(p, size, forcestart, pagesize);
+        // NOTE: pages that are locked right away may come from any shard, as all shards are locked then
+        const uint8_t shardindex = (forcestart) ? getLockShard(p) : getRegionShard(pagestart);
+        shard = &cacheShards[shardindex];
+
+        // Invalidate any pages that overlap with the new page
+        VPtrNum key;
+        for (VPtrSize k=getIndexKeys(&bigPageIndex, pagestart, pagesize, key); k; --k, ++key)
         {
-            if (bigPages.pages[i].start != 0)
+            for (LockPage *page=getIndexBucket(&bigPageIndex, key), *next; page; page=next)
             {
-                const VPtrNum pageend = bigPages.pages[i].start + bigPages.size;
-                if ((p >= bigPages.pages[i].start && p < pageend) ||
-                    (newpageend >= bigPages.pages[i].start && newpageend <= pageend))
+                next = page->indexNext;
+                if (page->start < (pagestart + pagesize) && pagestart < (page->start + page->size))
                 {
-                    pageindex = i;
-                    syncBigPage(&bigPages.pages[pageindex]);
-                    bigPages.pages[i].start = 0; // invalidate
-                    pagefindstate = STATE_GOTPARTIAL;
+                    syncBigPage(page);
+                    uncacheBigPage(page);
+                    page->start = 0; // invalidate
+                    if (getPageShard(page - bigPages.pages) == shardindex)
+                    {
+                        pageindex = page - bigPages.pages;
+                        pagefindstate = STATE_GOTPARTIAL;
+                    }
                 }
             }
-            else if (pagefindstate != STATE_GOTPARTIAL)
+        }
+
+        for (VirtPageIndex i=bigPages.freeIndex; i!=-1 && pagefindstate != STATE_GOTPARTIAL; i=bigPages.pages[i].next)
+        {
+            if (getPageShard(i) != shardindex)
+                continue;
+
+            // prefer the first empty page, so that data loaded in sequence also ends up in adjacent pools,
+            // which allows merging writes (see syncBigPage())
+            if (bigPages.pages[i].start == 0 && (pagefindstate != STATE_GOTEMPTY || i < pageindex))
             {
                 pageindex = i;
                 pagefindstate = STATE_GOTEMPTY;
             }
 
-            if (pagefindstate > STATE_GOTCLEAN)
+            // leave the choice to the replacement policy, if any
+            if (pagefindstate > STATE_GOTCLEAN && !shard->pagePolicy)
             {
-                if (!bigPages.pages[i].dirty || (++bigPages.pages[i].cleanSkips) >= PAGE_MAX_CLEAN_SKIPS)
+#ifdef VIRTMEM_READ_AHEAD
+                // pages that were read ahead are skipped like dirty pages, so they are less likely swapped before use
+                const bool clean = !bigPages.pages[i].dirty && !bigPages.pages[i].prefetched;
+#else
+                const bool clean = !bigPages.pages[i].dirty;
+#endif
+                if (clean || (++bigPages.pages[i].cleanSkips) >= PAGE_MAX_CLEAN_SKIPS)
                 {
                     pageindex = i;
                     pagefindstate = STATE_GOTCLEAN;
                 }
-                else if (pagefindstate != STATE_GOTDIRTY && i == nextPageToSwap)
+                else if (pagefindstate != STATE_GOTDIRTY && i == shard->nextPageToSwap)
                 {
                     pageindex = i;
                     pagefindstate = STATE_GOTDIRTY;
                 }
             }
         }
+
+        if (pagefindstate == STATE_GOTNONE && shard->pagePolicy)
+        {
+            pageindex = shard->pagePolicy->getVictim();
+            pagefindstate = STATE_GOTVICTIM;
+        }
     }
 
     // 'pageindex' should now point to page which is within or closest to pointer range
@@ -248,42 +1069,25 @@ void *BaseVAlloc::pullRawData(VPtrNum p, VPtrSize size, bool readonly, bool forc
 //        std::cout << "getPool switches " << (page - memPageList) << " from: " << page->start << " to " << p << std::endl;
 
         if (bigPages.pages[pageindex].start != 0)
-            syncBigPage(&bigPages.pages[pageindex]);
-
-        if (pagefindstate == STATE_GOTDIRTY)
         {
-            nextPageToSwap = bigPages.pages[pageindex].next;
-            if (nextPageToSwap == -1)
-                nextPageToSwap = bigPages.freeIndex;
+            syncBigPage(&bigPages.pages[pageindex]);
+            uncacheBigPage(&bigPages.pages[pageindex]);
         }
-        else
-            nextPageToSwap = bigPages.freeIndex;
+
+        shard->nextPageToSwap = getNextShardPage(shard - cacheShards, (pagefindstate == STATE_GOTDIRTY) ? pageindex : -1);
 
         // Load in page
-        if (/*!forcestart*/false) // check alignment UNDONE
-        {
-            const VPtrNum alignp = p - (p & (sizeof(TAlign) - 1));
-            if ((alignp + bigPages.size) >= (p + size))
-                bigPages.pages[pageindex].start = alignp;
-            else
-                bigPages.pages[pageindex].start = p;
-        }
-        else
-            bigPages.pages[pageindex].start = p;
+        bigPages.pages[pageindex].start = pagestart;
+        bigPages.pages[pageindex].size = pagesize;
+        cacheBigPage(&bigPages.pages[pageindex]);
 
 //        std::cout << "start: " << bigPages.pages[pageindex].start <<"/" << p << std::endl;
 
-        const VirtPageSize rdsize = private_utils::minimal((poolSize - bigPages.pages[pageindex].start), (VPtrSize)bigPages.size);
-        doRead(bigPages.pages[pageindex].pool, bigPages.pages[pageindex].start, rdsize);
-
-#ifdef VIRTMEM_TRACE_STATS
-        ++bigPageReads;
-        bytesRead += rdsize;
-#endif
+        loadBigPage(pageindex);
     }
 
     if (!readonly)
-        bigPages.pages[pageindex].dirty = true;
+        setPageDirty(&bigPages.pages[pageindex], p - bigPages.pages[pageindex].start, size);
 
     ASSERT(p >= bigPages.pages[pageindex].start);
 
@@ -297,15 +1101,209 @@ void *BaseVAlloc::pullRawData(VPtrNum p, VPtrSize size, bool readonly, bool forc
 
 void BaseVAlloc::pushRawData(VPtrNum p, const void *d, VPtrSize size)
 {
+    // big pages don't extend to other regions of cache shards (see CacheShard), so data is written per region
+    while (!isShardRange(p, size))
+    {
+        const VPtrSize partsize = getRegionEnd(p) - p;
+        pushRawData(p, d, partsize);
+        p += partsize;
+        d = static_cast<const uint8_t *>(d) + partsize;
+        size -= partsize;
+    }
+
     void *pool = pullRawData(p, size, false, false);
-    memcpy(pool, d, size);
+    memmove(pool, d, size); // NOTE: may be the same data if the pool is mapped
+}
+
+// Copies data within the memory pool without swapping pages: data is read from cached big pages or the
+// memory pool and written to cached big pages or directly to the memory pool. An unlocked big page is
+// used as buffer. The source and destination may only overlap if the destination comes first.
+void BaseVAlloc::copyPoolData(VPtrNum dest, VPtrNum src, VPtrSize size)
+{
+    // unlocked small and medium pages may contain (modified) copies of the data
+    PageInfo *pinfos[] = { &smallPages, &mediumPages };
+    for (uint8_t i=0; i<2; ++i)
+    {
+        for (VirtPageIndex j=pinfos[i]->lockedIndex; j!=-1; )
+        {
+            LockPage *page = &pinfos[i]->pages[j];
+            if ((page->start < (src + size) && src < (page->start + page->size)) ||
+                (page->start < (dest + size) && dest < (page->start + page->size)))
+            {
+                ASSERT(page->locks == 0);
+                j = freeLockedPage(pinfos[i], j);
+            }
+            else
+                j = page->next;
+        }
+    }
+
+    if (mappedPool)
+    {
+        // cached big pages point into the pool, so the data can be moved in place
+        if (stateStored)
+            invalidateState();
+        memmove(mappedPool + dest, mappedPool + src, size);
+        return;
+    }
+
+    // take a big page as buffer, preferably one that is empty or clean
+    LockPage *buffer = 0;
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    {
+        LockPage *page = &bigPages.pages[i];
+        if (!buffer || buffer->start != 0)
+        {
+            if (page->start == 0 || !buffer || (buffer->dirty && !page->dirty))
+                buffer = page;
+        }
+    }
+
+    uint8_t smallbuffer[32];
+    uint8_t *pool = smallbuffer;
+    VPtrSize bufsize = sizeof(smallbuffer);
+    if (buffer)
+    {
+        if (buffer->start != 0)
+        {
+            syncBigPage(buffer);
+            uncacheBigPage(buffer);
+            buffer->start = 0;
+        }
+        pool = buffer->pool;
+        bufsize = bigPages.size;
+    }
+
+    for (VPtrSize offset=0; offset<size; offset+=bufsize)
+    {
+        const VPtrSize copysize = private_utils::minimal(bufsize, size - offset);
+        copyRawData(pool, src + offset, copysize);
+        saveRawData(pool, dest + offset, copysize);
+    }
+}
+
+// Releases the data of freed memory: the parts of the given range that cover whole (aligned) big pages
+// are dropped from the cache without writing them back, and the memory pool is asked to free their storage
+void BaseVAlloc::trimPool(VPtrNum start, VPtrSize size)
+{
+    const VPtrNum first = (start + bigPages.size - 1) / bigPages.size * bigPages.size;
+    const VPtrNum last = (start + size) / bigPages.size * bigPages.size;
+    if (first >= last)
+        return;
+
+    LOCK_CACHE;
+
+    // unlocked pages may still contain (modified) copies of the data
+    PageInfo *pinfos[] = { &smallPages, &mediumPages };
+    for (uint8_t i=0; i<2; ++i)
+    {
+        for (VirtPageIndex j=pinfos[i]->lockedIndex; j!=-1; )
+        {
+            LockPage *page = &pinfos[i]->pages[j];
+            if (page->start >= first && (page->start + page->size) <= last)
+            {
+                ASSERT(page->locks == 0);
+                page->dirty = false;
+                j = freeLockedPage(pinfos[i], j);
+            }
+            else
+                j = page->next;
+        }
+    }
+
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    {
+        LockPage *page = &bigPages.pages[i];
+        if (page->start >= first && (page->start + bigPages.size) <= last)
+        {
+            uncacheBigPage(page);
+            page->start = 0;
+            page->dirty = false;
+        }
+    }
+
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    for (VPtrSize i=0; i<VIRTMEM_HEADER_CACHE_SIZE; ++i)
+    {
+        if (headerCache[i].start >= first && headerCache[i].start < last)
+            headerCache[i].start = 0;
+    }
+#endif
+
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+        asyncIO->wait(first, last - first);
+#endif
+
+    if (stateStored)
+        invalidateState();
+    doTrim(first, last - first);
 }
 
-const BaseVAlloc::UMemHeader *BaseVAlloc::getHeaderConst(VPtrNum p)
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+// Returns the cache entry for the header at p. The header is read from the pool if load is set.
+BaseVAlloc::CachedHeader *BaseVAlloc::getCachedHeader(VPtrNum p, bool load)
+{
+    CachedHeader *ch = &headerCache[(p / sizeof(UMemHeader)) % VIRTMEM_HEADER_CACHE_SIZE];
+    if (ch->start != p)
+    {
+        if (ch->start && ch->dirty)
+            write(ch->start, &ch->header, sizeof(UMemHeader));
+        ch->start = p;
+        ch->dirty = false;
+        if (load)
+            read(p, &ch->header, sizeof(UMemHeader));
+    }
+    return ch;
+}
+
+// Removes a header that became part of another memory block, so it is never written
+void BaseVAlloc::dropHeader(VPtrNum p)
+{
+    CachedHeader *ch = &headerCache[(p / sizeof(UMemHeader)) % VIRTMEM_HEADER_CACHE_SIZE];
+    if (ch->start == p)
+        ch->start = 0;
+}
+#endif
+
+// Writes all modified cached headers to the memory pool
+void BaseVAlloc::flushHeaders()
+{
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    for (VPtrSize i=0; i<VIRTMEM_HEADER_CACHE_SIZE; ++i)
+    {
+        if (headerCache[i].start && headerCache[i].dirty)
+        {
+            write(headerCache[i].start, &headerCache[i].header, sizeof(UMemHeader));
+            headerCache[i].dirty = false;
+        }
+    }
+#endif
+}
+
+// Marks data in a page as modified. Big pages of a mapped memory pool are modified in place, so any stored
+// state is invalidated first (see invalidateState()).
+void BaseVAlloc::setPageDirty(LockPage *page, VirtPageSize offset, VirtPageSize size)
+{
+    if (stateStored && mappedPool && page >= bigPages.pages && page < &bigPages.pages[bigPages.count])
+        invalidateState();
+    page->setDirty(offset, size);
+}
+
+// Copies the header at p. The copy is made while the cache is locked, since other threads may swap out the
+// page holding the header (see VIRTMEM_THREAD_SAFE).
+void BaseVAlloc::getHeader(VPtrNum p, UMemHeader *h)
 {
     if (p == BASE_INDEX)
-        return &baseFreeList;
-    return reinterpret_cast<UMemHeader *>(read(p, sizeof(UMemHeader)));
+        memcpy(h, &baseFreeList, sizeof(UMemHeader));
+    else
+    {
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+        memcpy(h, &getCachedHeader(p, true)->header, sizeof(UMemHeader));
+#else
+        read(p, h, sizeof(UMemHeader));
+#endif
+    }
 }
 
 void BaseVAlloc::updateHeader(VPtrNum p, UMemHeader *h)
@@ -313,25 +1311,46 @@ void BaseVAlloc::updateHeader(VPtrNum p, UMemHeader *h)
     if (p == BASE_INDEX)
         memcpy(&baseFreeList, h, sizeof(UMemHeader));
     else
+    {
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+        CachedHeader *ch = getCachedHeader(p, false);
+        memcpy(&ch->header, h, sizeof(UMemHeader));
+        ch->dirty = true;
+#else
         write(p, h, sizeof(UMemHeader));
+#endif
+    }
 }
 
-int8_t BaseVAlloc::findFreePage(BaseVAlloc::PageInfo *pinfo, VPtrNum p, VPtrSize size, bool atstart)
+VirtPageIndex BaseVAlloc::findFreePage(VPtrNum p, VPtrSize size, bool atstart)
 {
     const VPtrNum pend = p + size;
-    for (int8_t i=pinfo->freeIndex; i!=-1; i=pinfo->pages[i].next)
+    VPtrNum key;
+    VPtrSize k;
+
+    if (atstart)
     {
-        if (pinfo->pages[i].start != 0 && ((atstart && pinfo->pages[i].start == p) ||
-            (!atstart && p >= pinfo->pages[i].start && pend <= (pinfo->pages[i].start + pinfo->pages[i].size))))
-            return i;
+        key = p >> indexShift;
+        k = 1;
+    }
+    else
+        k = getIndexKeys(&bigPageIndex, p, size, key);
+
+    for (; k; --k, ++key)
+    {
+        for (LockPage *page=getIndexBucket(&bigPageIndex, key); page; page=page->indexNext)
+        {
+            if ((atstart && page->start == p && size <= page->size) || (!atstart && p >= page->start && pend <= (page->start + page->size)))
+                return page - bigPages.pages;
+        }
     }
 
     return -1;
 }
 
-int8_t BaseVAlloc::findUnusedLockedPage(PageInfo *pinfo)
+VirtPageIndex BaseVAlloc::findUnusedLockedPage(PageInfo *pinfo)
 {
-    for (int8_t i=pinfo->lockedIndex; i!=-1; i=pinfo->pages[i].next)
+    for (VirtPageIndex i=pinfo->lockedIndex; i!=-1; i=pinfo->pages[i].next)
     {
         if (pinfo->pages[i].locks == 0)
             return i;
@@ -346,10 +1365,13 @@ void BaseVAlloc::syncLockedPage(BaseVAlloc::LockPage *page)
     if (page->dirty)
     {
 #if 1
-        saveRawData(page->pool, page->start, page->size);
+        // only save modified data, note that the page may have shrunk since it was modified
+        const VirtPageSize end = private_utils::minimal(page->dirtyEnd, page->size);
+        if (page->dirtyStart < end)
+            saveRawData(page->pool + page->dirtyStart, page->start + page->dirtyStart, end - page->dirtyStart);
 #else
         void *data = pullRawData(page->start, page->size, true, false);
-        const int8_t pageindex = findFreePage(&bigPages, page->start, page->size, false);
+        const VirtPageIndex pageindex = findFreePage(page->start, page->size, false);
         ASSERT(pageindex != -1);
 
         // only copy data if regular page is already dirty or data changed
@@ -364,115 +1386,113 @@ void BaseVAlloc::syncLockedPage(BaseVAlloc::LockPage *page)
     }
 }
 
-int8_t BaseVAlloc::lockPage(PageInfo *pinfo, VPtrNum ptr, VirtPageSize size)
+VirtPageIndex BaseVAlloc::lockPage(PageInfo *pinfo, VPtrNum ptr, VirtPageSize size)
 {
-    int8_t index;
+    VirtPageIndex index;
 
     if (pinfo == &bigPages)
     {
         // read in data and lock the page that was used
         // NOTE: set readonly here, the eventual ro flag should be set afterwards
         pullRawData(ptr, size, true, true);
-        index = findFreePage(pinfo, ptr, size, true);
+        index = findFreePage(ptr, size, true);
         if (size < pinfo->size)
             syncBigPage(&bigPages.pages[index]); // synchronize if there is data outside lock range
+        uncacheBigPage(&bigPages.pages[index]);
     }
     else
+    {
         index = pinfo->freeIndex;
+        pinfo->pages[index].start = ptr;
+    }
 
-    if (index == pinfo->freeIndex)
-        pinfo->freeIndex = pinfo->pages[pinfo->freeIndex].next;
-    else
+    unlinkPage(pinfo, pinfo->freeIndex, index);
+
+    if (pinfo == &bigPages)
     {
-        // find previous
-        int8_t previ = pinfo->freeIndex;
-        for (; index!=pinfo->pages[previ].next; previ=pinfo->pages[previ].next)
-            ;
-        pinfo->pages[previ].next = pinfo->pages[index].next;
+        CacheShard *shard = &cacheShards[getPageShard(index)];
+        if (shard->nextPageToSwap == index)
+            shard->nextPageToSwap = getNextShardPage(shard - cacheShards, -1); // locked page, can't swap it anymore
     }
 
-    if (pinfo == &bigPages && nextPageToSwap == index)
-        nextPageToSwap = pinfo->freeIndex; // locked page, can't swap it anymore
-
-    pinfo->pages[index].next = pinfo->lockedIndex;
-    pinfo->lockedIndex = index;
+    linkPage(pinfo, pinfo->lockedIndex, index);
+    indexPage(&lockedPageIndex, &pinfo->pages[index]);
 
     return index;
 }
 
-int8_t BaseVAlloc::freeLockedPage(BaseVAlloc::PageInfo *pinfo, int8_t index)
+VirtPageIndex BaseVAlloc::freeLockedPage(BaseVAlloc::PageInfo *pinfo, VirtPageIndex index)
 {
-    if (pinfo != &bigPages)
-        syncLockedPage(&pinfo->pages[index]);
-    else if (pinfo->pages[index].size < pinfo->size /*|| (pinfo->pages[index].start & (sizeof(TAlign)-1)) != 0*/)
+    unindexPage(&lockedPageIndex, &pinfo->pages[index]);
+
+    // Big pages are kept for regular IO, unless they were shrunk, do not map a frame, belong to another
+    // shard than their data (see CacheShard) or overlap with data cached by other pages (e.g. after a
+    // partial read of the lock)
+    bool keep = false;
+    if (pinfo == &bigPages && pinfo->pages[index].size == pinfo->size &&
+        isShardRange(pinfo->pages[index].start, pinfo->pages[index].size) &&
+        getRegionShard(pinfo->pages[index].start) == getPageShard(index))
     {
-        // only synchronize shrunk big pages as they cannot be used for regular IO or unaligned pages
-        syncLockedPage(&pinfo->pages[index]);
-        // restore as regular unused free page
-        pinfo->pages[index].start = 0;
-        pinfo->pages[index].size = pinfo->size;
+        keep = !isBigPageCached(pinfo->pages[index].start, pinfo->pages[index].size);
+#ifdef VIRTMEM_ALIGNED_PAGES
+        keep = keep && (pinfo->pages[index].start % bigPages.size) == 0;
+#endif
     }
 
-    const int8_t ret = pinfo->pages[index].next;
+    if (!keep)
+        syncLockedPage(&pinfo->pages[index]);
+
+    const VirtPageIndex ret = pinfo->pages[index].next;
 
-    if (index == pinfo->lockedIndex)
-        pinfo->lockedIndex = pinfo->pages[index].next;
-    else
+    unlinkPage(pinfo, pinfo->lockedIndex, index);
+    linkPage(pinfo, pinfo->freeIndex, index);
+
+    if (pinfo == &bigPages)
     {
-        int prevind = pinfo->lockedIndex;
-        for (; pinfo->pages[prevind].next != index; prevind=pinfo->pages[prevind].next)
-            ;
-        pinfo->pages[prevind].next = pinfo->pages[index].next;
+        if (!keep)
+        {
+            // restore as regular unused free page
+            pinfo->pages[index].start = 0;
+            pinfo->pages[index].size = pinfo->size;
+            pinfo->pages[index].dirty = false;
+        }
+        else
+            cacheBigPage(&pinfo->pages[index]); // keep data for regular IO
     }
-    pinfo->pages[index].next = pinfo->freeIndex;
-    pinfo->freeIndex = index;
 //    printf("freeing page %d - free/used: %d/%d\n", index, pinfo->freeIndex, pinfo->usedIndex);
 
-    if (pinfo == &bigPages && nextPageToSwap == -1)
-        nextPageToSwap = pinfo->freeIndex;
+    if (pinfo == &bigPages && cacheShards[getPageShard(index)].nextPageToSwap == -1)
+        cacheShards[getPageShard(index)].nextPageToSwap = index;
 
     pinfo->pages[index].locks = 0;
 
     return ret;
 }
 
-int8_t BaseVAlloc::findLockedPage(PageInfo *pinfo, VPtrNum p)
+BaseVAlloc::LockPage *BaseVAlloc::findLockedPage(VPtrNum p)
 {
-    for (int8_t i=pinfo->lockedIndex; i!=-1; i=pinfo->pages[i].next)
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&lockedPageIndex, p, 1, key); k; --k, ++key)
     {
-        if (p >= pinfo->pages[i].start && (p - pinfo->pages[i].start) < pinfo->pages[i].size)
-            return i;
+        for (LockPage *page=getIndexBucket(&lockedPageIndex, key); page; page=page->indexNext)
+        {
+            if (p >= page->start && (p - page->start) < page->size)
+                return page;
+        }
     }
 
-    return -1;
-}
-
-BaseVAlloc::LockPage *BaseVAlloc::findLockedPage(VPtrNum p)
-{
-    int8_t index = findLockedPage(&smallPages, p);
-    if (index != -1)
-        return &smallPages.pages[index];
-
-    index = findLockedPage(&mediumPages, p);
-    if (index != -1)
-        return &mediumPages.pages[index];
-
-    index = findLockedPage(&bigPages, p);
-    if (index != -1)
-        return &bigPages.pages[index];
-
     return 0;
 }
 
-uint8_t BaseVAlloc::getUnlockedPages(const PageInfo *pinfo) const
+VirtPageCount BaseVAlloc::getUnlockedPages(const PageInfo *pinfo) const
 {
-    uint8_t ret = 0;
+    VirtPageCount ret = 0;
 
-    for (int8_t i=pinfo->freeIndex; i!=-1; i=pinfo->pages[i].next)
+    for (VirtPageIndex i=pinfo->freeIndex; i!=-1; i=pinfo->pages[i].next)
         ++ret;
 
     // also include unused locked pages
-    for (int8_t i=pinfo->lockedIndex; i!=-1; i=pinfo->pages[i].next)
+    for (VirtPageIndex i=pinfo->lockedIndex; i!=-1; i=pinfo->pages[i].next)
     {
         if (pinfo->pages[i].locks == 0)
             ++ret;
@@ -496,21 +1516,84 @@ void BaseVAlloc::writeZeros(VPtrNum start, VPtrSize n)
         doWrite(bigPages.pages[0].pool, start + i, private_utils::minimal(n - i, (VPtrSize)bigPages.size));
 }
 
+// Computes the checksum of a superblock, which is stored in it
+static uint32_t getSuperblockChecksum(const void *sb, size_t size)
+{
+    // FNV-1a
+    uint32_t ret = 2166136261u;
+    for (size_t i=0; i<size; ++i)
+        ret = (ret ^ static_cast<const uint8_t *>(sb)[i]) * 16777619u;
+    return ret;
+}
+
+// Marks the stored state of a persistent memory pool as invalid before the pool is modified, so that a pool
+// that was not stopped properly is never reopened with a state that does not match its data
+void BaseVAlloc::invalidateState()
+{
+    LOCK_POOL;
+    if (!stateStored)
+        return; // another thread was first
+    stateStored = false;
+    const uint32_t magic = 0;
+    writeData(&magic, START_OFFSET + offsetof(Superblock, magic), sizeof(magic));
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+        return; // NOTE: background writes are performed in order
+#endif
+    doFlush();
+}
+
+// Restores the allocator state of a persistent memory pool. Returns false if the pool has no (valid) state.
+bool BaseVAlloc::loadSuperblock()
+{
+    Superblock sb;
+    doRead(&sb, START_OFFSET, sizeof(sb));
+
+    const uint32_t checksum = sb.checksum;
+    sb.checksum = 0;
+    if (sb.magic != SUPERBLOCK_MAGIC || sb.version != SUPERBLOCK_VERSION || sb.headerSize != sizeof(UMemHeader) ||
+        checksum != getSuperblockChecksum(&sb, sizeof(sb)))
+        return false;
+
+    poolSize = private_utils::maximal(poolSize, sb.poolSize); // may have grown
+    poolFreePos = sb.poolFreePos;
+    freePointer = sb.freePointer;
+    root = sb.root;
+    baseFreeList = sb.baseFreeList;
+#ifdef VIRTMEM_TRACE_STATS
+    memUsed = maxMemUsed = sb.memUsed;
+#endif
+    return true;
+}
+
 /**
  * @fn BaseVAlloc::start()
  * @brief Starts the allocator.
  *
  * This function should always be called during initialization, i.e. in *setup()* function of your sketch.
  * If the allocator was stopped (see \ref stop()), this function should be called again before using the allocator.
- * All used virtual memory (if any) will be cleared during initialization.
+ * All used virtual memory (if any) will be cleared during initialization, unless the memory pool is persistent
+ * (see \ref setPersistent()).
  */
 void BaseVAlloc::start()
 {
+#ifdef VIRTMEM_ASYNC_IO
+    delete asyncIO; // in case stop() wasn't called
+    asyncIO = 0;
+#endif
+
     freePointer = 0;
-    nextPageToSwap = 0;
     baseFreeList.s.next = 0;
     baseFreeList.s.size = 0;
     poolFreePos = START_OFFSET + sizeof(UMemHeader);
+    if (persistent)
+        poolFreePos += (sizeof(Superblock) + sizeof(UMemHeader) - 1) / sizeof(UMemHeader) * sizeof(UMemHeader);
+    compactPos = 0;
+    root = 0;
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    for (VPtrSize i=0; i<VIRTMEM_HEADER_CACHE_SIZE; ++i)
+        headerCache[i].start = 0;
+#endif
 #ifdef VIRTMEM_TRACE_STATS
     resetStats();
 #endif
@@ -521,12 +1604,14 @@ void BaseVAlloc::start()
         plist[pindex]->freeIndex = 0;
         plist[pindex]->lockedIndex = -1;
 
-        for (uint8_t i=0; i<plist[pindex]->count; ++i)
+        for (VirtPageCount i=0; i<plist[pindex]->count; ++i)
         {
             if (i == (plist[pindex]->count - 1))
                 plist[pindex]->pages[i].next = -1;
             else
                 plist[pindex]->pages[i].next = i + 1;
+            plist[pindex]->pages[i].prev = i - 1;
+            plist[pindex]->pages[i].indexNext = 0;
 
             if (plist[pindex] == &bigPages)
                 plist[pindex]->pages[i].size = plist[pindex]->size;
@@ -534,10 +1619,61 @@ void BaseVAlloc::start()
             plist[pindex]->pages[i].locks = 0;
             plist[pindex]->pages[i].cleanSkips = 0;
             plist[pindex]->pages[i].dirty = false;
+#ifdef VIRTMEM_READ_AHEAD
+            plist[pindex]->pages[i].prefetched = false;
+#endif
+#ifdef VIRTMEM_ASYNC_IO
+            plist[pindex]->pages[i].loading = false;
+#endif
         }
     }
 
+    for (uint8_t i=0; i<shardCount; ++i)
+    {
+        cacheShards[i].nextPageToSwap = cacheShards[i].firstPage;
+        if (cacheShards[i].pagePolicy)
+            cacheShards[i].pagePolicy->reset();
+    }
+
+#ifdef VIRTMEM_READ_AHEAD
+    for (uint8_t i=0; i<VIRTMEM_READ_AHEAD_STREAMS; ++i)
+    {
+        readAheadStreams[i].low = readAheadStreams[i].high = 0;
+        readAheadStreams[i].direction = 0;
+    }
+    nextReadAheadStream = 0;
+    readAheadWindow = 1;
+#endif
+
+    initPageIndex(&lockedPageIndex, lockedPageIndex.buckets, lockedPageIndex.mask + 1);
+    initPageIndex(&bigPageIndex, bigPageIndex.buckets, bigPageIndex.mask + 1);
+    if (allocEngine)
+        allocEngine->reset();
+
     doStart();
+
+    // the allocation engines keep their state in RAM
+    ASSERT(!persistent || !allocEngine);
+    const bool reopened = persistent && loadSuperblock();
+    if (persistent && !reopened)
+        doTrim(0, poolSize); // discard old data
+    stateStored = reopened;
+
+#if VIRTMEM_ZERO_MAP_SIZE > 0
+    // the pool is zero until written, choose the smallest region size that covers the (grown) pool
+    // NOTE: mapped pools are accessed in place, so the map would not be updated
+    memset(zeroMap, (mappedPool) ? 0 : 0xFF, sizeof(zeroMap));
+    const VPtrSize mapsize = private_utils::maximal(poolSize, maxPoolSize);
+    for (zeroMapShift=0; mapsize && ((mapsize - 1) >> zeroMapShift) >= (VPtrNum)(VIRTMEM_ZERO_MAP_SIZE * 8); ++zeroMapShift)
+        ;
+    if (reopened)
+        clearZeroData(0, poolFreePos);
+#endif
+
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIOEnabled && !mappedPool)
+        asyncIO = new private_utils::AsyncIO(this);
+#endif
 }
 
 /**
@@ -548,6 +1684,14 @@ void BaseVAlloc::start()
  */
 void BaseVAlloc::stop()
 {
+    if (persistent)
+        checkpoint();
+
+#ifdef VIRTMEM_ASYNC_IO
+    // finishes all pending I/O
+    delete asyncIO;
+    asyncIO = 0;
+#endif
     doStop();
 }
 
@@ -559,6 +1703,22 @@ void BaseVAlloc::stop()
  */
 VPtrNum BaseVAlloc::allocRaw(VPtrSize size)
 {
+    LOCK_ALLOC;
+
+    if (allocEngine)
+    {
+        VPtrSize blocksize;
+        const VPtrNum ret = allocEngine->alloc(size, blocksize);
+#ifdef VIRTMEM_TRACE_STATS
+        if (ret)
+        {
+            memUsed += blocksize;
+            maxMemUsed = private_utils::maximal(maxMemUsed, memUsed);
+        }
+#endif
+        return ret;
+    }
+
     const VPtrSize quantity = (size + sizeof(UMemHeader) - 1) / sizeof(UMemHeader) + 1;
     VPtrNum prevp = freePointer;
 
@@ -572,13 +1732,15 @@ VPtrNum BaseVAlloc::allocRaw(VPtrSize size)
         baseFreeList.s.size = 0;
     }
 
-    VPtrNum p = getHeaderConst(prevp)->s.next;
+    UMemHeader h;
+    getHeader(prevp, &h);
+    VPtrNum p = h.s.next;
     while (true)
     {
-        const UMemHeader *consth = getHeaderConst(p);
+        getHeader(p, &h);
 
         // big enough ?
-        if (consth->s.size >= quantity)
+        if (h.s.size >= quantity)
         {
 #ifdef VIRTMEM_TRACE_STATS
             memUsed += (quantity * sizeof(UMemHeader));
@@ -586,28 +1748,26 @@ VPtrNum BaseVAlloc::allocRaw(VPtrSize size)
 #endif
 
             // exactly ?
-            if (consth->s.size == quantity)
+            if (h.s.size == quantity)
             {
                 // just eliminate this block from the free list by pointing
                 // its prev's next to its next
-                VPtrNum next = consth->s.next;
-//                UMemHeader prevh = *getHeaderConst(prevp); // UNDONE: this seems to sometimes crash while memcpy doesn't?!?
                 UMemHeader prevh;
-                memcpy(&prevh, getHeaderConst(prevp), sizeof(UMemHeader));
-                prevh.s.next = next;
+                getHeader(prevp, &prevh);
+                prevh.s.next = h.s.next;
                 updateHeader(prevp, &prevh);
-                // NOTE: getHeaderConst might invalidate h from here ----
+
+                // allocated blocks are not relocatable (see setRelocatable())
+                h.s.next = 0;
+                updateHeader(p, &h);
             }
             else // too big
             {
-                //UMemHeader h = *consth;
-                UMemHeader h;
-                memcpy(&h, consth, sizeof(UMemHeader));
                 h.s.size -= quantity;
                 updateHeader(p, &h);
                 p += (h.s.size * sizeof(UMemHeader));
-//                h = *getHeaderConst(p);
-                memcpy(&h, getHeaderConst(p), sizeof(UMemHeader));
+                // new header, no need to read the old data
+                h.s.next = 0;
                 h.s.size = quantity;
                 updateHeader(p, &h);
             }
@@ -630,15 +1790,149 @@ VPtrNum BaseVAlloc::allocRaw(VPtrSize size)
                 ASSERT(false);
                 return 0;
             }
-            consth = getHeaderConst(p);
+            getHeader(p, &h);
         }
 
         prevp = p;
-        p = consth->s.next;
+        p = h.s.next;
         ASSERT(p);
     }
 }
 
+// Takes quantity units from the free block that has room closest to hint, within the big page of hint or its
+// neighbours. Returns zero if there is no such block.
+VPtrNum BaseVAlloc::allocFreeListNear(VPtrNum hint, VPtrSize quantity)
+{
+    const VPtrNum frame = hint - (hint % bigPages.size);
+    const VPtrNum low = (frame > bigPages.size) ? (frame - bigPages.size) : 0, high = frame + bigPages.size * 2;
+
+    if (freePointer == 0)
+    {
+        baseFreeList.s.next = freePointer = BASE_INDEX;
+        baseFreeList.s.size = 0;
+    }
+
+    for (uint8_t attempt=0; ; ++attempt)
+    {
+        // the free list is sorted by address: start before the region and stop after it
+        VPtrNum prevp = (freePointer < low) ? freePointer : (VPtrNum)BASE_INDEX;
+        VPtrNum best = 0, bestprev = 0, bestpos = 0, bestdist = 0;
+        UMemHeader h;
+        getHeader(prevp, &h);
+        for (VPtrNum p=h.s.next; p!=BASE_INDEX && p<high; prevp=p, p=h.s.next)
+        {
+            getHeader(p, &h);
+            if (h.s.size < quantity)
+                continue;
+
+            // position closest to the hint, in whole units from the start of the block
+            const VPtrNum last = p + (h.s.size - quantity) * sizeof(UMemHeader);
+            VPtrNum pos = p;
+            if (hint >= last)
+                pos = last;
+            else if (hint > p)
+                pos = p + (hint - p) / sizeof(UMemHeader) * sizeof(UMemHeader);
+            if (pos < low || pos >= high)
+                continue;
+
+            const VPtrNum dist = (pos > hint) ? (pos - hint) : (hint - pos);
+            if (!best || dist < bestdist)
+            {
+                best = p;
+                bestprev = prevp;
+                bestpos = pos;
+                bestdist = dist;
+            }
+        }
+
+        if (best)
+        {
+            // split the block in a free front part, the new block and a free back part
+            getHeader(best, &h);
+            const VPtrSize front = (bestpos - best) / sizeof(UMemHeader), back = h.s.size - front - quantity;
+            VPtrNum next = h.s.next;
+            if (back)
+            {
+                UMemHeader backh;
+                backh.s.next = next;
+                backh.s.size = back;
+                next = bestpos + quantity * sizeof(UMemHeader);
+                updateHeader(next, &backh);
+            }
+            if (front)
+            {
+                h.s.size = front;
+                h.s.next = next;
+                updateHeader(best, &h);
+                freePointer = best;
+            }
+            else
+            {
+                UMemHeader prevh;
+                getHeader(bestprev, &prevh);
+                prevh.s.next = next;
+                updateHeader(bestprev, &prevh);
+                freePointer = bestprev;
+            }
+
+            h.s.next = 0;
+            h.s.size = quantity;
+            updateHeader(bestpos, &h);
+#ifdef VIRTMEM_TRACE_STATS
+            memUsed += (quantity * sizeof(UMemHeader));
+            maxMemUsed = private_utils::maximal(maxMemUsed, memUsed);
+#endif
+            return bestpos + sizeof(UMemHeader);
+        }
+
+        // take new memory if the unused part of the pool is close
+        if (attempt || poolFreePos < low || poolFreePos >= high || !getMem(quantity))
+            return 0;
+    }
+}
+
+/**
+ * @brief Allocates a piece of raw (virtual) memory close to other memory.
+ *
+ * Free memory in the same *big* page as \a hint, or in a neighbouring page, is preferred. This way, data
+ * that is accessed together, such as the nodes of a linked list or a tree, shares cached pages and fewer
+ * pages have to be swapped.
+ * @param hint The address of the memory that the new block should be close to, e.g. the parent or previous node.
+ * When an allocation engine is used, this should be the start of a memory block. If there is no free memory
+ * near \a hint, or \a hint is zero, this function behaves like \ref allocRaw().
+ * @param size the size of the memory block
+ * @return The starting address of the memory block. Will return zero if out of memory.
+ * @sa VAlloc::allocNear, VAlloc::Cluster
+ */
+VPtrNum BaseVAlloc::allocRawNear(VPtrNum hint, VPtrSize size)
+{
+    LOCK_ALLOC;
+
+    if (hint)
+    {
+        VPtrNum ret;
+        if (allocEngine)
+        {
+            VPtrSize blocksize;
+            ret = allocEngine->allocNear(hint, size, blocksize);
+#ifdef VIRTMEM_TRACE_STATS
+            if (ret)
+            {
+                memUsed += blocksize;
+                maxMemUsed = private_utils::maximal(maxMemUsed, memUsed);
+            }
+#endif
+        }
+        else
+            ret = allocFreeListNear(hint, (size + sizeof(UMemHeader) - 1) / sizeof(UMemHeader) + 1);
+
+        if (ret)
+            return ret;
+    }
+
+    return allocRaw(size);
+}
+
 /**
  * @fn BaseVAlloc::freeRaw
  * @brief Frees a memory block for re-usage.
@@ -649,6 +1943,18 @@ void BaseVAlloc::freeRaw(VPtrNum ptr)
     if (!ptr)
         return;
 
+    LOCK_ALLOC;
+
+    if (allocEngine)
+    {
+#ifdef VIRTMEM_TRACE_STATS
+        memUsed -= allocEngine->free(ptr);
+#else
+        allocEngine->free(ptr);
+#endif
+        return;
+    }
+
     // Scans the free list, starting at freePointer, looking the the place to insert the
     // free block. This is either between two existing blocks or at the end of the
     // list. In any case, if the block being freed is adjacent to either neighbor,
@@ -657,38 +1963,39 @@ void BaseVAlloc::freeRaw(VPtrNum ptr)
     // acquire pointer to block header
     const VPtrNum hdrptr = ptr - sizeof(UMemHeader);
     UMemHeader statheader;
-    memcpy(&statheader, getHeaderConst(hdrptr), sizeof(UMemHeader));
+    getHeader(hdrptr, &statheader);
+    const VPtrSize freedsize = statheader.s.size * sizeof(UMemHeader);
 
 #ifdef VIRTMEM_TRACE_STATS
-    memUsed -= (statheader.s.size * sizeof(UMemHeader));
+    memUsed -= freedsize;
 #endif
 
     // Find the correct place to place the block in (the free list is sorted by
     // address, increasing order)
     VPtrNum p = freePointer;
-    const UMemHeader *consth = getHeaderConst(p);
-    while (!(hdrptr > p && hdrptr < consth->s.next))
+    UMemHeader stath;
+    getHeader(p, &stath);
+    while (!(hdrptr > p && hdrptr < stath.s.next))
     {
         // Since the free list is circular, there is one link where a
         // higher-addressed block points to a lower-addressed block.
         // This condition checks if the block should be actually
         // inserted between them
-        if (p >= consth->s.next && (hdrptr > p || hdrptr < consth->s.next))
+        if (p >= stath.s.next && (hdrptr > p || hdrptr < stath.s.next))
             break;
 
-        p = consth->s.next;
-        consth = getHeaderConst(p);
+        p = stath.s.next;
+        getHeader(p, &stath);
     }
 
-    UMemHeader stath;
-    memcpy(&stath, consth, sizeof(UMemHeader));
-
     // Try to combine with the higher neighbor
-    if ((hdrptr + statheader.s.size) == stath.s.next)
+    if ((hdrptr + statheader.s.size * sizeof(UMemHeader)) == stath.s.next)
     {
-        const UMemHeader *nexth = getHeaderConst(stath.s.next);
-        statheader.s.size += nexth->s.size;
-        statheader.s.next = nexth->s.next;
+        UMemHeader nexth;
+        getHeader(stath.s.next, &nexth);
+        statheader.s.size += nexth.s.size;
+        statheader.s.next = nexth.s.next;
+        dropHeader(stath.s.next);
     }
     else
         statheader.s.next = stath.s.next;
@@ -697,10 +2004,15 @@ void BaseVAlloc::freeRaw(VPtrNum ptr)
     updateHeader(hdrptr, &statheader);
 
     // Try to combine with the lower neighbor
-    if (p + stath.s.size == hdrptr)
+    VPtrNum freeblock = hdrptr;
+    VPtrSize freeblocksize = statheader.s.size;
+    if ((p + stath.s.size * sizeof(UMemHeader)) == hdrptr)
     {
         stath.s.size += statheader.s.size;
         stath.s.next = statheader.s.next;
+        dropHeader(hdrptr);
+        freeblock = p;
+        freeblocksize = stath.s.size;
     }
     else
         stath.s.next = hdrptr;
@@ -710,6 +2022,365 @@ void BaseVAlloc::freeRaw(VPtrNum ptr)
     ASSERT(p);
     ASSERT(stath.s.next);
     freePointer = p;
+
+    // only large blocks are trimmed, so that small blocks next to a large free block don't trim it again
+    if (freedsize >= bigPages.size)
+        trimPool(freeblock + sizeof(UMemHeader), (freeblocksize - 1) * sizeof(UMemHeader));
+}
+
+namespace {
+
+int comparePtrs(const void *a, const void *b)
+{
+    const VPtrNum pa = *static_cast<const VPtrNum *>(a), pb = *static_cast<const VPtrNum *>(b);
+    return (pa < pb) ? -1 : (pa > pb);
+}
+
+}
+
+/**
+ * @fn BaseVAlloc::allocRawBatch
+ * @brief Allocates multiple pieces of raw (virtual) memory of the same size.
+ *
+ * With the default allocation algorithm, all blocks are taken from a single free region, so the free list
+ * is only searched once. This is much faster than calling \ref allocRaw() for each block.
+ * @param count the amount of memory blocks to allocate
+ * @param size the size of each memory block
+ * @param ptrs array that receives the starting addresses of the memory blocks
+ * @return Whether all memory blocks could be allocated. If not, no memory is allocated.
+ * @sa freeRawBatch
+ */
+bool BaseVAlloc::allocRawBatch(VPtrSize count, VPtrSize size, VPtrNum *ptrs)
+{
+    ASSERT(count && size);
+
+    LOCK_ALLOC;
+
+    if (allocEngine)
+    {
+        for (VPtrSize i=0; i<count; ++i)
+        {
+            if ((ptrs[i] = allocRaw(size)) == 0)
+            {
+                freeRawBatch(ptrs, i);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // allocate one block for all and divide it
+    const VPtrSize quantity = (size + sizeof(UMemHeader) - 1) / sizeof(UMemHeader) + 1;
+    const VPtrNum p = allocRaw(count * quantity * sizeof(UMemHeader) - sizeof(UMemHeader));
+    if (!p)
+        return false;
+
+    UMemHeader h;
+    h.s.next = 0;
+    h.s.size = quantity;
+    for (VPtrSize i=0; i<count; ++i)
+    {
+        const VPtrNum hdrptr = p - sizeof(UMemHeader) + i * quantity * sizeof(UMemHeader);
+        updateHeader(hdrptr, &h);
+        ptrs[i] = hdrptr + sizeof(UMemHeader);
+    }
+    return true;
+}
+
+/**
+ * @fn BaseVAlloc::freeRawBatch
+ * @brief Frees multiple memory blocks.
+ *
+ * The blocks are freed in order of their address. With the default allocation algorithm, this means that
+ * the (address ordered) free list is only traversed once, and adjacent blocks are merged on the way.
+ * @param ptrs array with the starting addresses of the memory blocks. Zero addresses are ignored.
+ * @param count the amount of memory blocks
+ * @note The array \a ptrs is sorted by this function.
+ * @sa allocRawBatch
+ */
+void BaseVAlloc::freeRawBatch(VPtrNum *ptrs, VPtrSize count)
+{
+    LOCK_ALLOC;
+
+    qsort(ptrs, count, sizeof(VPtrNum), comparePtrs);
+    for (VPtrSize i=0; i<count; ++i)
+        freeRaw(ptrs[i]); // NOTE: the free list search continues where the previous block was inserted
+}
+
+// Resizes a memory block in place, if possible. The amount of usable bytes of the block before resizing is
+// stored in usable.
+bool BaseVAlloc::resizeBlock(VPtrNum ptr, VPtrSize size, VPtrSize &usable)
+{
+    if (allocEngine)
+    {
+        usable = allocEngine->getSize(ptr);
+        VPtrSize oldblocksize, newblocksize;
+        if (!allocEngine->resize(ptr, size, oldblocksize, newblocksize))
+            return false;
+#ifdef VIRTMEM_TRACE_STATS
+        memUsed = memUsed - oldblocksize + newblocksize;
+        maxMemUsed = private_utils::maximal(maxMemUsed, memUsed);
+#endif
+        return true;
+    }
+
+    const VPtrNum hdrptr = ptr - sizeof(UMemHeader);
+    UMemHeader h;
+    getHeader(hdrptr, &h);
+    usable = (h.s.size - 1) * sizeof(UMemHeader);
+
+    const VPtrSize quantity = (size + sizeof(UMemHeader) - 1) / sizeof(UMemHeader) + 1;
+    if (quantity <= h.s.size)
+    {
+        // shrink: split off the rest and free it, if it can hold any data
+        if ((h.s.size - quantity) > 1)
+        {
+            const VPtrNum rest = hdrptr + quantity * sizeof(UMemHeader);
+            UMemHeader resth;
+            resth.s.size = h.s.size - quantity;
+            resth.s.next = 0;
+            updateHeader(rest, &resth);
+            h.s.size = quantity;
+            updateHeader(hdrptr, &h);
+            freeRaw(rest + sizeof(UMemHeader)); // NOTE: also updates stats
+        }
+        return true;
+    }
+
+    const VPtrNum end = hdrptr + h.s.size * sizeof(UMemHeader);
+    VPtrSize extra = quantity - h.s.size;
+
+    // last block of the pool?
+    if (!extendPoolMem(end, extra * sizeof(UMemHeader)))
+    {
+        if (freePointer == 0)
+            return false;
+
+        // find the free block following the block (the free list is sorted by address, see freeRaw())
+        VPtrNum p = freePointer;
+        UMemHeader prevh;
+        getHeader(p, &prevh);
+        while (!(hdrptr > p && hdrptr < prevh.s.next))
+        {
+            if (p >= prevh.s.next && (hdrptr > p || hdrptr < prevh.s.next))
+                break;
+            p = prevh.s.next;
+            getHeader(p, &prevh);
+        }
+
+        if (prevh.s.next != end)
+            return false;
+
+        UMemHeader nexth;
+        getHeader(end, &nexth);
+        if (nexth.s.size < extra)
+            return false;
+
+        dropHeader(end);
+        if ((nexth.s.size - extra) > 1)
+        {
+            // move the free block's header behind the enlarged block
+            const VPtrNum rest = end + extra * sizeof(UMemHeader);
+            nexth.s.size -= extra;
+            updateHeader(rest, &nexth);
+            prevh.s.next = rest;
+        }
+        else
+        {
+            // take the complete free block
+            extra = nexth.s.size;
+            prevh.s.next = nexth.s.next;
+        }
+        updateHeader(p, &prevh);
+        freePointer = p;
+    }
+
+    h.s.size += extra;
+    updateHeader(hdrptr, &h);
+#ifdef VIRTMEM_TRACE_STATS
+    memUsed += (extra * sizeof(UMemHeader));
+    maxMemUsed = private_utils::maximal(maxMemUsed, memUsed);
+#endif
+    return true;
+}
+
+/**
+ * @fn BaseVAlloc::reallocRaw
+ * @brief Changes the size of a piece of raw (virtual) memory.
+ *
+ * The memory block is resized in place if possible, i.e. when it is shrunk or followed by enough unused memory.
+ * Otherwise, a new block is allocated and the data is copied within the memory pool, without swapping in
+ * pages of either block.
+ * @param ptr starting address of the memory block. If zero, this function is equivalent to \ref allocRaw().
+ * @param size the new size of the memory block. If zero, this function is equivalent to \ref freeRaw().
+ * @return The (possibly changed) starting address of the memory block. Will return zero if out of memory, in
+ * which case the original block is left untouched.
+ * @note The memory block should not be locked while it is resized.
+ */
+VPtrNum BaseVAlloc::reallocRaw(VPtrNum ptr, VPtrSize size)
+{
+    if (!ptr)
+        return allocRaw(size);
+    if (!size)
+    {
+        freeRaw(ptr);
+        return 0;
+    }
+
+    LOCK_ALLOC;
+
+    VPtrSize usable;
+    if (resizeBlock(ptr, size, usable))
+        return ptr;
+
+    const VPtrNum ret = allocRaw(size);
+    if (ret)
+    {
+        {
+            LOCK_CACHE;
+            copyPoolData(ret, ptr, private_utils::minimal(usable, size));
+        }
+        freeRaw(ptr);
+    }
+    return ret;
+}
+
+/**
+ * @brief Allows a memory block to be moved by \ref compact().
+ *
+ * When the block is moved, its new starting address is written to \a ref. Usually, \a ref is an entry of a
+ * table that is used to access the block, such as a VHandleTable.
+ * @param ptr starting address of the memory block
+ * @param ref address in virtual memory where the starting address of the block is stored. This address should
+ * not be part of a relocatable block itself. If zero, the block is not moved anymore.
+ * @note Only the default allocation algorithm moves blocks: this function has no effect if an allocation engine
+ * is used (see BaseAllocEngine). The block stays relocatable until it is freed or moved by \ref reallocRaw().
+ * @sa compact
+ */
+void BaseVAlloc::setRelocatable(VPtrNum ptr, VPtrNum ref)
+{
+    LOCK_ALLOC;
+
+    if (allocEngine)
+        return;
+
+    const VPtrNum hdrptr = ptr - sizeof(UMemHeader);
+    UMemHeader h;
+    getHeader(hdrptr, &h);
+    h.s.next = ref; // NOTE: unused by allocated blocks otherwise
+    updateHeader(hdrptr, &h);
+}
+
+/**
+ * @brief Performs a step of compacting the memory pool.
+ *
+ * Relocatable blocks (see \ref setRelocatable()) are moved towards the start of the memory pool, so that
+ * their free neighbours are merged into larger free blocks. This counters fragmentation: large blocks can be
+ * allocated again, the free list becomes shorter and the used memory less scattered. Free memory at the end of
+ * the pool is released. Other blocks are never moved, and free memory before them remains.
+ *
+ * Compaction is incremental: each call moves at most about \a maxsize bytes and continues where the previous
+ * call stopped. Data is copied within the memory pool, a big page at a time, without swapping in the pages of
+ * the blocks (see \ref reallocRaw()).
+ *
+ * Example:
+ * @code{.cpp}
+ * // compact a little during idle time
+ * if (valloc.compact(1024))
+ *     Serial.println("memory pool is compacted");
+ * @endcode
+ * @param maxsize the maximum amount of bytes to move
+ * @return `true` if compaction has finished, i.e. no more blocks can be moved. The next call will start over.
+ * @note Only the default allocation algorithm is compacted, this function has no effect if an allocation engine
+ * is used (see BaseAllocEngine).
+ * @note Relocatable blocks must not be locked while compacting, and addresses obtained before may be stale
+ * afterwards.
+ */
+bool BaseVAlloc::compact(VPtrSize maxsize)
+{
+    LOCK_ALLOC;
+
+    if (allocEngine || freePointer == 0)
+        return true;
+
+    VPtrSize done = 0;
+    VPtrNum prevp = BASE_INDEX;
+    UMemHeader prevh;
+    getHeader(prevp, &prevh);
+
+    while (done < maxsize)
+    {
+        // next free block (the free list is sorted by address, see freeRaw())
+        VPtrNum p = prevh.s.next;
+        while (p != BASE_INDEX && p < compactPos)
+        {
+            prevp = p;
+            getHeader(p, &prevh);
+            p = prevh.s.next;
+        }
+        if (p == BASE_INDEX)
+            break;
+
+        UMemHeader freeh;
+        getHeader(p, &freeh);
+        const VPtrNum block = p + freeh.s.size * sizeof(UMemHeader);
+        if (block == poolFreePos)
+        {
+            // free space at the end: return it to the pool
+            prevh.s.next = freeh.s.next;
+            updateHeader(prevp, &prevh);
+            dropHeader(p);
+            freePointer = prevp;
+            poolFreePos = p;
+            trimPool(p, freeh.s.size * sizeof(UMemHeader));
+            break;
+        }
+
+        UMemHeader blockh;
+        getHeader(block, &blockh);
+        const VPtrSize blocksize = blockh.s.size * sizeof(UMemHeader);
+        if (!blockh.s.next)
+        {
+            // fixed block, continue after it
+            compactPos = block + blocksize;
+            done += sizeof(UMemHeader);
+            continue;
+        }
+
+        // slide the block down: the free block moves up and is merged with a following free block
+        dropHeader(block);
+        {
+            LOCK_CACHE;
+            copyPoolData(p + sizeof(UMemHeader), block + sizeof(UMemHeader), blocksize - sizeof(UMemHeader));
+        }
+        updateHeader(p, &blockh);
+        const VPtrNum newptr = p + sizeof(UMemHeader);
+        write(blockh.s.next, &newptr, sizeof(newptr));
+
+        const VPtrNum freeblock = p + blocksize;
+        if (freeh.s.next == (block + blocksize))
+        {
+            UMemHeader nexth;
+            getHeader(freeh.s.next, &nexth);
+            dropHeader(freeh.s.next);
+            freeh.s.size += nexth.s.size;
+            freeh.s.next = nexth.s.next;
+        }
+        updateHeader(freeblock, &freeh);
+        prevh.s.next = freeblock;
+        updateHeader(prevp, &prevh);
+        freePointer = prevp;
+
+        compactPos = freeblock;
+        done += blocksize;
+    }
+
+    if (done < maxsize)
+    {
+        compactPos = 0;
+        return true;
+    }
+    return false;
 }
 
 /**
@@ -720,36 +2391,60 @@ void BaseVAlloc::freeRaw(VPtrNum ptr)
  * @return a pointer to a memory block (a memory page) containing the data
  * @note The memory block returned by this function is temporary and may be invalidated
  * during a page swap. To use the memory accross reads and writes it should be locked.
+ * @note If VIRTMEM_THREAD_SAFE is defined, other threads may swap out the page at any time.
+ * Use \ref read(VPtrNum, void *, VPtrSize) or locks instead.
  */
 void *BaseVAlloc::read(VPtrNum p, VPtrSize size)
 {
-    PageInfo *plist[3] = { &smallPages, &mediumPages, &bigPages };
+    LOCK_CACHE_RANGE(p, size);
+    void *ret = getRawData(p, size);
+
+    if (!isShardRange(p, size))
+    {
+        // the data was loaded in a big page that extends to another region of a cache shard, which is only
+        // allowed while both are locked (see CacheShard)
+        const VirtPageIndex index = findFreePage(p, size, false);
+        if (index != -1)
+        {
+            syncBigPage(&bigPages.pages[index]);
+            uncacheBigPage(&bigPages.pages[index]);
+            bigPages.pages[index].start = 0; // NOTE: the data stays available until the page is reused
+        }
+    }
+
+    return ret;
+}
+
+// Returns a pointer to data in a locked page, or otherwise in a big page (see read())
+void *BaseVAlloc::getRawData(VPtrNum p, VPtrSize size)
+{
     const VPtrNum pend = p + size;
 
-    for (uint8_t pindex=0; pindex<3; ++pindex)
+    // NOTE: locked pages never overlap, so if a page is found that contains all data no other pages
+    // can overlap
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&lockedPageIndex, p, size, key); k; --k, ++key)
     {
-        for (int8_t i=plist[pindex]->lockedIndex; i!=-1; i=plist[pindex]->pages[i].next)
+        for (LockPage *page=getIndexBucket(&lockedPageIndex, key); page; page=page->indexNext)
         {
-            const bool beginoverlaps = (p >= plist[pindex]->pages[i].start &&
-                                      p < (plist[pindex]->pages[i].start + plist[pindex]->pages[i].size));
-            const bool endoverlaps = (p < plist[pindex]->pages[i].start && pend > plist[pindex]->pages[i].start);
+            const bool beginoverlaps = (p >= page->start && p < (page->start + page->size));
+            const bool endoverlaps = (p < page->start && pend > page->start);
 
             if (beginoverlaps)
             {
-                const VPtrNum offset = p - plist[pindex]->pages[i].start;
+                const VPtrNum offset = p - page->start;
                 // data fits in this page?
-                if ((offset + size) <= plist[pindex]->pages[i].size)
+                if ((offset + size) <= page->size)
                 {
         //            std::cout << "using temp lock page " << (int)(pageindex) << ", " << p << std::endl;
-                    return (char *)plist[pindex]->pages[i].pool + offset;
+                    return (char *)page->pool + offset;
                 }
             }
 
             if (beginoverlaps || endoverlaps)
             {
                 // only fits partially... mirror data to normal page so a continuous block can be returned
-                pushRawData(plist[pindex]->pages[i].start, plist[pindex]->pages[i].pool,
-                            plist[pindex]->pages[i].size); // UNDONE: partial copy, check dirty?
+                pushRawData(page->start, page->pool, page->size); // UNDONE: partial copy, check dirty?
 
 //                std::cout << "mirrored partial page: " << (int)pindex << "/" << (int)(i) << std::endl;
             }
@@ -760,6 +2455,31 @@ void *BaseVAlloc::read(VPtrNum p, VPtrSize size)
     return pullRawData(p, size, true, false);
 }
 
+/**
+ * @brief Copies a raw block of (virtual) memory.
+ * @param p starting address of memory block
+ * @param d buffer where the data is copied to
+ * @param size number of bytes to copy. This should not exceed the size of a *big* page.
+ * @note Unlike \ref read(VPtrNum, VPtrSize), the data is copied while the allocator is locked, which makes
+ * this function suitable for multithreaded code (see VIRTMEM_THREAD_SAFE).
+ */
+void BaseVAlloc::read(VPtrNum p, void *d, VPtrSize size)
+{
+    LOCK_CACHE_RANGE(p, size);
+
+    // big pages don't extend to other regions of cache shards (see CacheShard), so data is copied per region
+    while (!isShardRange(p, size))
+    {
+        const VPtrSize partsize = getRegionEnd(p) - p;
+        memcpy(d, getRawData(p, partsize), partsize);
+        p += partsize;
+        d = static_cast<uint8_t *>(d) + partsize;
+        size -= partsize;
+    }
+
+    memcpy(d, getRawData(p, size), size);
+}
+
 /**
  * @fn BaseVAlloc::write
  * @brief Writes a piece of raw data to (virtual) memory.
@@ -769,40 +2489,41 @@ void *BaseVAlloc::read(VPtrNum p, VPtrSize size)
  */
 void BaseVAlloc::write(VPtrNum p, const void *d, VPtrSize size)
 {
-    PageInfo *plist[3] = { &smallPages, &mediumPages, &bigPages };
+    LOCK_CACHE_RANGE(p, size);
     const VPtrNum pend = p + size;
 
-    for (uint8_t pindex=0; pindex<3; ++pindex)
+    VPtrNum key;
+    for (VPtrSize k=getIndexKeys(&lockedPageIndex, p, size, key); k; --k, ++key)
     {
-        for (int8_t i=plist[pindex]->lockedIndex; i!=-1; i=plist[pindex]->pages[i].next)
+        for (LockPage *page=getIndexBucket(&lockedPageIndex, key); page; page=page->indexNext)
         {
-            const bool beginoverlaps = (p >= plist[pindex]->pages[i].start &&
-                                      p < (plist[pindex]->pages[i].start + plist[pindex]->pages[i].size));
-            const bool endoverlaps = (p < plist[pindex]->pages[i].start && pend > plist[pindex]->pages[i].start);
-
-            if (!plist[pindex]->pages[i].dirty && (beginoverlaps || endoverlaps))
-                plist[pindex]->pages[i].dirty = true;
+            const bool beginoverlaps = (p >= page->start && p < (page->start + page->size));
+            const bool endoverlaps = (p < page->start && pend > page->start);
 
             if (beginoverlaps)
             {
-                const VPtrNum offset = p - plist[pindex]->pages[i].start;
+                const VPtrNum offset = p - page->start;
                 // data fits in this page?
-                if ((offset + size) <= plist[pindex]->pages[i].size)
+                if ((offset + size) <= page->size)
                 {
-                    memcpy((char *)plist[pindex]->pages[i].pool + offset, d, size);
+                    setPageDirty(page, offset, size);
+                    memcpy((char *)page->pool + offset, d, size);
                     return;
                 }
                 else
                 {
                     // partial fit (data too large), copy stuff that fits in page
-                    memcpy((char *)plist[pindex]->pages[i].pool + offset, d, plist[pindex]->pages[i].size - offset);
+                    setPageDirty(page, offset, page->size - offset);
+                    memcpy((char *)page->pool + offset, d, page->size - offset);
                 }
             }
             else if (endoverlaps)
             {
                 // partial fit (data starts before), copy stuff that fits in page
-                const VPtrNum offset = plist[pindex]->pages[i].start - p;
-                memcpy((char *)plist[pindex]->pages[i].pool, (uint8_t *)d + offset, size - offset);
+                const VPtrNum offset = page->start - p;
+                const VirtPageSize copysize = private_utils::minimal(size - offset, (VPtrSize)page->size);
+                setPageDirty(page, 0, copysize);
+                memcpy((char *)page->pool, (uint8_t *)d + offset, copysize);
             }
         }
     }
@@ -819,12 +2540,85 @@ void BaseVAlloc::write(VPtrNum p, const void *d, VPtrSize size)
  */
 void BaseVAlloc::flush()
 {
+    LOCK_ALLOC;
+    LOCK_CACHE;
+    flushHeaders();
     // UNDONE: also flush locked pages?
-    for (int8_t i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    syncBigPages();
+    sync();
+}
+
+/**
+ * @brief Stores all data and the allocator state in a persistent memory pool.
+ *
+ * All modified data is written to the memory pool first, followed by the allocator state (see
+ * \ref setPersistent()). When the allocator is started again, the memory pool is reopened in the state of the
+ * last checkpoint. This function is called by \ref stop() for persistent memory pools.
+ * @note Data in locked pages is stored as it is at the time of the checkpoint.
+ */
+void BaseVAlloc::checkpoint()
+{
+    LOCK_ALLOC;
+    LOCK_CACHE;
+
+    ASSERT(persistent && !allocEngine);
+
+    // small and medium pages may contain modified data, locked pages stay dirty as they may still be modified
+    PageInfo *pinfos[] = { &smallPages, &mediumPages };
+    for (uint8_t i=0; i<2; ++i)
     {
-        if (bigPages.pages[i].start != 0)
-            syncBigPage(&bigPages.pages[i]);
+        for (VirtPageIndex j=pinfos[i]->lockedIndex; j!=-1; j=pinfos[i]->pages[j].next)
+        {
+            LockPage *page = &pinfos[i]->pages[j];
+            syncLockedPage(page);
+            if (page->locks == 0)
+                page->dirty = false;
+        }
     }
+
+    flushHeaders();
+    syncBigPages();
+    sync();
+    doFlush();
+
+    // the state is written last, so that it never refers to data that was not stored
+    Superblock sb;
+    memset(&sb, 0, sizeof(sb)); // no random padding in the checksum
+    sb.magic = SUPERBLOCK_MAGIC;
+    sb.version = SUPERBLOCK_VERSION;
+    sb.headerSize = sizeof(UMemHeader);
+    sb.poolSize = poolSize;
+#ifdef VIRTMEM_TRACE_STATS
+    sb.memUsed = memUsed;
+#endif
+    sb.poolFreePos = poolFreePos;
+    sb.freePointer = freePointer;
+    sb.root = root;
+    sb.baseFreeList = baseFreeList;
+    sb.checksum = getSuperblockChecksum(&sb, sizeof(sb));
+
+    write(START_OFFSET, &sb, sizeof(sb));
+    syncBigPages();
+    sync();
+    doFlush();
+    stateStored = true;
+}
+
+/**
+ * @brief Waits until all data that is read or written in the background is finished.
+ *
+ * When asynchronous I/O is used (see \ref setAsyncIO()), written data may not yet be stored in the memory
+ * pool after a page was swapped out. This function can be used as a barrier, for instance before the memory
+ * pool is accessed directly.
+ * @note Without asynchronous I/O this function does nothing.
+ * @sa setAsyncIO()
+ */
+void BaseVAlloc::sync()
+{
+#ifdef VIRTMEM_ASYNC_IO
+    if (asyncIO)
+        asyncIO->sync();
+#endif
 }
 
 /**
@@ -834,12 +2628,18 @@ void BaseVAlloc::flush()
  */
 void BaseVAlloc::clearPages()
 {
+    LOCK_ALLOC;
+    LOCK_CACHE;
+    flushHeaders();
+    syncBigPages();
+    sync();
+
     // wipe all pages
-    for (int8_t i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
     {
         if (bigPages.pages[i].start != 0)
         {
-            syncBigPage(&bigPages.pages[i]);
+            uncacheBigPage(&bigPages.pages[i]);
             bigPages.pages[i].start = 0;
         }
     }
@@ -849,11 +2649,11 @@ void BaseVAlloc::clearPages()
  * @fn BaseVAlloc::getFreeBigPages
  * @return number of *big* pages that are not used and are not locked.
  */
-uint8_t BaseVAlloc::getFreeBigPages() const
+VirtPageCount BaseVAlloc::getFreeBigPages() const
 {
-    uint8_t ret = 0;
+    VirtPageCount ret = 0;
 
-    for (int8_t i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
+    for (VirtPageIndex i=bigPages.freeIndex; i!=-1; i=bigPages.pages[i].next)
     {
         if (bigPages.pages[i].start == 0)
             ++ret;
@@ -865,6 +2665,7 @@ uint8_t BaseVAlloc::getFreeBigPages() const
 // @cond HIDDEN_SYMBOLS
 void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
 {
+    LOCK_CACHE;
     ASSERT(ptr != 0);
     ASSERT(size <= bigPages.size);
 
@@ -879,11 +2680,11 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
 //    std::cout << "request lock: " << ptr << "/" << size << "/" << pinfo->size << std::endl;
 
     PageInfo *plist[3] = { &smallPages, &mediumPages, &bigPages };
-    int8_t pageindex = -1, oldlockindex = -1, secoldlockindex = -1;
+    VirtPageIndex pageindex = -1, oldlockindex = -1, secoldlockindex = -1;
     bool fixbeginningoverlap = false, done = false, shrunk = false;
     for (uint8_t pindex=0; pindex<3 && !done; ++pindex)
     {
-        for (int8_t i=plist[pindex]->lockedIndex; i!=-1;)
+        for (VirtPageIndex i=plist[pindex]->lockedIndex; i!=-1;)
         {
             // already there?
             if (plist[pindex]->pages[i].start == ptr)
@@ -992,7 +2793,7 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
                 pinfo = &smallPages;
             else
             {
-                const int8_t index = findUnusedLockedPage(&smallPages);
+                const VirtPageIndex index = findUnusedLockedPage(&smallPages);
                 if (index != -1)
                 {
                     pinfo = &smallPages;
@@ -1007,7 +2808,7 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
                 pinfo = &mediumPages;
             else
             {
-                const int8_t index = findUnusedLockedPage(&mediumPages);
+                const VirtPageIndex index = findUnusedLockedPage(&mediumPages);
                 if (index != -1)
                 {
                     pinfo = &mediumPages;
@@ -1061,6 +2862,7 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
                 syncLockedPage(&pinfo->pages[oldlockindex]);
                 pinfo->pages[oldlockindex].dirty = false;
                 pageindex = oldlockindex;
+                setLockedPageStart(&pinfo->pages[pageindex], ptr);
             }
             else
             {
@@ -1076,7 +2878,7 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
             // NOTE: we couldn't do this earlier since it was unknown which data is going to be used
             for (uint8_t pindex=0; pindex<3; ++pindex)
             {
-                for (int8_t i=plist[pindex]->lockedIndex; i!=-1; i=plist[pindex]->pages[i].next)
+                for (VirtPageIndex i=plist[pindex]->lockedIndex; i!=-1; i=plist[pindex]->pages[i].next)
                 {
                     if ((i != pageindex || plist[pindex] != pinfo) && ptr > plist[pindex]->pages[i].start &&
                         ptr < (plist[pindex]->pages[i].start + plist[pindex]->pages[i].size))
@@ -1086,7 +2888,7 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
                         // copy their overlapping data (assume this is the most up to date)
                         const VPtrSize offsetold = ptr - plist[pindex]->pages[i].start;
                         const VirtPageSize copysize = private_utils::minimal((VirtPageSize)(plist[pindex]->pages[i].size - offsetold), size);
-                        memcpy(pinfo->pages[pageindex].pool, (char *)plist[pindex]->pages[i].pool + offsetold, copysize);
+                        memmove(pinfo->pages[pageindex].pool, (char *)plist[pindex]->pages[i].pool + offsetold, copysize);
                         copyoffset = private_utils::maximal(copyoffset, copysize); // NOTE: take max, copyoffset might have been set earlier
                         plist[pindex]->pages[i].size = offsetold; // shrink other so this one fits
                         fixed = true;
@@ -1105,8 +2907,6 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
             copyRawData(pinfo->pages[pageindex].pool + copyoffset, ptr + copyoffset, size - copyoffset);
 #endif
         }
-
-        pinfo->pages[pageindex].start = ptr;
     }
     else
     {
@@ -1131,8 +2931,9 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
     else
         printf("using existing page %d (%d) - free/used: %d/%d\n", pageindex, ptr, pinfo->freeIndex, pinfo->usedIndex);*/
 
-    if (!pinfo->pages[pageindex].dirty)
-        pinfo->pages[pageindex].dirty = !ro;
+    // NOTE: data of locks can be modified anywhere
+    if (!ro)
+        setPageDirty(&pinfo->pages[pageindex], 0, size);
 
     ++pinfo->pages[pageindex].locks;
     pinfo->pages[pageindex].size = size;
@@ -1145,17 +2946,19 @@ void *BaseVAlloc::makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro)
 // Otherwise a new lock is created with an apropiate size to avoid overlap
 void *BaseVAlloc::makeFittingLock(VPtrNum ptr, VirtPageSize &size, bool ro)
 {
+    LOCK_CACHE;
     ASSERT(ptr != 0);
 
     size = private_utils::minimal(size, bigPages.size);
 
     PageInfo *plist[3] = { &smallPages, &mediumPages, &bigPages };
-    int8_t unusedlist[3] = { -1, -1, -1 };
-    int8_t plistindex = -1, pageindex = -1;
+    VirtPageIndex unusedlist[3] = { -1, -1, -1 };
+    int8_t plistindex = -1;
+    VirtPageIndex pageindex = -1;
     bool done = false;
     for (uint8_t pindex=0; pindex<3 && !done; ++pindex)
     {
-        for (int8_t i=plist[pindex]->lockedIndex; i!=-1;)
+        for (VirtPageIndex i=plist[pindex]->lockedIndex; i!=-1;)
         {
 //            std::cout << "pindex: " << (int)pindex << "/" << (int)i << "/" << ptr << "/" << plist[pindex]->pages[i].start << "/" << plist[pindex]->pages[i].size << std::endl;
             // lock within requested address?
@@ -1232,12 +3035,12 @@ void *BaseVAlloc::makeFittingLock(VPtrNum ptr, VirtPageSize &size, bool ro)
             pageindex = unusedlist[plistindex];
             syncLockedPage(&plist[plistindex]->pages[pageindex]);
             plist[plistindex]->pages[pageindex].dirty = false;
+            setLockedPageStart(&plist[plistindex]->pages[pageindex], ptr);
         }
 
         if (syncpool)
             copyRawData(plist[plistindex]->pages[pageindex].pool, ptr, size);
 
-        plist[plistindex]->pages[pageindex].start = ptr;
         plist[plistindex]->pages[pageindex].size = size;
     }
     else
@@ -1253,8 +3056,8 @@ void *BaseVAlloc::makeFittingLock(VPtrNum ptr, VirtPageSize &size, bool ro)
     // else add to lock count
     ++plist[plistindex]->pages[pageindex].locks;
 
-    if (!plist[plistindex]->pages[pageindex].dirty)
-        plist[plistindex]->pages[pageindex].dirty = !ro;
+    if (!ro)
+        setPageDirty(&plist[plistindex]->pages[pageindex], offset, size);
 
 //    std::cout << "fitting lock page: " << (int)pageindex << "/" << ptr << "/" << size << "/" << (int)plistindex << "/" << (int)plist[plistindex]->pages[pageindex].locks << std::endl;
 
@@ -1263,6 +3066,7 @@ void *BaseVAlloc::makeFittingLock(VPtrNum ptr, VirtPageSize &size, bool ro)
 
 void BaseVAlloc::releaseLock(VPtrNum ptr)
 {
+    LOCK_CACHE;
     LockPage *page = findLockedPage(ptr);
     ASSERT(page && page->locks);
 //    std::cout << "temp unlock page: " << (int)ptr << "/" << (int)page->locks << std::endl;
@@ -1270,9 +3074,8 @@ void BaseVAlloc::releaseLock(VPtrNum ptr)
     if (!page->locks)
     {
         // was it a big page? free it so that it can be re-used for non locked IO
-        const int8_t index = findLockedPage(&bigPages, ptr);
-        if (index != -1)
-            freeLockedPage(&bigPages, index);
+        if (page >= bigPages.pages && page < (bigPages.pages + bigPages.count))
+            freeLockedPage(&bigPages, page - bigPages.pages);
     }
 }
 
@@ -1285,10 +3088,11 @@ void BaseVAlloc::printStats()
     VPtrNum p = START_OFFSET + sizeof(UMemHeader);
     while (p < poolFreePos)
     {
-        const UMemHeader *h = getHeaderConst(p);
-        printf("  * Addr: %8u; Size: %8u\n", p, h->s.size);
-        p += (h->s.size * sizeof(UMemHeader));
-        if (!h->s.size || h->s.next < p)
+        UMemHeader h;
+        getHeader(p, &h);
+        printf("  * Addr: %8u; Size: %8u\n", p, h.s.size);
+        p += (h.s.size * sizeof(UMemHeader));
+        if (!h.s.size || h.s.next < p)
             break;
     }
 
@@ -1300,10 +3104,11 @@ void BaseVAlloc::printStats()
 
         while (1)
         {
-            const UMemHeader *h = getHeaderConst(p);
-            printf("  * Addr: %8u; Size: %8u; Next: %8u\n", p, h->s.size, h->s.next);
+            UMemHeader h;
+            getHeader(p, &h);
+            printf("  * Addr: %8u; Size: %8u; Next: %8u\n", p, h.s.size, h.s.next);
 
-            p = h->s.next;
+            p = h.s.next;
 
             if (p == freePointer)
                 break;
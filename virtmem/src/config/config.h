@@ -13,8 +13,16 @@
 #undef VIRTMEM_WRAP_CPOINTERS
 #undef VIRTMEM_VIRT_ADDRESS_OPERATOR
 #undef VIRTMEM_TRACE_STATS
+#undef VIRTMEM_WIDE_PAGES
+#undef VIRTMEM_WIDE_ADDRESSES
+#undef VIRTMEM_ALIGNED_PAGES
+#undef VIRTMEM_COMPACT_HEADERS
+#undef VIRTMEM_READ_AHEAD
+#undef VIRTMEM_ASYNC_IO
+#undef VIRTMEM_THREAD_SAFE
 #undef VIRTMEM_CPP11
 #undef VIRTMEM_EXPLICIT
+#undef VIRTMEM_THREAD_LOCAL
 #endif
 
 /**
@@ -46,6 +54,171 @@
   */
 //#define VIRTMEM_TRACE_STATS
 
+/**
+  * @def VIRTMEM_WIDE_PAGES
+  * @brief If defined, 32 bit types are used to index, count and size memory pages.
+  *
+  * Without this option page indices are stored in 8 bits and page sizes in 16 bits,
+  * which limits an allocator to 127 pages per type of up to 64 kB each. This compact layout
+  * saves RAM on small MCUs, but restricts the page cache on platforms with plenty of RAM.
+  * Defining this option allows thousands of pages and page sizes of several megabytes.
+  * By default it is only enabled on PC like platforms.
+  * @sa virtmem::VirtPageSize, virtmem::VirtPageIndex and virtmem::VirtPageCount
+  */
+#if defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32)
+#define VIRTMEM_WIDE_PAGES
+#endif
+
+/**
+  * @def VIRTMEM_WIDE_ADDRESSES
+  * @brief If defined, virtual pointers, memory block sizes and statistics counters are 64 bit.
+  *
+  * By default virtual addresses are 32 bit wide, which limits the memory pool of an
+  * allocator to 4 GB. Defining this option lifts this limit at the cost of larger virtual
+  * pointers and memory block headers. By default it is only enabled on PC like platforms.
+  * @sa virtmem::VPtrNum and virtmem::VPtrSize
+  */
+#if defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32)
+#define VIRTMEM_WIDE_ADDRESSES
+#endif
+
+/**
+  * @brief The alignment (in bytes) of memory blocks allocated by the default allocation engine.
+  *
+  * This is also the unit in which block sizes are stored: a memory block occupies a whole number of units,
+  * and its header occupies at least one unit. Smaller values therefore waste less memory for small blocks, but
+  * the alignment should suit the data that is stored. Must be zero or a power of two. Zero (the default) uses the
+  * alignment of the largest fundamental type of the platform, which is 16 bytes on x86-64.
+  * @sa VIRTMEM_COMPACT_HEADERS
+  */
+#define VIRTMEM_ALLOC_ALIGN 0
+
+/**
+  * @def VIRTMEM_COMPACT_HEADERS
+  * @brief If defined, the headers of memory blocks allocated by the default allocation engine are 8 bytes.
+  *
+  * Headers store the address of the next free block and the block size, which normally each take the size of a
+  * virtual pointer (i.e. 16 bytes with VIRTMEM_WIDE_ADDRESSES). This option stores both in 32 bits instead, which
+  * limits the used part of the memory pool to 4 GB. Combine this option with a VIRTMEM_ALLOC_ALIGN of 8 (or less)
+  * to reduce the header size. Allocation engines (e.g. virtmem::SlabAllocEngine) use their own headers, but
+  * their memory is limited to the first 4 GB of the pool as well.
+  */
+//#define VIRTMEM_COMPACT_HEADERS
+
+/**
+  * @def VIRTMEM_ALIGNED_PAGES
+  * @brief If defined, *big* pages used for caching are mapped to fixed frames, which are aligned to the
+  * size of a big page.
+  *
+  * Frames never overlap, which avoids duplicate reads of neighbouring data and keeps I/O to the
+  * memory pool aligned. Data that straddles two frames is loaded in a page that starts at the
+  * data instead. Big pages used for locking always start at the locked data: when unlocked, they are only
+  * kept as cache if they map a frame. If this option is not defined, big pages simply start at the
+  * first address that was accessed.
+  */
+#define VIRTMEM_ALIGNED_PAGES
+
+/**
+  * @def VIRTMEM_READ_AHEAD
+  * @brief If defined, allocators can detect sequential access and read ahead *big* pages.
+  *
+  * When data is accessed in ascending or descending order, multiple pages are loaded ahead
+  * with a single read from the memory pool. Read-ahead is disabled by default for each allocator,
+  * and has to be enabled with virtmem::BaseVAlloc::setReadAhead(). Descending access is only detected
+  * if VIRTMEM_ALIGNED_PAGES is defined. By default this option is only enabled on PC like platforms.
+  * @sa VIRTMEM_READ_AHEAD_STREAMS
+  */
+#if defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32)
+#define VIRTMEM_READ_AHEAD
+#endif
+
+/**
+  * @brief The amount of sequential access streams that are tracked for read-ahead.
+  *
+  * Each stream follows accesses within a different region of the memory pool, for instance, when
+  * two arrays are processed simultaneously.
+  * @sa VIRTMEM_READ_AHEAD
+  */
+#define VIRTMEM_READ_AHEAD_STREAMS 4
+
+/**
+  * @def VIRTMEM_ASYNC_IO
+  * @brief If defined, allocators can perform I/O to their memory pool on a background thread.
+  *
+  * Dirty pages that are swapped out are then written while the application continues, and pages
+  * read ahead (see VIRTMEM_READ_AHEAD) are loaded in the background. Asynchronous I/O has to be
+  * enabled for each allocator with virtmem::BaseVAlloc::setAsyncIO(), and
+  * virtmem::BaseVAlloc::sync() can be used to wait until all data is written. Access to the memory
+  * pool is serialized, so existing allocators (e.g. StdioVAlloc) can be used unchanged.
+  * This option requires C++11 thread support, and is therefore only usable on PC like platforms.
+  * @sa VIRTMEM_ASYNC_IO_BUFFER_SIZE
+  */
+//#define VIRTMEM_ASYNC_IO
+
+/**
+  * @brief Maximum amount of bytes used to buffer data that is written in the background.
+  * @sa VIRTMEM_ASYNC_IO
+  */
+#define VIRTMEM_ASYNC_IO_BUFFER_SIZE (1024l * 1024l)
+
+/**
+  * @def VIRTMEM_HEADER_CACHE_SIZE
+  * @brief The amount of memory block headers that are cached in RAM by each allocator.
+  *
+  * The default allocation algorithm (i.e. when no allocation engine is set, see virtmem::BaseAllocEngine)
+  * stores a header for each memory block and its free list within the memory pool. When the headers are
+  * cached, allocating and freeing memory mostly does not access the *big* pages, so bookkeeping does not
+  * swap out application data. Modified headers are written to the memory pool when they are removed from
+  * the cache, and by virtmem::BaseVAlloc::flush(). Each cached header uses about 40 bytes of RAM on a PC
+  * (less on MCUs). A value of zero disables caching. By default caching is only enabled on PC like platforms.
+  */
+#if defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32)
+#define VIRTMEM_HEADER_CACHE_SIZE 256
+#else
+#define VIRTMEM_HEADER_CACHE_SIZE 0
+#endif
+
+/**
+  * @def VIRTMEM_ZERO_MAP_SIZE
+  * @brief The amount of bytes of RAM used by each allocator to track which parts of the memory pool were never written.
+  *
+  * The memory pool is divided in up to `VIRTMEM_ZERO_MAP_SIZE * 8` equally sized regions. Data of regions that were
+  * not written since virtmem::BaseVAlloc::start() is known to be zero, so it is not read from the memory pool. This
+  * avoids most reads when freshly allocated memory is accessed. A value of zero disables tracking. By default
+  * tracking is only enabled on PC like platforms.
+  */
+#if defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32)
+#define VIRTMEM_ZERO_MAP_SIZE 1024
+#else
+#define VIRTMEM_ZERO_MAP_SIZE 0
+#endif
+
+/**
+  * @def VIRTMEM_THREAD_SAFE
+  * @brief If defined, allocators and virtual pointers can be used from multiple threads.
+  *
+  * The page cache is divided in shards, each with its own lock (see VIRTMEM_CACHE_SHARDS), and allocation
+  * bookkeeping (virtmem::BaseVAlloc::allocRaw() and virtmem::BaseVAlloc::freeRaw()) is protected by a separate lock.
+  * Dereferencing a virtual pointer copies the data while the cache is locked, since other threads may
+  * swap out pages at any time. Memory that is locked (e.g. with virtmem::VPtrLock) stays valid until the
+  * lock is released, also when other threads access the allocator. Pointers returned by
+  * virtmem::BaseVAlloc::read() however are *not* guaranteed to stay valid.
+  * This option requires C++11 thread support, and is therefore only usable on PC like platforms.
+  */
+//#define VIRTMEM_THREAD_SAFE
+
+/**
+  * @brief The maximum amount of shards of the page cache, used if VIRTMEM_THREAD_SAFE is defined.
+  *
+  * The memory pool is divided in small regions that are assigned to the shards in turn. Each shard caches the
+  * data of its regions in its own part of the *big* pages, with its own lock and replacement policy (see
+  * virtmem::BasePagePolicy). Threads accessing data of different shards therefore don't wait for each other.
+  * Locking memory (e.g. with virtmem::VPtrLock) and bookkeeping such as virtmem::BaseVAlloc::flush() lock all
+  * shards. An allocator uses fewer shards if it has less than eight *big* pages for each of them. The value
+  * should be a power of two between 1 and 32, where 1 disables sharding.
+  */
+#define VIRTMEM_CACHE_SHARDS 4
+
 /**
   * @brief The default poolsize for allocators supporting a variable sized pool.
   *
@@ -71,10 +244,24 @@
   */
 #define VIRTMEM_EXPLICIT explicit
 
+/**
+  * @def VIRTMEM_THREAD_LOCAL
+  * @brief Storage class used for the current allocator instance (see virtmem::VAlloc::makeCurrent()).
+  *
+  * On PC like platforms every thread has its own current allocator instance. Otherwise, this is
+  * empty and the current instance is shared.
+  */
+#if defined(VIRTMEM_CPP11) && (defined(__unix__) || defined(__UNIX__) || (defined(__APPLE__) && defined(__MACH__)) || defined(_WIN32))
+#define VIRTMEM_THREAD_LOCAL thread_local
+#else
+#define VIRTMEM_THREAD_LOCAL
+#endif
+
 namespace virtmem {
 
 // Default virtual memory page settings
-// NOTE: Take care of sufficiently large int types when increasing these values
+// NOTE: Take care of sufficiently large int types when increasing these values. More than
+// 127 pages (per type) or pages larger than 64 kB require VIRTMEM_WIDE_PAGES.
 
 #if defined(__MK20DX256__) || defined(__SAM3X8E__) // Teensy 3.1 / Arduino Due (>= 64 kB sram)
 struct DefaultAllocProperties
@@ -208,6 +395,30 @@ SDVAllocP<AllocProperties> alloc;
 #ifndef VIRTMEM_TRACE_STATS
 #define VIRTMEM_TRACE_STATS
 #endif
+
+#ifndef VIRTMEM_WIDE_PAGES
+#define VIRTMEM_WIDE_PAGES
+#endif
+
+#ifndef VIRTMEM_WIDE_ADDRESSES
+#define VIRTMEM_WIDE_ADDRESSES
+#endif
+
+#ifndef VIRTMEM_ALIGNED_PAGES
+#define VIRTMEM_ALIGNED_PAGES
+#endif
+
+#ifndef VIRTMEM_READ_AHEAD
+#define VIRTMEM_READ_AHEAD
+#endif
+
+#ifndef VIRTMEM_ASYNC_IO
+#define VIRTMEM_ASYNC_IO
+#endif
+
+#ifndef VIRTMEM_THREAD_SAFE
+#define VIRTMEM_THREAD_SAFE
+#endif
 #endif
 
 #endif // CONFIG_H
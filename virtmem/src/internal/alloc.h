@@ -6,14 +6,63 @@
   @brief virtual memory class header
 */
 
+#include "alloc_engine.h"
 #include "base_alloc.h"
 #include "config/config.h"
+#include "page_policy.h"
+#include "utils.h"
 #include "vptr.h"
 
+#include <stdlib.h>
+
 namespace virtmem {
 
 template <typename, typename> class VPtr;
 
+// \cond HIDDEN_SYMBOLS
+namespace private_utils {
+
+// Checks if allocator properties declare a PagePolicy type
+template <typename Properties> struct HasPagePolicy
+{
+    template <typename P> static char test(typename P::PagePolicy *);
+    template <typename P> static long test(...);
+    enum { value = (sizeof(test<Properties>(0)) == sizeof(char)) };
+};
+
+template <typename Properties, uint8_t shards, bool = HasPagePolicy<Properties>::value> struct PagePolicyHolder
+{
+    BasePagePolicy *get(uint8_t) { return 0; } // use built-in FIFO
+};
+
+template <typename Properties, uint8_t shards> struct PagePolicyHolder<Properties, shards, true>
+{
+    typename Properties::PagePolicy policy[shards]; // one for each cache shard (see VIRTMEM_CACHE_SHARDS)
+    BasePagePolicy *get(uint8_t shard) { return &policy[shard]; }
+};
+
+// Checks if allocator properties declare an AllocEngine type
+template <typename Properties> struct HasAllocEngine
+{
+    template <typename P> static char test(typename P::AllocEngine *);
+    template <typename P> static long test(...);
+    enum { value = (sizeof(test<Properties>(0)) == sizeof(char)) };
+};
+
+template <typename Properties, bool = HasAllocEngine<Properties>::value> struct AllocEngineHolder
+{
+    BaseAllocEngine *get(void) { return 0; } // use built-in free list
+};
+
+template <typename Properties> struct AllocEngineHolder<Properties, true>
+{
+    typename Properties::AllocEngine engine;
+    BaseAllocEngine *get(void) { return &engine; }
+};
+
+}
+// \endcond
+
 /**
  * @brief Base template class for virtual memory allocators.
  *
@@ -21,15 +70,33 @@ template <typename, typename> class VPtr;
  * defined in BaseVAlloc, while this class only contains code dependent upon template
  * parameters (i.e. page settings).
  *
- * @tparam Properties Allocator properties, see DefaultAllocProperties
- * @tparam Derived Dummy parameter, used to create unique singleton instances for each derived class.
+ * @tparam Properties Allocator properties, see DefaultAllocProperties. The replacement policy of *big* pages can
+ * optionally be set by declaring a `PagePolicy` type, see BasePagePolicy. Similarly, the allocation engine can
+ * be set by declaring an `AllocEngine` type, see BaseAllocEngine.
+ * @tparam Derived Dummy parameter, used to create unique instances for each derived class.
+ *
+ * Multiple instances of the same allocator class may exist, each with their own memory pool and cache.
+ * Virtual pointers use the *current* instance, which is the instance created first, unless another
+ * instance was made current (see \ref makeCurrent() and \ref Scope).
  */
 template <typename Properties, typename Derived>
 class VAlloc : public BaseVAlloc
 {
+    enum
+    {
+        BATCH_CHUNK_SIZE = 32, // blocks allocated or freed at once by allocBatch() and freeBatch()
+        LOCKED_INDEX_SIZE = private_utils::CeilPowerOfTwo<Properties::smallPageCount + Properties::mediumPageCount +
+                                                          Properties::bigPageCount>::value,
+        BIG_INDEX_SIZE = private_utils::CeilPowerOfTwo<Properties::bigPageCount>::value
+    };
+
     LockPage smallPagesData[Properties::smallPageCount];
     LockPage mediumPagesData[Properties::mediumPageCount];
     LockPage bigPagesData[Properties::bigPageCount];
+    LockPage *lockedPageIndexData[LOCKED_INDEX_SIZE];
+    LockPage *bigPageIndexData[BIG_INDEX_SIZE];
+    private_utils::PagePolicyHolder<Properties, CACHE_SHARDS> pagePolicyHolder;
+    private_utils::AllocEngineHolder<Properties> allocEngineHolder;
 #ifdef NVALGRIND
     uint8_t smallPagePool[Properties::smallPageCount * Properties::smallPageSize] __attribute__ ((aligned (sizeof(TAlign))));
     uint8_t mediumPagePool[Properties::mediumPageCount * Properties::mediumPageSize] __attribute__ ((aligned (sizeof(TAlign))));
@@ -39,13 +106,25 @@ class VAlloc : public BaseVAlloc
     uint8_t mediumPagePool[Properties::mediumPageCount * (Properties::mediumPageSize + valgrindPad * 2)];
     uint8_t bigPagePool[Properties::bigPageCount * (Properties::bigPageSize + valgrindPad * 2)];
 #endif
-    static VAlloc *instance;
+    static VAlloc *instance; // default instance
+    static VIRTMEM_THREAD_LOCAL VAlloc *currentInstance; // overrides the default instance, if set
+
+    // qsort() callback that orders virtual pointers by address (see freeBatch())
+    template <typename T> static int compareVPtrs(const void *a, const void *b)
+    {
+        const VPtrNum pa = static_cast<const virtmem::VPtr<T, Derived> *>(a)->getRawNum();
+        const VPtrNum pb = static_cast<const virtmem::VPtr<T, Derived> *>(b)->getRawNum();
+        return (pa < pb) ? -1 : (pa > pb);
+    }
 
 protected:
     VAlloc(void)
     {
-        ASSERT(!instance);
-        instance = this;
+        if (!instance)
+            instance = this;
+        ASSERT(validPageSettings(Properties::smallPageCount, Properties::smallPageSize));
+        ASSERT(validPageSettings(Properties::mediumPageCount, Properties::mediumPageSize));
+        ASSERT(validPageSettings(Properties::bigPageCount, Properties::bigPageSize));
 #ifdef NVALGRIND
         initSmallPages(smallPagesData, &smallPagePool[0], Properties::smallPageCount, Properties::smallPageSize);
         initMediumPages(mediumPagesData, &mediumPagePool[0], Properties::mediumPageCount, Properties::mediumPageSize);
@@ -58,16 +137,27 @@ protected:
         VALGRIND_MAKE_MEM_NOACCESS(&mediumPagePool[0], pad); VALGRIND_MAKE_MEM_NOACCESS(&mediumPagePool[Properties::mediumPageCount * Properties::mediumPageSize + pad], pad);
         VALGRIND_MAKE_MEM_NOACCESS(&bigPagePool[0], pad); VALGRIND_MAKE_MEM_NOACCESS(&bigPagePool[Properties::bigPageCount * Properties::bigPageSize + pad], pad);
 #endif
+        initPageIndices(lockedPageIndexData, LOCKED_INDEX_SIZE, bigPageIndexData, BIG_INDEX_SIZE);
+        for (uint8_t i=0; i<CACHE_SHARDS; ++i)
+            setPagePolicy(pagePolicyHolder.get(i), i);
+        setAllocEngine(allocEngineHolder.get());
+    }
+    ~VAlloc(void)
+    {
+        if (instance == this)
+            instance = 0;
+        if (currentInstance == this)
+            currentInstance = 0;
     }
-    ~VAlloc(void) { instance = 0; }
 
 public:
     /**
-     * @brief Returns a pointer to the instance of the class.
+     * @brief Returns a pointer to the current instance of the class.
      *
-     * All allocator classes are singletons: only one instance can exist for a particular allocator.
+     * This is the instance used by virtual pointers. By default, this is the instance that was
+     * created first. Another instance can be used with \ref makeCurrent() or \ref Scope.
      *
-     * Note that, since allocators are template classes, one instance is generated for every set of
+     * Note that, since allocators are template classes, a separate instance is used for every set of
      * unique template parameters. For example:
      * @code{.cpp}
      * virtmem::SDVAlloc alloc1; // allocator with default template parameters
@@ -76,7 +166,48 @@ public:
      * In this case, `alloc1` and `alloc2` are variables with a *different* type, hence getInstance()
      * will return a different instance for both classes.
      */
-    static VAlloc *getInstance(void) { return instance; }
+    static VAlloc *getInstance(void) { return (currentInstance) ? currentInstance : instance; }
+
+    /**
+     * @brief Makes this instance the current instance, i.e. the instance used by virtual pointers.
+     *
+     * This allows multiple instances of the same allocator class, for instance to use a separate memory pool
+     * per thread. If VIRTMEM_THREAD_LOCAL is not empty (the default on PC like platforms), the current
+     * instance is only changed for the calling thread.
+     * @note Virtual pointers do not store which instance they belong to. Hence, a virtual pointer should
+     * only be used while the instance it was allocated from is current.
+     * @sa resetCurrent, Scope
+     */
+    void makeCurrent(void) { currentInstance = this; }
+    //! Makes the default instance (i.e. the instance created first) current again. @sa makeCurrent
+    static void resetCurrent(void) { currentInstance = 0; }
+
+    /**
+     * @brief Makes an allocator instance current while in scope.
+     *
+     * Example:
+     * @code{.cpp}
+     * virtmem::StdioVAlloc valloc, valloc2;
+     * {
+     *     virtmem::StdioVAlloc::Scope scope(valloc2);
+     *     virtmem::StdioVAlloc::TVPtr<int>::type vptr = valloc2.alloc<int>();
+     *     *vptr = 10; // uses valloc2
+     * }
+     * // valloc is used again
+     * @endcode
+     * @sa makeCurrent
+     */
+    class Scope
+    {
+        VAlloc *previous;
+
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+
+    public:
+        Scope(VAlloc &a) : previous(currentInstance) { currentInstance = &a; } //!< Makes \a a current.
+        ~Scope(void) { currentInstance = previous; } //!< Restores the previous current instance.
+    };
 
     // C style malloc/free
     /**
@@ -113,6 +244,166 @@ public:
         p.setRawNum(0);
     }
 
+    /**
+     * @brief Changes the size of a block of virtual memory
+     * @param p virtual pointer that points to the block to be resized
+     * @param size The new size in bytes.
+     * @return Virtual pointer pointing to the resized memory block. Will be null if out of memory, in which
+     * case \a p stays valid.
+     *
+     * This function is the equivelant of the C `realloc` function. The block is resized in place if possible.
+     * Otherwise, the data is copied to a new block (see \ref BaseVAlloc::reallocRaw).
+     * @sa alloc, free, BaseVAlloc::reallocRaw
+     */
+    template <typename T> VPtr<T, Derived> realloc(const VPtr<T, Derived> &p, VPtrSize size)
+    {
+        virtmem::VPtr<T, Derived> ret;
+        ret.setRawNum(reallocRaw(p.getRawNum(), size));
+        return ret;
+    }
+
+    //! Stores the address of a block as *root* of a persistent memory pool. @sa BaseVAlloc::setPersistent, getRoot
+    template <typename T> void setRoot(const VPtr<T, Derived> &p) { setRootRaw(p.getRawNum()); }
+    /**
+     * @brief Returns the *root* of a persistent memory pool.
+     *
+     * The root is usually the start of a data structure, which can be found again when a persistent memory
+     * pool is reopened. Example:
+     * @code{.cpp}
+     * valloc.setPersistent(true);
+     * valloc.start();
+     * virtmem::SDVAlloc::TVPtr<Node>::type list = valloc.getRoot<Node>();
+     * if (!list)
+     * {
+     *     list = valloc.alloc<Node>(); // new memory pool
+     *     valloc.setRoot(list);
+     * }
+     * @endcode
+     * @sa BaseVAlloc::setPersistent, setRoot
+     */
+    template <typename T> VPtr<T, Derived> getRoot(void) const
+    {
+        virtmem::VPtr<T, Derived> ret;
+        ret.setRawNum(getRootRaw());
+        return ret;
+    }
+
+    /**
+     * @brief Allocates memory close to other memory
+     * @tparam T The data type to allocate for.
+     * @param hint Virtual pointer to a block (as returned by \ref alloc) which the new memory should be close to.
+     * @param size The number of bytes to allocate. By default this is the size of the type pointed to.
+     * @return Virtual pointer pointing to allocated memory.
+     *
+     * Memory near \a hint is preferred, so that both blocks are likely to share a page. This reduces the
+     * amount of page swaps for data that is accessed together, for instance:
+     * @code
+     * node->next = valloc.allocNear<Node>(node);
+     * @endcode
+     * If no memory near \a hint is free, or \a hint is null, this function behaves like \ref alloc.
+     * @sa Cluster, BaseVAlloc::allocRawNear
+     */
+    template <typename T, typename U> VPtr<T, Derived> allocNear(const VPtr<U, Derived> &hint, VPtrSize size=sizeof(T))
+    {
+        virtmem::VPtr<T, Derived> ret;
+        ret.setRawNum(allocRawNear(hint.getRawNum(), size));
+        return ret;
+    }
+
+    /**
+     * @brief Allocates related memory close together.
+     *
+     * Each allocation is placed near the previous allocation of the cluster (see \ref allocNear). This
+     * is useful to build structures that are traversed in order, such as linked lists.
+     *
+     * Example:
+     * @code{.cpp}
+     * virtmem::StdioVAlloc valloc;
+     * virtmem::StdioVAlloc::Cluster cluster(valloc);
+     * virtmem::StdioVAlloc::TVPtr<Node>::type head = cluster.alloc<Node>(), node = head;
+     * for (int i=0; i<100; ++i)
+     *     node = node->next = cluster.alloc<Node>();
+     * @endcode
+     */
+    class Cluster
+    {
+        VAlloc &allocator;
+        VPtrNum last;
+
+        Cluster(const Cluster &);
+        Cluster &operator=(const Cluster &);
+
+    public:
+        Cluster(VAlloc &a) : allocator(a), last(0) { } //!< Constructs an empty cluster for \a a.
+        //! Constructs a cluster that starts near the block pointed to by \a hint.
+        template <typename U> Cluster(VAlloc &a, const VPtr<U, Derived> &hint) : allocator(a), last(hint.getRawNum()) { }
+
+        //! Allocates memory near the previous allocation. @sa VAlloc::alloc
+        template <typename T> VPtr<T, Derived> alloc(VPtrSize size=sizeof(T))
+        {
+            virtmem::VPtr<T, Derived> ret;
+            ret.setRawNum(allocator.allocRawNear(last, size));
+            if (ret)
+                last = ret.getRawNum();
+            return ret;
+        }
+    };
+
+    /**
+     * @brief Allocates multiple blocks of virtual memory of the same size
+     * @param count The amount of blocks to allocate.
+     * @param size The size of each block in bytes.
+     * @param ptrs Array of at least \a count virtual pointers that receive the allocated blocks.
+     * @return Whether all blocks could be allocated. If not, no memory is allocated.
+     *
+     * This function is much faster than calling \ref alloc for each block, for instance when
+     * building large linked structures.
+     * @sa freeBatch, BaseVAlloc::allocRawBatch
+     */
+    template <typename T> bool allocBatch(VPtrSize count, VPtrSize size, VPtr<T, Derived> *ptrs)
+    {
+        VPtrNum raw[BATCH_CHUNK_SIZE];
+        for (VPtrSize i=0; i<count; i+=BATCH_CHUNK_SIZE)
+        {
+            const VPtrSize n = private_utils::minimal(count - i, (VPtrSize)BATCH_CHUNK_SIZE);
+            if (!allocRawBatch(n, size, raw))
+            {
+                freeBatch(ptrs, i);
+                return false;
+            }
+            for (VPtrSize j=0; j<n; ++j)
+                ptrs[i + j].setRawNum(raw[j]);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Frees multiple blocks of virtual memory
+     * @param ptrs Array with virtual pointers to the blocks to be freed. The pointers will be set to null.
+     * @param count The amount of virtual pointers in \a ptrs.
+     *
+     * The blocks are freed in chunks by BaseVAlloc::freeRawBatch(), which is much faster than calling
+     * \ref free for each block.
+     * @note The array \a ptrs is sorted by address first, so that all chunks together are freed in order.
+     * @sa allocBatch, BaseVAlloc::freeRawBatch
+     */
+    template <typename T> void freeBatch(VPtr<T, Derived> *ptrs, VPtrSize count)
+    {
+        qsort(ptrs, count, sizeof(virtmem::VPtr<T, Derived>), compareVPtrs<T>);
+
+        VPtrNum raw[BATCH_CHUNK_SIZE];
+        for (VPtrSize i=0; i<count; i+=BATCH_CHUNK_SIZE)
+        {
+            const VPtrSize n = private_utils::minimal(count - i, (VPtrSize)BATCH_CHUNK_SIZE);
+            for (VPtrSize j=0; j<n; ++j)
+            {
+                raw[j] = ptrs[i + j].getRawNum();
+                ptrs[i + j].setRawNum(0);
+            }
+            freeRawBatch(raw, n);
+        }
+    }
+
     // C++ style new/delete --> call constructors (by placement new) and destructors
     /**
      * @brief Allocates memory and constructs data type
@@ -129,8 +420,14 @@ public:
     template <typename T> VPtr<T, Derived> newClass(VPtrSize size=sizeof(T))
     {
         virtmem::VPtr<T, Derived> ret = alloc<T>(size);
+#ifdef VIRTMEM_THREAD_SAFE
+        // other threads may swap out the page returned by read(), so construct in locked data instead
+        new (makeDataLock(ret.getRawNum(), sizeof(T))) T;
+        releaseLock(ret.getRawNum());
+#else
         T *ptr = static_cast<T *>(read(ret.getRawNum(), sizeof(T)));
         new (ptr) T; // UNDONE: can this be ro?
+#endif
         return ret;
     }
 
@@ -168,7 +465,15 @@ public:
         write(p, &elements, sizeof(VPtrSize));
         p += sizeof(VPtrSize);
         for (VPtrSize s=0; s<elements; ++s)
-            new (read(p + (s * sizeof(T)), sizeof(T))) T; // UNDONE: can this be ro?
+        {
+            const VPtrNum elp = p + (s * sizeof(T));
+#ifdef VIRTMEM_THREAD_SAFE
+            new (makeDataLock(elp, sizeof(T))) T; // see newClass()
+            releaseLock(elp);
+#else
+            new (read(elp, sizeof(T))) T; // UNDONE: can this be ro?
+#endif
+        }
 
         virtmem::VPtr<T, Derived> ret;
         ret.setRawNum(p);
@@ -186,11 +491,18 @@ public:
     template <typename T> void deleteArray(VPtr<T, Derived> &p)
     {
         const VPtrNum soffset = p.getRawNum() - sizeof(VPtrSize); // pointer to size offset
-        VPtrSize *size = static_cast<VPtrSize *>(read(soffset, sizeof(VPtrSize)));
-        for (VPtrSize s=0; s<*size; ++s)
+        VPtrSize size;
+        read(soffset, &size, sizeof(VPtrSize));
+        for (VPtrSize s=0; s<size; ++s)
         {
-            T *ptr = static_cast<T *>(read(p.getRawNum() + (s * sizeof(T)), sizeof(T)));
+            const VPtrNum elp = p.getRawNum() + (s * sizeof(T));
+#ifdef VIRTMEM_THREAD_SAFE
+            static_cast<T *>(makeDataLock(elp, sizeof(T)))->~T(); // see newClass()
+            releaseLock(elp);
+#else
+            T *ptr = static_cast<T *>(read(elp, sizeof(T)));
             ptr->~T();
+#endif
         }
         freeRaw(soffset); // soffset points at beginning of actual block
     }
@@ -225,6 +537,9 @@ public:
 template <typename Properties, typename Derived>
 VAlloc<Properties, Derived> *VAlloc<Properties, Derived>::instance = 0;
 
+template <typename Properties, typename Derived>
+VIRTMEM_THREAD_LOCAL VAlloc<Properties, Derived> *VAlloc<Properties, Derived>::currentInstance = 0;
+
 }
 
 #endif // VIRTMEM_ALLOC_H
@@ -0,0 +1,1048 @@
+#ifndef VIRTMEM_ALLOC_ENGINE_H
+#define VIRTMEM_ALLOC_ENGINE_H
+
+/**
+  @file
+  @brief Allocation engines, which manage the free space of the memory pool
+*/
+
+#include "base_alloc.h"
+#include "config/config.h"
+#include "utils.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace virtmem {
+
+/**
+ * @brief Base class for allocation engines.
+ *
+ * An allocation engine decides where memory blocks are placed in the memory pool (see
+ * BaseVAlloc::allocRaw() and BaseVAlloc::freeRaw()). Unused memory is obtained from the pool
+ * with \ref getPoolMem().
+ *
+ * Engines are selected by declaring an `AllocEngine` type in the allocator properties, for example:
+ * @code{.cpp}
+struct AllocProperties
+{
+    static const uint8_t smallPageCount = 4, smallPageSize = 64;
+    static const uint8_t mediumPageCount = 4, mediumPageSize = 128;
+    static const uint8_t bigPageCount = 8;
+    static const uint16_t bigPageSize = 512;
+    typedef virtmem::SlabAllocEngine<64> AllocEngine;
+};
+ * @endcode
+ * If no engine is declared, a first-fit free list is used, which is stored within the memory pool
+ * (based on *memmgr* by Eli Bendersky). This default needs no extra RAM, but allocating and freeing
+ * memory may require many page swaps.
+ *
+ * @sa SlabAllocEngine, TLSFAllocEngine
+ */
+class BaseAllocEngine
+{
+    BaseVAlloc *allocator;
+
+    friend class BaseVAlloc;
+
+protected:
+    BaseVAlloc *getAllocator(void) const { return allocator; } //!< Returns the allocator using this engine.
+    //! Takes \a size bytes of unused memory from the pool, aligned to \a align (a power of two). Returns zero if the pool is full.
+    VPtrNum getPoolMem(VPtrSize size, VPtrSize align) { return allocator->getPoolMem(size, align); }
+    //! Extends memory obtained by getPoolMem() that ends at \a end by \a size bytes. Only succeeds for the last memory taken from the pool.
+    bool extendPoolMem(VPtrNum end, VPtrSize size) { return allocator->extendPoolMem(end, size); }
+    //! Drops the data of an unused region of the pool, see BaseVAlloc::doTrim(). Only whole *big* pages are dropped.
+    void trimPoolMem(VPtrNum start, VPtrSize size) { allocator->trimPool(start, size); }
+
+public:
+    BaseAllocEngine(void) : allocator(0) { }
+
+    /**
+     * @name Engine hooks
+     * The following functions should be defined by derived engine classes.
+     * @{
+     */
+    virtual void reset(void) = 0; //!< Called when the allocator starts. All memory is unused afterwards.
+    //! Allocates a block of at least \a size bytes, stores the actual size in \a blocksize. Returns zero if out of memory.
+    virtual VPtrNum alloc(VPtrSize size, VPtrSize &blocksize) = 0;
+    virtual VPtrSize free(VPtrNum ptr) = 0; //!< Frees a block returned by alloc() and returns its size
+    virtual VPtrSize getSize(VPtrNum ptr) = 0; //!< Returns the amount of usable bytes of a block returned by alloc()
+    //! @}
+
+    /**
+     * @brief Tries to resize a block without moving it.
+     *
+     * Used by BaseVAlloc::reallocRaw(). If the block cannot be resized in place, it is copied to a new block
+     * instead. The default implementation never resizes in place.
+     * @param ptr The block to resize, as returned by alloc().
+     * @param size The new size in bytes.
+     * @param oldblocksize Set to the previous size of the block (as returned by free()), if successful.
+     * @param newblocksize Set to the new size of the block (as set by alloc()), if successful.
+     * @return Whether the block was resized.
+     */
+    virtual bool resize(VPtrNum ptr, VPtrSize size, VPtrSize &oldblocksize, VPtrSize &newblocksize)
+    { (void)ptr; (void)size; (void)oldblocksize; (void)newblocksize; return false; }
+
+    /**
+     * @brief Allocates a block close to another block.
+     *
+     * Used by BaseVAlloc::allocRawNear(). If no memory is available near \a hint, zero should be returned,
+     * after which alloc() is used instead. The default implementation never allocates near other blocks.
+     * @param hint A block returned by alloc(), which the new block should be close to.
+     * @param size The size of the new block in bytes.
+     * @param blocksize Set to the actual size of the block, as for alloc().
+     * @return The new block, or zero if there is no free memory near \a hint.
+     */
+    virtual VPtrNum allocNear(VPtrNum hint, VPtrSize size, VPtrSize &blocksize)
+    { (void)hint; (void)size; (void)blocksize; return 0; }
+};
+
+/**
+ * @brief Allocation engine with segregated size classes.
+ *
+ * Small blocks (up to 512 bytes) are rounded up to a power of two size class. Blocks of the same
+ * class are taken from *slabs*: regions of the memory pool that are divided in equally sized blocks.
+ * The slabs and the usage of their blocks are tracked in RAM, hence, allocating and freeing small blocks
+ * does not access the memory pool at all. Small blocks have no header, so with a small \a minBlockSize
+ * tiny objects only occupy their own (rounded) size.
+ *
+ * Larger blocks start with a small header in the memory pool, which stores their size and whether the
+ * preceding block is free. Freed large blocks are merged with adjacent free blocks immediately, and are
+ * kept in lists per power of two size (*bins*). The first bin that may contain a large enough block is
+ * searched completely for the best fitting block, which requires reading the headers of its blocks.
+ *
+ * Memory for slabs and large blocks is taken from the memory pool when needed. Consecutive memory of
+ * large blocks is merged. Slabs that become empty are re-used for any size class. When all slabs are
+ * used, small blocks are allocated as large blocks.
+ *
+ * @tparam slabCount The maximum amount of slabs. Each slab uses about `slabSize / (8 * minBlockSize)`
+ * bytes of RAM.
+ * @tparam slabSize The size of a slab in bytes. This should be a power of two from 1024 up to 512 kB.
+ * @tparam minBlockSize The size of the smallest size class, which is also the alignment of the smallest
+ * blocks. This should be a power of two from 4 up to 64 bytes. A slab can hold at most 32768 blocks.
+ */
+template <uint16_t slabCount, VPtrSize slabSize=4096, uint8_t minBlockSize=16> class SlabAllocEngine : public BaseAllocEngine
+{
+    enum
+    {
+        MIN_BLOCK_SIZE = minBlockSize,
+        MAX_SMALL_SIZE = 512,
+        SIZE_CLASSES = private_utils::FloorLog2<MAX_SMALL_SIZE / MIN_BLOCK_SIZE>::value + 1,
+        BITMAP_WORDS = (slabSize / MIN_BLOCK_SIZE + 31) / 32,
+        SLAB_INDEX_SIZE = private_utils::CeilPowerOfTwo<slabCount * 2>::value,
+        LARGE_ALIGN = 16, // alignment of large blocks
+        HEADER_SIZE = LARGE_ALIGN, // size + prevFreePhys, keeps large blocks aligned
+        LARGE_BINS = sizeof(VPtrSize) * 8,
+        FREE_BIT = 1, // stored in the size of large blocks
+        NO_SLAB = 0xFFFF
+    };
+
+    struct Slab
+    {
+        VPtrNum start; // zero if the slab has no memory yet
+        uint16_t used; // amount of allocated blocks
+        uint16_t next, prev; // list of slabs with free blocks of the same class or of empty slabs
+        uint8_t sizeClass;
+        uint32_t bitmap[BITMAP_WORDS]; // allocated blocks, unavailable blocks are always set
+    };
+
+    // stored at the start of large blocks, the bin pointers are only used by free blocks
+    struct LargeHeader
+    {
+        VPtrSize size; // including header
+        VPtrNum prevFreePhys; // the preceding large block in the pool if it is free, zero otherwise
+        VPtrNum nextFree, prevFree; // neighbours in the bin
+    };
+
+    Slab slabs[slabCount];
+    uint16_t slabIndex[SLAB_INDEX_SIZE]; // open addressing hash (start / slabSize) --> slab + 1
+    uint16_t partialSlabs[SIZE_CLASSES]; // slabs with free blocks, per class
+    uint16_t emptySlabs, unusedSlabs; // unusedSlabs: first slab without memory
+    VPtrNum largeBins[LARGE_BINS]; // free large blocks, bin N contains sizes in [2^N, 2^(N+1))
+    VPtrSize usedBins; // bit N is set if largeBins[N] is not empty
+    VPtrNum arenaEnd; // zero sized sentinel block after the last memory of large blocks, zero if none
+
+    static uint8_t getBin(VPtrSize size) { return private_utils::floorLog2(size); }
+    static uint16_t getBlockCount(uint8_t sizeclass) { return slabSize / (MIN_BLOCK_SIZE << sizeclass); }
+
+    void pushSlab(uint16_t &head, uint16_t s)
+    {
+        slabs[s].prev = NO_SLAB;
+        slabs[s].next = head;
+        if (head != NO_SLAB)
+            slabs[head].prev = s;
+        head = s;
+    }
+    void removeSlab(uint16_t &head, uint16_t s)
+    {
+        if (slabs[s].prev != NO_SLAB)
+            slabs[slabs[s].prev].next = slabs[s].next;
+        else
+            head = slabs[s].next;
+        if (slabs[s].next != NO_SLAB)
+            slabs[slabs[s].next].prev = slabs[s].prev;
+    }
+
+    uint16_t findSlab(VPtrNum ptr) const
+    {
+        const VPtrNum key = ptr / slabSize;
+        for (uint16_t i=key & (SLAB_INDEX_SIZE-1); slabIndex[i]; i=(i + 1) & (SLAB_INDEX_SIZE-1))
+        {
+            if ((slabs[slabIndex[i]-1].start / slabSize) == key)
+                return slabIndex[i] - 1;
+        }
+        return NO_SLAB;
+    }
+
+    uint16_t newSlab(uint8_t sizeclass)
+    {
+        uint16_t s = emptySlabs;
+        if (s != NO_SLAB)
+            removeSlab(emptySlabs, s);
+        else if (unusedSlabs < slabCount)
+        {
+            const VPtrNum start = getPoolMem(slabSize, slabSize);
+            if (!start)
+                return NO_SLAB;
+
+            s = unusedSlabs++;
+            slabs[s].start = start;
+            uint16_t i = (start / slabSize) & (SLAB_INDEX_SIZE-1);
+            while (slabIndex[i])
+                i = (i + 1) & (SLAB_INDEX_SIZE-1);
+            slabIndex[i] = s + 1;
+        }
+        else
+            return NO_SLAB;
+
+        // mark blocks beyond the slab as allocated, so they are never found
+        const uint16_t blocks = getBlockCount(sizeclass);
+        for (uint16_t w=0; w<BITMAP_WORDS; ++w)
+        {
+            if ((w * 32u) >= blocks)
+                slabs[s].bitmap[w] = ~(uint32_t)0;
+            else if (((w + 1) * 32u) > blocks)
+                slabs[s].bitmap[w] = ~(((uint32_t)1 << (blocks - w * 32)) - 1);
+            else
+                slabs[s].bitmap[w] = 0;
+        }
+        slabs[s].used = 0;
+        slabs[s].sizeClass = sizeclass;
+        pushSlab(partialSlabs[sizeclass], s);
+        return s;
+    }
+
+    // takes the first free block from the given bitmap word onwards, wrapping around
+    VPtrNum allocSmall(uint16_t s, uint16_t w=0)
+    {
+        Slab &slab = slabs[s];
+        while (slab.bitmap[w] == ~(uint32_t)0)
+            w = (w + 1) % BITMAP_WORDS;
+        uint8_t bit = 0;
+        while (slab.bitmap[w] & ((uint32_t)1 << bit))
+            ++bit;
+
+        slab.bitmap[w] |= ((uint32_t)1 << bit);
+        if (++slab.used == getBlockCount(slab.sizeClass))
+            removeSlab(partialSlabs[slab.sizeClass], s); // full
+        return slab.start + (VPtrNum)(w * 32 + bit) * (MIN_BLOCK_SIZE << slab.sizeClass);
+    }
+
+    VPtrSize freeSmall(uint16_t s, VPtrNum ptr)
+    {
+        Slab &slab = slabs[s];
+        const uint16_t block = (ptr - slab.start) / (MIN_BLOCK_SIZE << slab.sizeClass);
+        ASSERT(slab.bitmap[block / 32] & ((uint32_t)1 << (block % 32)));
+        slab.bitmap[block / 32] &= ~((uint32_t)1 << (block % 32));
+
+        if (slab.used == getBlockCount(slab.sizeClass))
+            pushSlab(partialSlabs[slab.sizeClass], s); // was full
+        if (--slab.used == 0)
+        {
+            removeSlab(partialSlabs[slab.sizeClass], s);
+            pushSlab(emptySlabs, s);
+        }
+        return MIN_BLOCK_SIZE << slab.sizeClass;
+    }
+
+    void readLarge(VPtrNum p, LargeHeader &h, bool full)
+    { getAllocator()->read(p, &h, full ? sizeof(LargeHeader) : offsetof(LargeHeader, nextFree)); }
+    void writeLarge(VPtrNum p, const LargeHeader &h, bool full)
+    { getAllocator()->write(p, &h, full ? sizeof(LargeHeader) : offsetof(LargeHeader, nextFree)); }
+    void setPrevFreePhys(VPtrNum p, VPtrNum prev) { getAllocator()->write(p + offsetof(LargeHeader, prevFreePhys), &prev, sizeof(prev)); }
+
+    void pushLarge(VPtrNum p, VPtrSize size)
+    {
+        const uint8_t bin = getBin(size);
+        LargeHeader h;
+        h.size = size | FREE_BIT;
+        h.prevFreePhys = 0; // free blocks are always merged with their predecessor
+        h.nextFree = largeBins[bin];
+        h.prevFree = 0;
+        writeLarge(p, h, true);
+        if (h.nextFree)
+            getAllocator()->write(h.nextFree + offsetof(LargeHeader, prevFree), &p, sizeof(p));
+        largeBins[bin] = p;
+        usedBins |= ((VPtrSize)1 << bin);
+    }
+
+    void removeLarge(const LargeHeader &h)
+    {
+        if (h.prevFree)
+            getAllocator()->write(h.prevFree + offsetof(LargeHeader, nextFree), &h.nextFree, sizeof(h.nextFree));
+        else
+        {
+            const uint8_t bin = getBin(h.size & ~(VPtrSize)FREE_BIT);
+            largeBins[bin] = h.nextFree;
+            if (!h.nextFree)
+                usedBins &= ~((VPtrSize)1 << bin);
+        }
+        if (h.nextFree)
+            getAllocator()->write(h.nextFree + offsetof(LargeHeader, prevFree), &h.prevFree, sizeof(h.prevFree));
+    }
+
+    // Returns the smallest free block of at least size bytes from the first bin that has one
+    VPtrNum findLarge(VPtrSize size)
+    {
+        VPtrSize bins = usedBins & ~(((VPtrSize)1 << getBin(size)) - 1);
+        while (bins)
+        {
+            const uint8_t bin = getBin(bins & -bins); // lowest bit
+            VPtrNum best = 0;
+            VPtrSize bestsize = 0;
+            LargeHeader h;
+            for (VPtrNum p=largeBins[bin]; p; p=h.nextFree)
+            {
+                readLarge(p, h, true);
+                const VPtrSize blocksize = h.size & ~(VPtrSize)FREE_BIT;
+                if (blocksize >= size && (!best || blocksize < bestsize))
+                {
+                    best = p;
+                    bestsize = blocksize;
+                    if (blocksize == size)
+                        break; // exact fit
+                }
+            }
+            if (best)
+                return best;
+            bins &= ~((VPtrSize)1 << bin);
+        }
+        return 0;
+    }
+
+    // Allocates the start of a free large block of at least size bytes
+    VPtrNum takeLarge(VPtrNum p, VPtrSize size, VPtrSize &blocksize)
+    {
+        LargeHeader h;
+        readLarge(p, h, true);
+        removeLarge(h);
+        blocksize = h.size & ~(VPtrSize)FREE_BIT;
+
+        // split off the rest, if it is worthwhile
+        if ((blocksize - size) > MAX_SMALL_SIZE)
+        {
+            pushLarge(p + size, blocksize - size);
+            setPrevFreePhys(p + blocksize, p + size);
+            blocksize = size;
+        }
+        else
+            setPrevFreePhys(p + blocksize, 0);
+
+        h.size = blocksize;
+        h.prevFreePhys = 0;
+        writeLarge(p, h, false);
+        return p + HEADER_SIZE;
+    }
+
+    // Makes the end of a used large block free. The rest is merged with the next block, if that is free.
+    void splitLarge(VPtrNum p, VPtrSize size, VPtrSize newsize)
+    {
+        VPtrNum next = p + size;
+        VPtrSize rest = size - newsize;
+        LargeHeader h;
+        readLarge(next, h, false);
+        if (h.size & FREE_BIT)
+        {
+            readLarge(next, h, true);
+            removeLarge(h);
+            rest += (h.size & ~(VPtrSize)FREE_BIT);
+            next += (h.size & ~(VPtrSize)FREE_BIT);
+        }
+
+        pushLarge(p + newsize, rest);
+        setPrevFreePhys(next, p + newsize);
+    }
+
+    // Takes memory from the pool for a free large block of at least size bytes. Memory that directly
+    // follows the last large block is preferred, and is merged with it. If extend is set, other memory
+    // is not used.
+    bool growLarge(VPtrSize size, bool extend)
+    {
+        const VPtrSize chunksize = size + HEADER_SIZE; // including the sentinel
+        if (chunksize < size)
+            return false; // overflow
+
+        VPtrNum start = 0;
+        if (arenaEnd && extendPoolMem(arenaEnd + HEADER_SIZE, chunksize))
+            start = arenaEnd + HEADER_SIZE;
+        else if (extend || !(start = getPoolMem(chunksize, LARGE_ALIGN)))
+            return false;
+
+        VPtrNum block;
+        VPtrSize blocksize;
+        if (arenaEnd && start == (arenaEnd + HEADER_SIZE))
+        {
+            // the old sentinel becomes the start of the new block
+            block = arenaEnd;
+            blocksize = chunksize;
+
+            LargeHeader h;
+            readLarge(arenaEnd, h, false);
+            if (h.prevFreePhys)
+            {
+                const VPtrNum prev = h.prevFreePhys;
+                readLarge(prev, h, true);
+                removeLarge(h);
+                block = prev;
+                blocksize += (h.size & ~(VPtrSize)FREE_BIT);
+            }
+        }
+        else
+        {
+            block = start;
+            blocksize = size;
+        }
+
+        pushLarge(block, blocksize);
+
+        arenaEnd = start + size;
+        LargeHeader sentinel;
+        sentinel.size = 0; // never free, so never merged
+        sentinel.prevFreePhys = block;
+        writeLarge(arenaEnd, sentinel, false);
+        return true;
+    }
+
+    static VPtrSize getLargeSize(VPtrSize size) { return (size + HEADER_SIZE + LARGE_ALIGN - 1) & ~(VPtrSize)(LARGE_ALIGN - 1); }
+    static uint8_t getSizeClass(VPtrSize size)
+    {
+        uint8_t ret = 0;
+        while ((VPtrSize)(MIN_BLOCK_SIZE << ret) < size)
+            ++ret;
+        return ret;
+    }
+
+    VPtrNum allocLarge(VPtrSize size, VPtrSize &blocksize)
+    {
+        const VPtrSize total = getLargeSize(size);
+        if (total < size)
+            return 0; // overflow
+
+        VPtrNum p = findLarge(total);
+        if (!p)
+        {
+            if (!growLarge(total, false))
+                return 0;
+            p = findLarge(total);
+            ASSERT(p);
+        }
+
+        return takeLarge(p, total, blocksize);
+    }
+
+public:
+    SlabAllocEngine(void)
+    {
+        ASSERT(slabSize >= 1024 && slabSize <= (512ul * 1024ul) && (slabSize & (slabSize - 1)) == 0);
+        ASSERT(minBlockSize >= 4 && minBlockSize <= 64 && (minBlockSize & (minBlockSize - 1)) == 0);
+        ASSERT((slabSize / minBlockSize) <= 32768); // block indices are 16 bit
+        reset();
+    }
+
+    void reset(void)
+    {
+        for (uint16_t i=0; i<SLAB_INDEX_SIZE; ++i)
+            slabIndex[i] = 0;
+        for (uint8_t i=0; i<SIZE_CLASSES; ++i)
+            partialSlabs[i] = NO_SLAB;
+        emptySlabs = NO_SLAB;
+        unusedSlabs = 0;
+        for (uint8_t i=0; i<LARGE_BINS; ++i)
+            largeBins[i] = 0;
+        usedBins = 0;
+        arenaEnd = 0;
+    }
+
+    VPtrNum alloc(VPtrSize size, VPtrSize &blocksize)
+    {
+        if (size <= MAX_SMALL_SIZE)
+        {
+            const uint8_t sizeclass = getSizeClass(size);
+            uint16_t s = partialSlabs[sizeclass];
+            if (s == NO_SLAB)
+                s = newSlab(sizeclass);
+            if (s != NO_SLAB)
+            {
+                blocksize = MIN_BLOCK_SIZE << sizeclass;
+                return allocSmall(s);
+            }
+            // out of slabs, use a large block instead
+        }
+
+        return allocLarge(size, blocksize);
+    }
+
+    // prefers the slab of hint, then the slabs before and after it
+    VPtrNum allocNear(VPtrNum hint, VPtrSize size, VPtrSize &blocksize)
+    {
+        if (size > MAX_SMALL_SIZE)
+            return 0;
+
+        const uint8_t sizeclass = getSizeClass(size);
+        const VPtrNum candidates[3] = { hint, hint - slabSize, hint + slabSize };
+        for (uint8_t i=0; i<3; ++i)
+        {
+            if (i == 1 && hint < slabSize)
+                continue; // no slab before the first
+            const uint16_t s = findSlab(candidates[i]);
+            if (s == NO_SLAB || slabs[s].sizeClass != sizeclass || !slabs[s].used ||
+                slabs[s].used == getBlockCount(sizeclass))
+                continue; // NOTE: empty slabs may be re-used for another class
+
+            // continue searching from the block at the hint
+            uint16_t w = 0;
+            if (i == 0)
+                w = (hint - slabs[s].start) / (MIN_BLOCK_SIZE << sizeclass) / 32;
+            blocksize = MIN_BLOCK_SIZE << sizeclass;
+            return allocSmall(s, w);
+        }
+        return 0;
+    }
+
+    VPtrSize free(VPtrNum ptr)
+    {
+        const uint16_t s = findSlab(ptr);
+        if (s != NO_SLAB)
+            return freeSmall(s, ptr);
+
+        VPtrNum block = ptr - HEADER_SIZE;
+        LargeHeader h;
+        readLarge(block, h, false);
+        ASSERT(!(h.size & FREE_BIT) && h.size);
+
+        const VPtrSize ret = h.size;
+        VPtrSize size = h.size;
+        VPtrNum next = block + size;
+
+        if (h.prevFreePhys)
+        {
+            block = h.prevFreePhys;
+            readLarge(block, h, true);
+            removeLarge(h);
+            size += (h.size & ~(VPtrSize)FREE_BIT);
+        }
+
+        readLarge(next, h, false); // NOTE: may be the sentinel, which has no bin pointers
+        if (h.size & FREE_BIT)
+        {
+            readLarge(next, h, true);
+            removeLarge(h);
+            size += (h.size & ~(VPtrSize)FREE_BIT);
+            next = block + size;
+        }
+
+        pushLarge(block, size);
+        setPrevFreePhys(next, block);
+        trimPoolMem(block + sizeof(h), size - sizeof(h));
+        return ret;
+    }
+
+    VPtrSize getSize(VPtrNum ptr)
+    {
+        const uint16_t s = findSlab(ptr);
+        if (s != NO_SLAB)
+            return MIN_BLOCK_SIZE << slabs[s].sizeClass;
+
+        LargeHeader h;
+        readLarge(ptr - HEADER_SIZE, h, false);
+        return h.size - HEADER_SIZE;
+    }
+
+    bool resize(VPtrNum ptr, VPtrSize size, VPtrSize &oldblocksize, VPtrSize &newblocksize)
+    {
+        const uint16_t s = findSlab(ptr);
+        if (s != NO_SLAB)
+        {
+            // small blocks stay if they remain in the same size class
+            if (size > MAX_SMALL_SIZE || getSizeClass(size) != slabs[s].sizeClass)
+                return false;
+            oldblocksize = newblocksize = MIN_BLOCK_SIZE << slabs[s].sizeClass;
+            return true;
+        }
+
+        const VPtrNum block = ptr - HEADER_SIZE;
+        const VPtrSize total = getLargeSize(size);
+        if (total < size)
+            return false; // overflow
+
+        LargeHeader h;
+        readLarge(block, h, false);
+        oldblocksize = h.size;
+
+        if (total > h.size)
+        {
+            // grow: take memory from the next block, if it is free
+            const VPtrNum next = block + h.size;
+            LargeHeader nexth;
+            readLarge(next, nexth, false);
+            VPtrSize avail = h.size;
+            if (nexth.size & FREE_BIT)
+                avail += (nexth.size & ~(VPtrSize)FREE_BIT);
+
+            // last block? then try to extend the pool
+            if (avail < total && (block + avail) == arenaEnd)
+            {
+                if (!growLarge(total - avail, true))
+                    return false;
+                readLarge(next, nexth, false);
+                avail = h.size;
+                if (nexth.size & FREE_BIT)
+                    avail += (nexth.size & ~(VPtrSize)FREE_BIT);
+            }
+
+            if (avail < total)
+                return false;
+
+            readLarge(next, nexth, true);
+            removeLarge(nexth);
+            h.size = avail;
+            setPrevFreePhys(block + avail, 0);
+        }
+
+        // split off the rest, if it is worthwhile
+        if ((h.size - total) > MAX_SMALL_SIZE)
+        {
+            splitLarge(block, h.size, total);
+            h.size = total;
+        }
+
+        writeLarge(block, h, false);
+        newblocksize = h.size;
+        return true;
+    }
+};
+
+/**
+ * @brief Allocation engine based on the *Two-Level Segregated Fit* (TLSF) algorithm.
+ *
+ * Free blocks are kept in lists that are segregated by size in two levels: the first level divides
+ * sizes in powers of two, the second level divides each power of two in \a secondLevels equally
+ * sized ranges. Bitmaps of non-empty lists and the heads of all lists are stored in RAM, hence, a
+ * suitable free block is found without any search. Adjacent free blocks are merged immediately.
+ *
+ * Allocating and freeing memory take constant time, regardless of fragmentation: each operation
+ * accesses at most four block headers in the memory pool (the block itself, its physical neighbours
+ * and the neighbours in a free list). This makes the amount of page swaps caused by allocations
+ * bounded, which is useful for code with strict timing requirements.
+ *
+ * Memory is taken from the memory pool in chunks of at least \a growSize bytes when no free block
+ * is large enough. Consecutive chunks are merged.
+ *
+ * @tparam secondLevels Log2 of the amount of second level lists per first level list (at most 5).
+ * Higher values reduce wasted memory, but use more RAM: the list heads use about
+ * `(bits - secondLevels - 2) * 2^secondLevels * sizeof(VPtrNum)` bytes, where *bits* is the size of
+ * \ref VPtrSize in bits (for instance about 1.6 kB with the default of 4 and 32 bit addresses).
+ * @tparam growSize The minimum amount of bytes taken from the memory pool at once.
+ */
+template <uint8_t secondLevels=4, VPtrSize growSize=16*1024> class TLSFAllocEngine : public BaseAllocEngine
+{
+    enum
+    {
+        ALIGN = sizeof(VPtrNum) * 2,
+        HEADER_SIZE = ALIGN, // size + prevFreePhys
+        MIN_BLOCK_SIZE = ALIGN * 2, // space for free list pointers
+        SL_COUNT = 1 << secondLevels,
+        SMALL_SIZE = ALIGN << secondLevels, // sizes below are all in the first level list 0
+        FL_SHIFT = private_utils::FloorLog2<SMALL_SIZE>::value,
+        FL_COUNT = sizeof(VPtrSize) * 8 - FL_SHIFT + 1,
+        FREE_BIT = 1 // stored in size
+    };
+
+    // stored at the start of each block, the list pointers are only used by free blocks
+    struct Header
+    {
+        VPtrSize size; // including header
+        VPtrNum prevFreePhys; // the preceding block in the pool if it is free, zero otherwise
+        VPtrNum nextFree, prevFree; // neighbours in the free list
+    };
+
+    VPtrNum freeLists[FL_COUNT][SL_COUNT];
+    VPtrSize flBitmap; // bit N is set if any list of first level N is not empty
+    uint32_t slBitmaps[FL_COUNT];
+    VPtrNum arenaEnd; // zero sized sentinel block at the end of the last chunk, zero if none
+
+    static void getIndices(VPtrSize size, uint8_t &fl, uint8_t &sl)
+    {
+        if (size < SMALL_SIZE)
+        {
+            fl = 0;
+            sl = size / ALIGN;
+        }
+        else
+        {
+            const uint8_t bit = private_utils::floorLog2(size);
+            fl = bit - FL_SHIFT + 1;
+            sl = (size >> (bit - secondLevels)) - SL_COUNT;
+        }
+    }
+
+    void readHeader(VPtrNum p, Header &h, bool full) { getAllocator()->read(p, &h, full ? sizeof(Header) : (VPtrSize)HEADER_SIZE); }
+    void writeHeader(VPtrNum p, const Header &h, bool full) { getAllocator()->write(p, &h, full ? sizeof(Header) : (VPtrSize)HEADER_SIZE); }
+    void setPrevFreePhys(VPtrNum p, VPtrNum prev) { getAllocator()->write(p + offsetof(Header, prevFreePhys), &prev, sizeof(prev)); }
+
+    void insertFree(VPtrNum p, VPtrSize size)
+    {
+        uint8_t fl, sl;
+        getIndices(size, fl, sl);
+
+        Header h;
+        h.size = size | FREE_BIT;
+        h.prevFreePhys = 0; // free blocks are always merged with their predecessor
+        h.nextFree = freeLists[fl][sl];
+        h.prevFree = 0;
+        writeHeader(p, h, true);
+        if (h.nextFree)
+            getAllocator()->write(h.nextFree + offsetof(Header, prevFree), &p, sizeof(p));
+
+        freeLists[fl][sl] = p;
+        flBitmap |= ((VPtrSize)1 << fl);
+        slBitmaps[fl] |= ((uint32_t)1 << sl);
+    }
+
+    void removeFree(const Header &h)
+    {
+        if (h.prevFree)
+            getAllocator()->write(h.prevFree + offsetof(Header, nextFree), &h.nextFree, sizeof(h.nextFree));
+        else
+        {
+            uint8_t fl, sl;
+            getIndices(h.size & ~(VPtrSize)FREE_BIT, fl, sl);
+            freeLists[fl][sl] = h.nextFree;
+            if (!h.nextFree)
+            {
+                slBitmaps[fl] &= ~((uint32_t)1 << sl);
+                if (!slBitmaps[fl])
+                    flBitmap &= ~((VPtrSize)1 << fl);
+            }
+        }
+        if (h.nextFree)
+            getAllocator()->write(h.nextFree + offsetof(Header, prevFree), &h.prevFree, sizeof(h.prevFree));
+    }
+
+    // Returns a free block from the first non-empty list that only has blocks of at least size bytes
+    VPtrNum findFree(VPtrSize size)
+    {
+        // round up to the next list, so that any block in it will fit
+        if (size >= SMALL_SIZE)
+        {
+            const VPtrSize round = ((VPtrSize)1 << (private_utils::floorLog2(size) - secondLevels)) - 1;
+            if ((size + round) < size)
+                return 0; // overflow
+            size += round;
+        }
+
+        uint8_t fl, sl;
+        getIndices(size, fl, sl);
+        if (fl >= FL_COUNT)
+            return 0;
+
+        uint32_t slmap = slBitmaps[fl] & (~(uint32_t)0 << sl);
+        if (!slmap)
+        {
+            const VPtrSize flmap = (fl + 1 < FL_COUNT) ? (flBitmap & (~(VPtrSize)0 << (fl + 1))) : 0;
+            if (!flmap)
+                return 0;
+            fl = private_utils::floorLog2(flmap & -flmap);
+            slmap = slBitmaps[fl];
+        }
+        sl = private_utils::floorLog2(slmap & -slmap);
+        return freeLists[fl][sl];
+    }
+
+    static VPtrSize getBlockSize(VPtrSize size)
+    { return private_utils::maximal<VPtrSize>((size + HEADER_SIZE + ALIGN - 1) & ~(VPtrSize)(ALIGN - 1), MIN_BLOCK_SIZE); }
+
+    // Makes the end of a used block free. The rest is merged with the next block, if that is free.
+    void splitUsed(VPtrNum p, VPtrSize size, VPtrSize newsize)
+    {
+        VPtrNum next = p + size;
+        VPtrSize rest = size - newsize;
+        Header h;
+        readHeader(next, h, false);
+        if (h.size & FREE_BIT)
+        {
+            readHeader(next, h, true);
+            removeFree(h);
+            rest += (h.size & ~(VPtrSize)FREE_BIT);
+            next += (h.size & ~(VPtrSize)FREE_BIT);
+        }
+
+        insertFree(p + newsize, rest);
+        setPrevFreePhys(next, p + newsize);
+    }
+
+    // Allocates the start of a free block of at least size bytes
+    VPtrNum takeFree(VPtrNum p, VPtrSize size, VPtrSize &blocksize)
+    {
+        Header h;
+        readHeader(p, h, true);
+        removeFree(h);
+        blocksize = h.size & ~(VPtrSize)FREE_BIT;
+
+        // split off the rest, if it can form a block
+        if ((blocksize - size) >= MIN_BLOCK_SIZE)
+        {
+            insertFree(p + size, blocksize - size);
+            setPrevFreePhys(p + blocksize, p + size);
+            blocksize = size;
+        }
+        else
+            setPrevFreePhys(p + blocksize, 0);
+
+        h.size = blocksize;
+        h.prevFreePhys = 0;
+        writeHeader(p, h, false);
+        return p + HEADER_SIZE;
+    }
+
+    // Adds a chunk from the memory pool with a block of at least size bytes
+    bool grow(VPtrSize size)
+    {
+        // reserve space for the sentinel and make sure that findFree() will pick the new block
+        const VPtrSize orgsize = size;
+        if (size >= SMALL_SIZE)
+            size += ((VPtrSize)1 << (private_utils::floorLog2(size) - secondLevels));
+        size += HEADER_SIZE;
+        if (size < orgsize)
+            return false; // overflow
+
+        VPtrSize chunksize = private_utils::maximal(size, growSize);
+        VPtrNum start = getPoolMem(chunksize, ALIGN);
+        if (!start && chunksize > size) // pool almost full?
+            start = getPoolMem(chunksize = size, ALIGN);
+        if (!start)
+            return false;
+
+        VPtrNum block;
+        VPtrSize blocksize;
+        if (arenaEnd && start == (arenaEnd + HEADER_SIZE))
+        {
+            // extends the previous chunk: the old sentinel becomes the start of the new block
+            block = arenaEnd;
+            blocksize = chunksize;
+
+            Header h;
+            readHeader(arenaEnd, h, false);
+            if (h.prevFreePhys)
+            {
+                const VPtrNum prev = h.prevFreePhys;
+                readHeader(prev, h, true);
+                removeFree(h);
+                block = prev;
+                blocksize += (h.size & ~(VPtrSize)FREE_BIT);
+            }
+        }
+        else
+        {
+            block = start;
+            blocksize = chunksize - HEADER_SIZE;
+        }
+
+        insertFree(block, blocksize);
+
+        arenaEnd = start + chunksize - HEADER_SIZE;
+        Header sentinel;
+        sentinel.size = 0; // never free, so never merged
+        sentinel.prevFreePhys = block;
+        writeHeader(arenaEnd, sentinel, false);
+        return true;
+    }
+
+public:
+    TLSFAllocEngine(void)
+    {
+        ASSERT(secondLevels <= 5 && growSize >= (MIN_BLOCK_SIZE + HEADER_SIZE));
+        reset();
+    }
+
+    void reset(void)
+    {
+        for (uint8_t i=0; i<FL_COUNT; ++i)
+        {
+            for (uint8_t j=0; j<SL_COUNT; ++j)
+                freeLists[i][j] = 0;
+            slBitmaps[i] = 0;
+        }
+        flBitmap = 0;
+        arenaEnd = 0;
+    }
+
+    VPtrNum alloc(VPtrSize size, VPtrSize &blocksize)
+    {
+        const VPtrSize total = getBlockSize(size);
+        if (total < size)
+            return 0; // overflow
+
+        VPtrNum p = findFree(total);
+        if (!p)
+        {
+            if (!grow(total))
+                return 0;
+            p = findFree(total);
+            ASSERT(p);
+        }
+
+        return takeFree(p, total, blocksize);
+    }
+
+    // prefers the free block after hint, then the free block before it
+    VPtrNum allocNear(VPtrNum hint, VPtrSize size, VPtrSize &blocksize)
+    {
+        const VPtrSize total = getBlockSize(size);
+        if (total < size)
+            return 0; // overflow
+
+        const VPtrNum block = hint - HEADER_SIZE;
+        Header h, nearh;
+        readHeader(block, h, false);
+        ASSERT(!(h.size & FREE_BIT) && h.size);
+
+        readHeader(block + h.size, nearh, false); // NOTE: may be the sentinel
+        if ((nearh.size & FREE_BIT) && (nearh.size & ~(VPtrSize)FREE_BIT) >= total)
+            return takeFree(block + h.size, total, blocksize);
+
+        if (!h.prevFreePhys)
+            return 0;
+        const VPtrNum prev = h.prevFreePhys;
+        readHeader(prev, nearh, true);
+        blocksize = nearh.size & ~(VPtrSize)FREE_BIT;
+        if (blocksize < total)
+            return 0;
+
+        // take the end of the previous block, the rest stays free
+        removeFree(nearh);
+        VPtrNum p = prev;
+        nearh.prevFreePhys = 0;
+        if ((blocksize - total) >= MIN_BLOCK_SIZE)
+        {
+            p += (blocksize - total);
+            insertFree(prev, blocksize - total);
+            nearh.prevFreePhys = prev;
+            blocksize = total;
+        }
+        setPrevFreePhys(block, 0);
+
+        nearh.size = blocksize;
+        writeHeader(p, nearh, false);
+        return p + HEADER_SIZE;
+    }
+
+    VPtrSize free(VPtrNum ptr)
+    {
+        VPtrNum block = ptr - HEADER_SIZE;
+        Header h;
+        readHeader(block, h, false);
+        ASSERT(!(h.size & FREE_BIT) && h.size);
+
+        const VPtrSize ret = h.size;
+        VPtrSize size = h.size;
+        VPtrNum next = block + size;
+
+        if (h.prevFreePhys)
+        {
+            block = h.prevFreePhys;
+            readHeader(block, h, true);
+            removeFree(h);
+            size += (h.size & ~(VPtrSize)FREE_BIT);
+        }
+
+        readHeader(next, h, false); // NOTE: may be the sentinel, which has no list pointers
+        if (h.size & FREE_BIT)
+        {
+            readHeader(next, h, true);
+            removeFree(h);
+            size += (h.size & ~(VPtrSize)FREE_BIT);
+            next = block + size;
+        }
+
+        insertFree(block, size);
+        setPrevFreePhys(next, block);
+        if (ret >= getAllocator()->getBigPageSize()) // see BaseVAlloc::freeRaw()
+            trimPoolMem(block + sizeof(Header), size - sizeof(Header));
+        return ret;
+    }
+
+    VPtrSize getSize(VPtrNum ptr)
+    {
+        Header h;
+        readHeader(ptr - HEADER_SIZE, h, false);
+        return h.size - HEADER_SIZE;
+    }
+
+    bool resize(VPtrNum ptr, VPtrSize size, VPtrSize &oldblocksize, VPtrSize &newblocksize)
+    {
+        const VPtrNum block = ptr - HEADER_SIZE;
+        const VPtrSize total = getBlockSize(size);
+        if (total < size)
+            return false; // overflow
+
+        Header h;
+        readHeader(block, h, false);
+        oldblocksize = h.size;
+
+        if (total > h.size)
+        {
+            // grow: take memory from the next block, if it is free
+            const VPtrNum next = block + h.size;
+            Header nexth;
+            readHeader(next, nexth, false);
+            VPtrSize avail = h.size;
+            if (nexth.size & FREE_BIT)
+                avail += (nexth.size & ~(VPtrSize)FREE_BIT);
+
+            // last block? then try to extend the pool
+            if (avail < total && (block + avail) == arenaEnd)
+            {
+                if (!grow(total - avail))
+                    return false;
+                readHeader(next, nexth, false);
+                avail = h.size;
+                if (nexth.size & FREE_BIT)
+                    avail += (nexth.size & ~(VPtrSize)FREE_BIT);
+            }
+
+            if (avail < total)
+                return false;
+
+            readHeader(next, nexth, true);
+            removeFree(nexth);
+            h.size = avail;
+            setPrevFreePhys(block + avail, 0);
+        }
+
+        // split off the rest, if it can form a block
+        if ((h.size - total) >= MIN_BLOCK_SIZE)
+        {
+            splitUsed(block, h.size, total);
+            h.size = total;
+        }
+
+        writeHeader(block, h, false);
+        newblocksize = h.size;
+        return true;
+    }
+};
+
+}
+
+#endif // VIRTMEM_ALLOC_ENGINE_H
@@ -0,0 +1,147 @@
+#ifndef VIRTMEM_ARENA_H
+#define VIRTMEM_ARENA_H
+
+/**
+  @file
+  @brief Arena (region) allocator for short lived virtual memory
+*/
+
+#include "base_alloc.h"
+#include "config/config.h"
+#include "utils.h"
+#include "vptr.h"
+
+namespace virtmem {
+
+/**
+ * @brief Allocates virtual memory from large extents, which are freed all at once.
+ *
+ * An arena takes large blocks of memory (*extents*) from an allocator and hands out memory by
+ * incrementing a pointer within the current extent. Allocations have no header and are placed
+ * next to each other, which keeps related data on the same pages. Memory is not freed separately:
+ * all memory of the arena is freed by \ref reset() or when the arena is destroyed. The memory
+ * allocated within a \ref Scope is freed when the scope ends.
+ *
+ * Example:
+ * @code{.cpp}
+ * virtmem::StdioVAlloc valloc;
+ * virtmem::VArena<virtmem::StdioVAlloc> arena;
+ *
+ * virtmem::StdioVAlloc::TVPtr<int>::type a = arena.alloc<int>();
+ * {
+ *     virtmem::VArena<virtmem::StdioVAlloc>::Scope scope(arena);
+ *     virtmem::StdioVAlloc::TVPtr<char>::type buf = arena.alloc<char>(256);
+ *     // ...
+ * } // buf is freed here
+ * arena.reset(); // a is freed
+ * @endcode
+ *
+ * @tparam Allocator The allocator class from which extents are taken.
+ * @note Destructors of objects allocated from an arena are never called.
+ */
+template <typename Allocator> class VArena
+{
+    enum
+    {
+        ALIGN = 8, // alignment of allocations, also the size of the link at the start of each extent
+        DEFAULT_EXTENT_SIZE = 1024 * 4
+    };
+
+    BaseVAlloc *allocator;
+    VPtrSize extentSize;
+    VPtrNum extent; // current extent, which starts with the address of the previous extent
+    VPtrSize extentUsed, extentEnd; // offsets in current extent
+
+    VArena(const VArena &);
+    VArena &operator=(const VArena &);
+
+    // Frees extents until the given extent is current
+    void rewind(VPtrNum e, VPtrSize used, VPtrSize end)
+    {
+        while (extent != e)
+        {
+            VPtrNum prev;
+            allocator->read(extent, &prev, sizeof(prev));
+            allocator->freeRaw(extent);
+            extent = prev;
+        }
+        extentUsed = used;
+        extentEnd = end;
+    }
+
+public:
+    /**
+     * @brief Constructs an arena.
+     * @param esize The size of the extents taken from the allocator. Larger allocations get an extent of their own.
+     * @param a The allocator instance to use. By default, the current instance is used (see VAlloc::getInstance()).
+     */
+    VArena(VPtrSize esize=DEFAULT_EXTENT_SIZE, BaseVAlloc *a=Allocator::getInstance())
+        : allocator(a), extentSize(esize), extent(0), extentUsed(0), extentEnd(0) { }
+    ~VArena(void) { reset(); } //!< Frees all memory of the arena.
+
+    /**
+     * @brief Allocates raw memory from the arena.
+     * @param size The size of the memory block.
+     * @return The starting address of the memory block. Will return zero if out of memory.
+     */
+    VPtrNum allocRaw(VPtrSize size)
+    {
+        size = (size + ALIGN - 1) & ~(VPtrSize)(ALIGN - 1);
+        if (!extent || (extentEnd - extentUsed) < size)
+        {
+            // NOTE: the rest of the current extent is lost
+            const VPtrSize esize = private_utils::maximal(extentSize, size + ALIGN);
+            const VPtrNum e = allocator->allocRaw(esize);
+            if (!e)
+                return 0;
+            allocator->write(e, &extent, sizeof(extent));
+            extent = e;
+            extentUsed = ALIGN;
+            extentEnd = esize;
+        }
+
+        const VPtrNum ret = extent + extentUsed;
+        extentUsed += size;
+        return ret;
+    }
+
+    /**
+     * @brief Allocates memory from the arena.
+     * @tparam T The data type to allocate for.
+     * @param size The number of bytes to allocate. By default this is the size of the type pointed to.
+     * @return Virtual pointer pointing to allocated memory, null if out of memory.
+     */
+    template <typename T> VPtr<T, Allocator> alloc(VPtrSize size=sizeof(T))
+    {
+        VPtr<T, Allocator> ret;
+        ret.setRawNum(allocRaw(size));
+        return ret;
+    }
+
+    void reset(void) { rewind(0, 0, 0); } //!< Frees all memory allocated from the arena.
+
+    /**
+     * @brief Frees all memory allocated from an arena while in scope.
+     *
+     * Scopes can be nested. Memory allocated before the scope was created stays valid.
+     */
+    class Scope
+    {
+        VArena &arena;
+        VPtrNum extent;
+        VPtrSize extentUsed, extentEnd;
+
+        Scope(const Scope &);
+        Scope &operator=(const Scope &);
+
+    public:
+        //! Marks the current position of \a a.
+        Scope(VArena &a) : arena(a), extent(a.extent), extentUsed(a.extentUsed), extentEnd(a.extentEnd) { }
+        //! Frees all memory allocated since the scope was created.
+        ~Scope(void) { arena.rewind(extent, extentUsed, extentEnd); }
+    };
+};
+
+}
+
+#endif // VIRTMEM_ARENA_H
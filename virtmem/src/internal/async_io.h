@@ -0,0 +1,70 @@
+#ifndef VIRTMEM_ASYNC_IO_H
+#define VIRTMEM_ASYNC_IO_H
+
+/**
+  @file
+  @brief Background I/O for allocators (see VIRTMEM_ASYNC_IO)
+*/
+
+#include "config/config.h"
+
+#ifdef VIRTMEM_ASYNC_IO
+
+#include "base_alloc.h"
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace virtmem {
+
+// \cond HIDDEN_SYMBOLS
+namespace private_utils {
+
+// Performs reads and writes of an allocator on a worker thread. Requests are handled in order of
+// submission. Access to the memory pool is serialized, so allocators don't have to be thread safe.
+class AsyncIO
+{
+    struct Request
+    {
+        VPtrNum start;
+        VPtrSize size;
+        uint8_t *data; // destination of reads, zero for writes
+        std::vector<uint8_t> buffer; // copy of the data to write
+    };
+
+    BaseVAlloc *allocator;
+    std::thread worker;
+    std::mutex mutex; // protects all below
+    std::mutex ioMutex; // held during calls to doRead()/doWrite()
+    std::condition_variable requestCondition, doneCondition;
+    std::list<Request> requests; // NOTE: first request may be in progress
+    VPtrSize pendingBytes; // size of all write buffers
+    bool quit;
+
+    void run(void);
+    bool isPending(VPtrNum start, VPtrSize size, bool all) const;
+    bool isLoading(const uint8_t *data, VPtrSize size) const;
+
+public:
+    AsyncIO(BaseVAlloc *a);
+    ~AsyncIO(void);
+
+    void queueRead(void *data, VPtrNum start, VPtrSize size);
+    void queueWrite(const void *data, VPtrNum start, VPtrSize size);
+    void read(void *data, VPtrNum start, VPtrSize size);
+    void wait(VPtrNum start, VPtrSize size);
+    void waitForData(const void *data, VPtrSize size);
+    void sync(void);
+};
+
+}
+// \endcond
+
+}
+
+#endif
+
+#endif // VIRTMEM_ASYNC_IO_H
@@ -16,11 +16,39 @@
 
 #include <stdint.h>
 
+#ifdef VIRTMEM_THREAD_SAFE
+#include <atomic>
+#include <mutex>
+
+#if VIRTMEM_CACHE_SHARDS < 1 || VIRTMEM_CACHE_SHARDS > 32
+#error "VIRTMEM_CACHE_SHARDS should be between 1 and 32"
+#endif
+#endif
+
 namespace virtmem {
 
+#ifdef VIRTMEM_WIDE_ADDRESSES
+typedef uint64_t VPtrNum; //!< Numeric type used to store raw virtual pointer addresses
+typedef uint64_t VPtrSize; //!< Numeric type used to store the size of a virtual memory block
+#else
 typedef uint32_t VPtrNum; //!< Numeric type used to store raw virtual pointer addresses
 typedef uint32_t VPtrSize; //!< Numeric type used to store the size of a virtual memory block
+#endif
+#ifdef VIRTMEM_WIDE_PAGES
+typedef uint32_t VirtPageSize; //!< Numeric type used to store the size of a virtual memory page
+typedef int32_t VirtPageIndex; //!< Numeric type used to index virtual memory pages (-1 for none)
+typedef uint32_t VirtPageCount; //!< Numeric type used to store the amount of virtual memory pages
+#else
 typedef uint16_t VirtPageSize; //!< Numeric type used to store the size of a virtual memory page
+typedef int8_t VirtPageIndex; //!< Numeric type used to index virtual memory pages (-1 for none)
+typedef uint8_t VirtPageCount; //!< Numeric type used to store the amount of virtual memory pages
+#endif
+
+class BasePagePolicy;
+class BaseAllocEngine;
+#ifdef VIRTMEM_ASYNC_IO
+namespace private_utils { class AsyncIO; }
+#endif
 
 /**
  * @brief Base class for virtual memory allocators.
@@ -30,34 +58,65 @@ typedef uint16_t VirtPageSize; //!< Numeric type used to store the size of a vir
  */
 class BaseVAlloc
 {
+    friend class BaseAllocEngine;
+#ifdef VIRTMEM_ASYNC_IO
+    friend class private_utils::AsyncIO;
+#endif
+
 protected:
     // \cond HIDDEN_SYMBOLS
-#if defined(__x86_64__) || defined(_M_X64)
+#if VIRTMEM_ALLOC_ALIGN > 0
+    struct __attribute__ ((aligned (VIRTMEM_ALLOC_ALIGN))) TAlign { uint8_t dummy[VIRTMEM_ALLOC_ALIGN]; };
+#elif defined(__x86_64__) || defined(_M_X64)
     typedef __uint128_t TAlign;
 #else
     typedef double TAlign;
 #endif
 
+#ifdef VIRTMEM_THREAD_SAFE
+    enum { CACHE_SHARDS = VIRTMEM_CACHE_SHARDS };
+#else
+    enum { CACHE_SHARDS = 1 };
+#endif
+
 private:
     enum
     {
         PAGE_MAX_CLEAN_SKIPS = 5, // if page is dirty: max tries for finding another clean page when swapping
         START_OFFSET = sizeof(TAlign), // don't start at zero so we can have NULL pointers
         BASE_INDEX = 1, // Special pointer to baseFreeList, not actually stored in file
-        MIN_ALLOC_SIZE = 16
+        MIN_ALLOC_SIZE = 16,
+        SUPERBLOCK_MAGIC = 0x564D5342, // "VMSB"
+        SUPERBLOCK_VERSION = 1
     };
 
+#ifdef VIRTMEM_COMPACT_HEADERS
+    typedef uint32_t THeaderNum;
+#else
+    typedef VPtrNum THeaderNum;
+#endif
+
     union UMemHeader
     {
         struct
         {
-            VPtrNum next;
-            VPtrSize size;
+            THeaderNum next;
+            THeaderNum size; // in units of sizeof(UMemHeader)
         } s;
 
         TAlign alignDummy;
     };
 
+    // allocator state, stored at START_OFFSET in persistent memory pools (see setPersistent())
+    struct Superblock
+    {
+        uint32_t magic, checksum;
+        uint16_t version, headerSize;
+        VPtrSize poolSize, memUsed;
+        VPtrNum poolFreePos, freePointer, root;
+        UMemHeader baseFreeList;
+    };
+
 protected:
 #ifndef NVALGRIND
     static const int valgrindPad = 12;
@@ -71,9 +130,42 @@ protected:
         uint8_t *pool;
         uint8_t locks, cleanSkips;
         bool dirty;
-        int8_t next;
+        VirtPageSize dirtyStart, dirtyEnd; // modified data (offsets relative to start), only valid if dirty is set
+#ifdef VIRTMEM_READ_AHEAD
+        bool prefetched; // loaded by read-ahead and not accessed yet
+#endif
+#ifdef VIRTMEM_ASYNC_IO
+        bool loading; // data may still be read in the background
+#endif
+        VirtPageIndex next, prev;
+        LockPage *indexNext; // next page in the same PageIndex bucket
 
-        LockPage(void) : start(0), size(0), pool(0), locks(0), cleanSkips(0), dirty(false), next(-1) { }
+        LockPage(void) : start(0), size(0), pool(0), locks(0), cleanSkips(0), dirty(false),
+#ifdef VIRTMEM_READ_AHEAD
+            prefetched(false),
+#endif
+#ifdef VIRTMEM_ASYNC_IO
+            loading(false),
+#endif
+            next(-1), prev(-1), indexNext(0) { }
+
+        // marks a range as modified
+        void setDirty(VirtPageSize offset, VirtPageSize size)
+        {
+            if (!dirty)
+            {
+                dirty = true;
+                dirtyStart = offset;
+                dirtyEnd = offset + size;
+            }
+            else
+            {
+                if (offset < dirtyStart)
+                    dirtyStart = offset;
+                if ((offset + size) > dirtyEnd)
+                    dirtyEnd = offset + size;
+            }
+        }
     };
     // \endcond
 
@@ -82,54 +174,239 @@ private:
     {
         LockPage *pages;
         VirtPageSize size;
-        uint8_t count;
-        int8_t freeIndex, lockedIndex;
+        VirtPageCount count;
+        VirtPageIndex freeIndex, lockedIndex;
+    };
+
+    // Hash of pages keyed by their start address (see getIndexKeys())
+    struct PageIndex
+    {
+        LockPage **buckets;
+        VPtrNum mask; // amount of buckets - 1
+    };
+
+#ifdef VIRTMEM_READ_AHEAD
+    // Region of the memory pool that is accessed sequentially
+    struct ReadAheadStream
+    {
+        VPtrNum low, high; // range of the pages loaded last
+        int8_t direction; // 1: ascending, -1: descending, 0: unknown yet
+    };
+#endif
+
+    // Part of the cache of big pages. The memory pool is divided in regions, which are assigned to the shards in
+    // turn. The pages of a region are only cached by a fixed range of big pages of its shard, and never extend
+    // to another region, so that threads accessing data of different shards don't wait for each other (see
+    // VIRTMEM_CACHE_SHARDS). The index buckets of a region belong to its shard as well (see getIndexKeys()).
+    struct CacheShard
+    {
+        VirtPageIndex firstPage, endPage; // big pages of this shard
+        BasePagePolicy *pagePolicy; // replacement policy, 0 for built-in FIFO
+        VirtPageIndex nextPageToSwap;
+#ifdef VIRTMEM_THREAD_SAFE
+        std::recursive_mutex mutex; // protects the big pages of this shard and its index buckets
+#endif
+    };
+
+#ifdef VIRTMEM_THREAD_SAFE
+    class CacheLock;
+    typedef std::atomic<VPtrSize> TStatCounter; // updated by threads holding different shards
+#else
+    typedef VPtrSize TStatCounter;
+#endif
+
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    struct CachedHeader
+    {
+        VPtrNum start; // zero if unused
+        UMemHeader header;
+        bool dirty;
     };
+#endif
 
     // Stuff configured from VAlloc
     VPtrSize poolSize;
+    VPtrSize maxPoolSize; // 0 if the pool cannot grow
     PageInfo smallPages, mediumPages, bigPages;
+    PageIndex lockedPageIndex; // all locked pages (small, medium and big)
+    PageIndex bigPageIndex; // unlocked big pages that contain data
+    uint8_t indexShift;
+    CacheShard cacheShards[CACHE_SHARDS];
+    uint8_t shardCount; // shards in use, a power of two
+    uint8_t shardShift; // log2 of the size of a region (see CacheShard)
+    VirtPageCount shardPages; // big pages per shard, the last shard also takes the remainder
+    BaseAllocEngine *allocEngine; // 0 for built-in free list (memmgr)
+    uint8_t *mappedPool; // memory pool mapped in RAM, big pages point directly into it (0 if not mapped)
 
     UMemHeader baseFreeList;
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    CachedHeader headerCache[VIRTMEM_HEADER_CACHE_SIZE]; // direct mapped, by address
+#endif
     VPtrNum freePointer;
     VPtrNum poolFreePos;
-    int8_t nextPageToSwap;
+    VPtrNum compactPos; // where compact() continues
+    VPtrNum root;
+    bool persistent;
+#ifdef VIRTMEM_THREAD_SAFE
+    std::atomic<bool> stateStored; // the persistent pool contains a valid state
+#else
+    bool stateStored; // the persistent pool contains a valid state
+#endif
+#if VIRTMEM_ZERO_MAP_SIZE > 0
+    uint8_t zeroMap[VIRTMEM_ZERO_MAP_SIZE]; // set bits: regions of the pool that were never written
+    uint8_t zeroMapShift; // log2 of the region size
+#endif
+
+#ifdef VIRTMEM_READ_AHEAD
+    // NOTE: streams are shared by all shards, so that they continue in the regions of other shards
+    ReadAheadStream readAheadStreams[VIRTMEM_READ_AHEAD_STREAMS];
+    uint8_t nextReadAheadStream; // stream replaced when a new one is detected
+    VirtPageCount maxReadAhead, readAheadWindow;
+#endif
+
+#ifdef VIRTMEM_ASYNC_IO
+    private_utils::AsyncIO *asyncIO; // set while started, if enabled
+    bool asyncIOEnabled;
+#endif
+
+#ifdef VIRTMEM_THREAD_SAFE
+    std::recursive_mutex allocMutex; // protects the free list, locked before any shard (recursive: getMem() calls freeRaw())
+    std::recursive_mutex readAheadMutex; // protects read-ahead streams, locked after any shard
+    std::recursive_mutex poolMutex; // protects I/O to the memory pool and the zero map, locked last
+#endif
 
 #ifdef VIRTMEM_TRACE_STATS
     VPtrSize memUsed, maxMemUsed;
-    uint32_t bigPageReads, bigPageWrites, bytesRead, bytesWritten;
+    TStatCounter bigPageReads, bigPageWrites, bigPageHits, bytesRead, bytesWritten;
+    TStatCounter readAheadHits, wastedPrefetches;
 #endif
 
-    void initPages(PageInfo *info, LockPage *pages, uint8_t *pool, uint8_t pcount, VirtPageSize psize);
+    void initPages(PageInfo *info, LockPage *pages, uint8_t *pool, VirtPageCount pcount, VirtPageSize psize);
+    void initPageIndex(PageIndex *index, LockPage **buckets, VPtrSize bcount);
+    void indexPage(PageIndex *index, LockPage *page);
+    void unindexPage(PageIndex *index, LockPage *page);
+    VPtrSize getIndexKeys(const PageIndex *index, VPtrNum p, VPtrSize size, VPtrNum &firstkey) const;
+    LockPage *getIndexBucket(const PageIndex *index, VPtrNum key) const { return index->buckets[key & index->mask]; }
+    uint8_t getRegionShard(VPtrNum p) const { return (p >> shardShift) & (shardCount - 1); }
+    uint8_t getPageShard(VirtPageIndex index) const
+    { const VirtPageCount s = index / shardPages; return (s < shardCount) ? s : (shardCount - 1); }
+    VPtrNum getRegionEnd(VPtrNum p) const { return ((p >> shardShift) + 1) << shardShift; }
+    bool isShardRange(VPtrNum p, VPtrSize size) const;
+#ifdef VIRTMEM_THREAD_SAFE
+    uint32_t getShardMask(VPtrNum p, VPtrSize size) const;
+    uint32_t getLockedPageShards(VPtrNum p, VPtrSize size) const;
+#endif
+    VirtPageIndex getNextShardPage(uint8_t shard, VirtPageIndex index) const;
+    uint8_t getLockShard(VPtrNum ptr) const;
+    void linkPage(PageInfo *pinfo, VirtPageIndex &head, VirtPageIndex index);
+    void unlinkPage(PageInfo *pinfo, VirtPageIndex &head, VirtPageIndex index);
+    void cacheBigPage(LockPage *page);
+    void uncacheBigPage(LockPage *page);
+    void setLockedPageStart(LockPage *page, VPtrNum start);
+    VPtrNum getBigPageStart(VPtrNum p, VPtrSize size, bool forcestart, VirtPageSize &pagesize) const;
+    bool isBigPageCached(VPtrNum p, VPtrSize size) const;
+    bool growPool(VPtrNum end);
     VPtrNum getMem(VPtrSize size);
+    VPtrNum getPoolMem(VPtrSize size, VPtrSize align);
+    bool extendPoolMem(VPtrNum end, VPtrSize size);
+    bool resizeBlock(VPtrNum ptr, VPtrSize size, VPtrSize &usable);
+    void copyPoolData(VPtrNum dest, VPtrNum src, VPtrSize size);
+    void trimPool(VPtrNum start, VPtrSize size);
+    VPtrNum allocFreeListNear(VPtrNum hint, VPtrSize quantity);
+    bool isCachedBigPage(const LockPage *page) const;
+    bool canMergeBigPages(const LockPage *first, const LockPage *second) const;
+#if VIRTMEM_ZERO_MAP_SIZE > 0
+    bool isZeroData(VPtrNum offset, VPtrSize size) const;
+    void clearZeroData(VPtrNum offset, VPtrSize size);
+#else
+    bool isZeroData(VPtrNum, VPtrSize) const { return false; }
+    void clearZeroData(VPtrNum, VPtrSize) { }
+#endif
+    void readData(void *data, VPtrNum offset, VPtrSize size);
+    void writeData(const void *data, VPtrNum offset, VPtrSize size);
+#ifdef VIRTMEM_ASYNC_IO
+    void waitForPage(LockPage *page);
+#else
+    void waitForPage(LockPage *) { }
+#endif
+    void writeBigPageData(const uint8_t *pool, VPtrNum start, VPtrSize size);
     void syncBigPage(LockPage *page);
+    void syncBigPages(void);
+#ifdef VIRTMEM_READ_AHEAD
+    ReadAheadStream *getReadAheadStream(VPtrNum start, VirtPageSize size);
+    VPtrNum getReadAheadRegion(uint8_t shard, const ReadAheadStream *stream, VirtPageSize &size) const;
+    bool canPrefetchInPage(VirtPageIndex index, VirtPageIndex exclude) const;
+    VirtPageIndex findPrefetchPage(uint8_t shard, VirtPageIndex previndex, int8_t direction, VirtPageIndex exclude) const;
+#endif
+    void readBigPageData(uint8_t *pool, VPtrNum start, VPtrSize size, bool prefetch);
+    void loadBigPage(VirtPageIndex index);
     void copyRawData(void *dest, VPtrNum p, VPtrSize size);
     void saveRawData(void *src, VPtrNum p, VPtrSize size);
     void *pullRawData(VPtrNum p, VPtrSize size, bool readonly, bool forcestart);
     void pushRawData(VPtrNum p, const void *d, VPtrSize size);
-    const UMemHeader *getHeaderConst(VPtrNum p);
+    void *getRawData(VPtrNum p, VPtrSize size);
+#if VIRTMEM_HEADER_CACHE_SIZE > 0
+    CachedHeader *getCachedHeader(VPtrNum p, bool load);
+    void dropHeader(VPtrNum p);
+#else
+    void dropHeader(VPtrNum) { }
+#endif
+    void flushHeaders(void);
+    void setPageDirty(LockPage *page, VirtPageSize offset, VirtPageSize size);
+    void invalidateState(void);
+    bool loadSuperblock(void);
+    void getHeader(VPtrNum p, UMemHeader *h);
     void updateHeader(VPtrNum p, UMemHeader *h);
-    int8_t findFreePage(PageInfo *pinfo, VPtrNum p, VPtrSize size, bool atstart);
-    int8_t findUnusedLockedPage(PageInfo *pinfo);
+    VirtPageIndex findFreePage(VPtrNum p, VPtrSize size, bool atstart);
+    VirtPageIndex findUnusedLockedPage(PageInfo *pinfo);
     void syncLockedPage(LockPage *page);
-    int8_t lockPage(PageInfo *pinfo, VPtrNum ptr, VirtPageSize size);
-    int8_t freeLockedPage(PageInfo *pinfo, int8_t index);
-    int8_t findLockedPage(PageInfo *pinfo, VPtrNum p);
+    VirtPageIndex lockPage(PageInfo *pinfo, VPtrNum ptr, VirtPageSize size);
+    VirtPageIndex freeLockedPage(PageInfo *pinfo, VirtPageIndex index);
     LockPage *findLockedPage(VPtrNum p);
-    uint8_t getFreePages(const PageInfo *pinfo) const;
-    uint8_t getUnlockedPages(const PageInfo *pinfo) const;
+    VirtPageCount getFreePages(const PageInfo *pinfo) const;
+    VirtPageCount getUnlockedPages(const PageInfo *pinfo) const;
 
 protected:
-    BaseVAlloc(void) : poolSize(0) { }
+    BaseVAlloc(void) : poolSize(0), maxPoolSize(0), allocEngine(0), mappedPool(0), persistent(false), stateStored(false)
+#ifdef VIRTMEM_READ_AHEAD
+      , maxReadAhead(0)
+#endif
+#ifdef VIRTMEM_ASYNC_IO
+      , asyncIO(0), asyncIOEnabled(false)
+#endif
+    { }
 
     // \cond HIDDEN_SYMBOLS
-    void initSmallPages(LockPage *pages, uint8_t *pool, uint8_t pcount, VirtPageSize psize) { initPages(&smallPages, pages, pool, pcount, psize); }
-    void initMediumPages(LockPage *pages, uint8_t *pool, uint8_t pcount, VirtPageSize psize) { initPages(&mediumPages, pages, pool, pcount, psize); }
-    void initBigPages(LockPage *pages, uint8_t *pool, uint8_t pcount, VirtPageSize psize) { initPages(&bigPages, pages, pool, pcount, psize); }
+    void initSmallPages(LockPage *pages, uint8_t *pool, VirtPageCount pcount, VirtPageSize psize) { initPages(&smallPages, pages, pool, pcount, psize); }
+    void initMediumPages(LockPage *pages, uint8_t *pool, VirtPageCount pcount, VirtPageSize psize) { initPages(&mediumPages, pages, pool, pcount, psize); }
+    void initBigPages(LockPage *pages, uint8_t *pool, VirtPageCount pcount, VirtPageSize psize) { initPages(&bigPages, pages, pool, pcount, psize); }
+    void initPageIndices(LockPage **lbuckets, VPtrSize lcount, LockPage **bbuckets, VPtrSize bcount);
+    void setPagePolicy(BasePagePolicy *p, uint8_t shard=0) { cacheShards[shard].pagePolicy = p; }
+    void setAllocEngine(BaseAllocEngine *e);
+    // checks if page settings fit in VirtPageIndex/VirtPageSize (see VIRTMEM_WIDE_PAGES)
+    static bool validPageSettings(VPtrSize count, VPtrSize size)
+    { return count <= (VirtPageCount)((VirtPageCount)-1 >> 1) && size <= (VirtPageSize)-1; }
     // \endcond
 
     void writeZeros(VPtrNum start, VPtrSize n); // NOTE: only call this in doStart()
 
+    /**
+     * @brief Lets the allocator access a memory pool that is mapped in RAM directly.
+     *
+     * Derived allocator classes that map the memory pool in the address space, e.g. with `mmap()`, should call
+     * this function in \ref doStart() and \ref doStop(). The data of *big* pages is then not copied, instead the
+     * pages point directly into the mapped memory pool. Small and medium pages are still used as copies for
+     * locks of small data. The mapping should cover the maximum size of the memory pool (see
+     * \ref setMaxPoolSize()) and may not move while the allocator is started. \ref doRead() and \ref doWrite()
+     * are still used to access data outside of pages.
+     * @param p The address of the mapped memory pool, or zero if the pool is not mapped.
+     * @note Data obtained for reading only (e.g. with \ref read(VPtrNum, VPtrSize)) should not be modified, as
+     * changes are made in the memory pool directly.
+     * @note The zero map (see VIRTMEM_ZERO_MAP_SIZE) and asynchronous I/O (see \ref setAsyncIO()) are not used
+     * for mapped memory pools.
+     */
+    void setMappedPool(uint8_t *p) { mappedPool = p; }
+
     /**
      * @name Pure virtual functions
      * The following functions should be defined by derived allocator classes.
@@ -141,6 +418,47 @@ protected:
     virtual void doWrite(const void *data, VPtrSize offset, VPtrSize size) = 0;
     //! @}
 
+    /**
+     * @brief Extends the memory pool (see \ref setMaxPoolSize()).
+     *
+     * Derived allocator classes that support growing pools should override this function. Any new
+     * memory does not have to be initialized.
+     * @param newsize The new size of the memory pool.
+     * @return Whether the memory pool was extended. The default implementation returns false.
+     */
+    virtual bool doGrow(VPtrSize newsize) { (void)newsize; return false; }
+
+    /**
+     * @brief Releases the storage of unused data in the memory pool.
+     *
+     * Called when memory blocks that span whole *big* pages are freed. Derived allocator classes may
+     * override this function to free the storage, e.g. by punching a hole in a file. The data may
+     * have any value afterwards. The default implementation does nothing.
+     * @param offset The start of the unused data.
+     * @param size The size of the unused data.
+     */
+    virtual void doTrim(VPtrSize offset, VPtrSize size) { (void)offset; (void)size; }
+
+    /**
+     * @brief Makes sure that all written data is stored.
+     *
+     * Called by \ref checkpoint(), before and after the allocator state is written. Derived allocator classes
+     * that buffer written data, such as files, should override this function to write the buffers. The default
+     * implementation does nothing.
+     */
+    virtual void doFlush(void) { }
+
+    /**
+     * @brief Hints that data of a mapped memory pool will be accessed soon.
+     *
+     * Called instead of reading data ahead (see \ref setReadAhead()) if the memory pool is mapped (see
+     * \ref setMappedPool()). Derived allocator classes may override this function to start loading the data,
+     * e.g. with `madvise()`. The default implementation does nothing.
+     * @param offset The start of the data.
+     * @param size The size of the data.
+     */
+    virtual void doPrefetch(VPtrSize offset, VPtrSize size) { (void)offset; (void)size; }
+
 public:
     void start(void);
     void stop(void);
@@ -150,21 +468,92 @@ public:
      * @param ps size of the memory pool.
      * @note The poolsize can also be set via the constructor of most allocators.
      * @note This function is unavailable for MultiSPIRAMVAllocP and StaticVAlloc.
-     * @note This function should always called before \ref start().
+     * @note This function should always be called before \ref start().
      */
     void setPoolSize(VPtrSize ps) { poolSize = ps; }
 
+    /**
+     * @brief Allows the memory pool to grow when it is full.
+     *
+     * When an allocation does not fit in the memory pool, the pool is extended up to the given size. The
+     * pool size is at least doubled each time, so growing only occasionally costs I/O. The initial size
+     * of the memory pool is set by \ref setPoolSize().
+     * @param ms The maximum size of the memory pool. Zero (the default) disables growing.
+     * @note Growing is only supported by some allocators, such as StdioVAllocP and SDVAllocP.
+     */
+    void setMaxPoolSize(VPtrSize ms) { maxPoolSize = ms; }
+    VPtrSize getMaxPoolSize(void) const { return maxPoolSize; } //!< Returns the maximum size of the memory pool (see \ref setMaxPoolSize()).
+
+#ifdef VIRTMEM_READ_AHEAD
+    /**
+     * @brief Enables read-ahead of *big* pages for sequential access.
+     *
+     * When sequential access is detected, the pages following the accessed data are loaded ahead
+     * with a single read from the memory pool. The amount of pages that is read ahead grows while
+     * they are used, and shrinks when prefetched pages are swapped out before they were accessed.
+     * Only unused or clean (i.e. unmodified) pages are used for read-ahead.
+     * @param maxpages The maximum amount of pages that is read ahead. This is limited to half of the
+     * total amount of *big* pages. Zero (the default) disables read-ahead.
+     * @note This function is only available if VIRTMEM_READ_AHEAD is defined (in config.h).
+     */
+    void setReadAhead(VirtPageCount maxpages) { maxReadAhead = maxpages; }
+    VirtPageCount getReadAhead(void) const { return maxReadAhead; } //!< Returns the maximum amount of pages that is read ahead (see \ref setReadAhead()).
+#endif
+
+#ifdef VIRTMEM_ASYNC_IO
+    /**
+     * @brief Enables I/O to the memory pool on a background thread.
+     *
+     * When enabled, dirty pages are written in the background and pages read ahead (see \ref setReadAhead())
+     * are loaded in the background. Data that is still being written or read is waited for when it is accessed.
+     * @note This function is only available if VIRTMEM_ASYNC_IO is defined (in config.h).
+     * @note This function should always be called before \ref start(). Furthermore, \ref stop() should always
+     * be called before the allocator is destroyed.
+     */
+    void setAsyncIO(bool e) { asyncIOEnabled = e; }
+    bool getAsyncIO(void) const { return asyncIOEnabled; } //!< Returns whether I/O is performed in the background (see \ref setAsyncIO()).
+#endif
+
+    /**
+     * @brief Keeps the memory pool when the allocator is stopped, so that it can be reopened.
+     *
+     * The state of the allocator is stored at the start of the memory pool by \ref checkpoint() and \ref stop().
+     * When started again, an existing memory pool is reopened: the data, and all blocks that were allocated, are
+     * available again without reading the pool. A *root* address can be stored to find the data again (see
+     * \ref setRootRaw()). If the pool does not contain a valid state, e.g. the first time, it is cleared instead.
+     * @note If the allocator is not stopped properly, changes made after the last checkpoint are lost. If any of
+     * these changes were already written to the memory pool, its state is invalid and it will be cleared.
+     * @note Persistence is only supported by allocators with a permanent memory pool, such as SDVAllocP and
+     * StdioVAllocP (see StdioVAllocP::setFileName()), and only with the default allocation algorithm (see
+     * BaseAllocEngine).
+     * @note This function should always be called before \ref start().
+     */
+    void setPersistent(bool p) { persistent = p; }
+    bool getPersistent(void) const { return persistent; } //!< Returns whether the memory pool is kept (see \ref setPersistent()).
+    //! Sets the *root* address, which is stored in persistent memory pools. @sa setPersistent, VAlloc::setRoot
+    void setRootRaw(VPtrNum p) { root = p; }
+    VPtrNum getRootRaw(void) const { return root; } //!< Returns the *root* address (see \ref setRootRaw()).
+    void checkpoint(void);
+
     VPtrNum allocRaw(VPtrSize size);
+    VPtrNum allocRawNear(VPtrNum hint, VPtrSize size);
     void freeRaw(VPtrNum ptr);
+    VPtrNum reallocRaw(VPtrNum ptr, VPtrSize size);
+    bool allocRawBatch(VPtrSize count, VPtrSize size, VPtrNum *ptrs);
+    void freeRawBatch(VPtrNum *ptrs, VPtrSize count);
+    void setRelocatable(VPtrNum ptr, VPtrNum ref);
+    bool compact(VPtrSize maxsize);
 
     void *read(VPtrNum p, VPtrSize size);
+    void read(VPtrNum p, void *d, VPtrSize size);
     void write(VPtrNum p, const void *d, VPtrSize size);
     void flush(void);
+    void sync(void);
     void clearPages(void);
-    uint8_t getFreeBigPages(void) const;
-    uint8_t getUnlockedSmallPages(void) const { return getUnlockedPages(&smallPages); } //!< Returns amount of *small* pages which are not locked.
-    uint8_t getUnlockedMediumPages(void) const { return getUnlockedPages(&mediumPages); } //!< Returns amount of *medium* pages which are not locked.
-    uint8_t getUnlockedBigPages(void) const { return getUnlockedPages(&bigPages); } //!< Returns amount of *big* pages which are not locked.
+    VirtPageCount getFreeBigPages(void) const;
+    VirtPageCount getUnlockedSmallPages(void) const { return getUnlockedPages(&smallPages); } //!< Returns amount of *small* pages which are not locked.
+    VirtPageCount getUnlockedMediumPages(void) const { return getUnlockedPages(&mediumPages); } //!< Returns amount of *medium* pages which are not locked.
+    VirtPageCount getUnlockedBigPages(void) const { return getUnlockedPages(&bigPages); } //!< Returns amount of *big* pages which are not locked.
 
     // \cond HIDDEN_SYMBOLS
     void *makeDataLock(VPtrNum ptr, VirtPageSize size, bool ro=false);
@@ -172,9 +561,9 @@ public:
     void releaseLock(VPtrNum ptr);
     // \endcond
 
-    uint8_t getSmallPageCount(void) const { return smallPages.count; } //!< Returns total amount of *small* pages.
-    uint8_t getMediumPageCount(void) const { return mediumPages.count; } //!< Returns total amount of *medium* pages.
-    uint8_t getBigPageCount(void) const { return bigPages.count; } //!< Returns total amount of *big* pages.
+    VirtPageCount getSmallPageCount(void) const { return smallPages.count; } //!< Returns total amount of *small* pages.
+    VirtPageCount getMediumPageCount(void) const { return mediumPages.count; } //!< Returns total amount of *medium* pages.
+    VirtPageCount getBigPageCount(void) const { return bigPages.count; } //!< Returns total amount of *big* pages.
     VirtPageSize getSmallPageSize(void) const { return smallPages.size; } //!< Returns the size of a *small* page.
     VirtPageSize getMediumPageSize(void) const { return mediumPages.size; } //!< Returns the size of a *medium* page.
     VirtPageSize getBigPageSize(void) const { return bigPages.size; } //!< Returns the size of a *big* page.
@@ -199,11 +588,20 @@ public:
     //@{
     VPtrSize getMemUsed(void) const { return memUsed; } //!< Returns total memory used.
     VPtrSize getMaxMemUsed(void) const { return maxMemUsed; } //!< Returns the maximum memory used so far.
-    uint32_t getBigPageReads(void) const { return bigPageReads; } //!< Returns the times *big* pages were read (swapped).
-    uint32_t getBigPageWrites(void) const { return bigPageWrites; } //!< Returns the times *big* pages written (synchronized).
-    uint32_t getBytesRead(void) const { return bytesRead; } //!< Returns the amount of bytes read as a result of page swaps.
-    uint32_t getBytesWritten(void) const { return bytesWritten; } //!< Returns the amount of bytes written as a results of page swaps.
-    void resetStats(void) { memUsed = maxMemUsed = 0; bigPageReads = bigPageWrites = bytesRead = bytesWritten = 0; } //!< Reset all statistics. Called by \ref start()
+    VPtrSize getBigPageReads(void) const { return bigPageReads; } //!< Returns the times *big* pages were read (swapped).
+    VPtrSize getBigPageWrites(void) const { return bigPageWrites; } //!< Returns the times *big* pages written (synchronized).
+    /**
+     * @brief Returns the times data was accessed that was already in a *big* page.
+     *
+     * Together with \ref getBigPageReads() (the misses), this can be used to calculate the miss rate of
+     * the page replacement policy (see BasePagePolicy).
+     */
+    VPtrSize getBigPageHits(void) const { return bigPageHits; }
+    VPtrSize getBytesRead(void) const { return bytesRead; } //!< Returns the amount of bytes read as a result of page swaps.
+    VPtrSize getBytesWritten(void) const { return bytesWritten; } //!< Returns the amount of bytes written as a results of page swaps.
+    VPtrSize getReadAheadHits(void) const { return readAheadHits; } //!< Returns the amount of pages loaded by read-ahead that were used afterwards.
+    VPtrSize getWastedPrefetches(void) const { return wastedPrefetches; } //!< Returns the amount of pages loaded by read-ahead that were swapped out before they were used.
+    void resetStats(void) { memUsed = maxMemUsed = 0; bigPageReads = bigPageWrites = bigPageHits = bytesRead = bytesWritten = readAheadHits = wastedPrefetches = 0; } //!< Reset all statistics. Called by \ref start()
     //@}
 #endif
 };
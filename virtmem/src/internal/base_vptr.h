@@ -97,15 +97,18 @@ protected:
 #endif
 
     // @cond HIDDEN_SYMBOLS
+    // Numeric type large enough for both virtual addresses and regular pointers
+    typedef private_utils::Conditional<(sizeof(intptr_t) > sizeof(VPtrNum)), intptr_t, VPtrNum>::type PtrAddr;
+
 #ifdef VIRTMEM_WRAP_CPOINTERS
     // Return 'real' address of pointer, ie without wrapping bit
     // static so that ValueWrapper can use it as well
-    static intptr_t getPtrNum(PtrNum p) { return p & ~((PtrNum)1 << WRAP_BIT); }
+    static PtrAddr getPtrNum(PtrNum p) { return p & ~((PtrNum)1 << WRAP_BIT); }
     static void *unwrap(PtrNum p) { ASSERT(isWrapped(p)); return reinterpret_cast<void *>(getPtrNum(p)); }
 #else
-    static intptr_t getPtrNum(PtrNum p) { return p; }
+    static PtrAddr getPtrNum(PtrNum p) { return p; }
 #endif
-    intptr_t getPtrNum(void) const { return getPtrNum(ptr); } // Shortcut
+    PtrAddr getPtrNum(void) const { return getPtrNum(ptr); } // Shortcut
     // @endcond
 
 public:
@@ -0,0 +1,189 @@
+#ifndef VIRTMEM_HANDLE_H
+#define VIRTMEM_HANDLE_H
+
+/**
+  @file
+  @brief Handles to relocatable virtual memory
+*/
+
+#include "base_alloc.h"
+#include "config/config.h"
+#include "vptr.h"
+
+namespace virtmem {
+
+/**
+ * @brief Allocates virtual memory that is accessed through handles, so that it can be moved.
+ *
+ * A handle refers to an entry of the table, which stores the current address of a memory block. Blocks
+ * allocated from a handle table are relocatable (see BaseVAlloc::setRelocatable()): BaseVAlloc::compact() may
+ * move them to reduce fragmentation of the memory pool, and updates the table when it does. The table itself
+ * is stored in virtual memory, in chunks of entries that never move.
+ *
+ * Example:
+ * @code{.cpp}
+ * virtmem::StdioVAlloc valloc;
+ * virtmem::VHandleTable<virtmem::StdioVAlloc> handles;
+ *
+ * virtmem::VHandleTable<virtmem::StdioVAlloc>::Handle h = handles.alloc(sizeof(int));
+ * *handles.get<int>(h) = 10;
+ * valloc.compact(1024); // may move the block
+ * int i = *handles.get<int>(h); // i == 10
+ * handles.free(h);
+ * @endcode
+ *
+ * @tparam Allocator The allocator class from which memory is allocated.
+ * @note Addresses and virtual pointers obtained with \ref get() stay valid until the memory pool is compacted.
+ * @note Blocks are only moved by the default allocation algorithm, see BaseVAlloc::compact().
+ */
+template <typename Allocator> class VHandleTable
+{
+public:
+    typedef VPtrNum Handle; //!< Refers to a block of the table, zero if none. This is the address of its entry.
+
+private:
+    enum
+    {
+        FREE_ENTRY = 1, // set in unused entries, which store the next unused entry (blocks are always aligned)
+        DEFAULT_CHUNK_SIZE = 32
+    };
+
+    BaseVAlloc *allocator;
+    VPtrSize chunkSize; // entries per chunk
+    VPtrNum chunk; // last chunk, which starts with the address of the previous chunk
+    VPtrNum freeEntries;
+
+    VHandleTable(const VHandleTable &);
+    VHandleTable &operator=(const VHandleTable &);
+
+    VPtrNum readEntry(VPtrNum e) const
+    {
+        VPtrNum ret;
+        allocator->read(e, &ret, sizeof(ret));
+        return ret;
+    }
+
+    void pushEntry(VPtrNum e)
+    {
+        const VPtrNum link = freeEntries | FREE_ENTRY;
+        allocator->write(e, &link, sizeof(link));
+        freeEntries = e;
+    }
+
+    Handle popEntry(void)
+    {
+        if (!freeEntries)
+        {
+            const VPtrNum c = allocator->allocRaw((chunkSize + 1) * sizeof(VPtrNum));
+            if (!c)
+                return 0;
+            allocator->write(c, &chunk, sizeof(chunk));
+            chunk = c;
+            for (VPtrSize i=chunkSize; i>0; --i)
+                pushEntry(c + i * sizeof(VPtrNum));
+        }
+
+        const Handle ret = freeEntries;
+        freeEntries = readEntry(ret) & ~(VPtrNum)FREE_ENTRY;
+        return ret;
+    }
+
+public:
+    /**
+     * @brief Constructs a handle table.
+     * @param csize The amount of entries in each chunk of the table.
+     * @param a The allocator instance to use. By default, the current instance is used (see VAlloc::getInstance()).
+     */
+    VHandleTable(VPtrSize csize=DEFAULT_CHUNK_SIZE, BaseVAlloc *a=Allocator::getInstance())
+        : allocator(a), chunkSize(csize), chunk(0), freeEntries(0) { }
+    ~VHandleTable(void) { reset(); } //!< Frees all memory of the table.
+
+    /**
+     * @brief Allocates a relocatable memory block.
+     * @param size The size of the memory block.
+     * @return The handle of the memory block. Will return zero if out of memory.
+     */
+    Handle alloc(VPtrSize size)
+    {
+        const Handle ret = popEntry();
+        if (!ret)
+            return 0;
+
+        const VPtrNum p = allocator->allocRaw(size);
+        if (!p)
+        {
+            pushEntry(ret);
+            return 0;
+        }
+
+        allocator->write(ret, &p, sizeof(p));
+        allocator->setRelocatable(p, ret);
+        return ret;
+    }
+
+    //! Frees a memory block allocated by \ref alloc(). The handle \a h is invalid afterwards.
+    void free(Handle h)
+    {
+        if (!h)
+            return;
+        allocator->freeRaw(readEntry(h));
+        pushEntry(h);
+    }
+
+    /**
+     * @brief Changes the size of a memory block.
+     * @param h The handle of the memory block, which stays the same.
+     * @param size The new size of the memory block.
+     * @return `false` if out of memory, in which case the block is left untouched.
+     * @sa BaseVAlloc::reallocRaw
+     */
+    bool realloc(Handle h, VPtrSize size)
+    {
+        const VPtrNum p = allocator->reallocRaw(readEntry(h), size);
+        if (!p)
+            return false;
+
+        allocator->write(h, &p, sizeof(p));
+        allocator->setRelocatable(p, h);
+        return true;
+    }
+
+    //! Returns the current address of the memory block of \a h.
+    VPtrNum getRaw(Handle h) const { return readEntry(h); }
+
+    /**
+     * @brief Returns a virtual pointer to the memory block of a handle.
+     * @tparam T The data type pointed to.
+     * @param h The handle of the memory block.
+     * @note The pointer should not be used after the memory pool is compacted.
+     */
+    template <typename T> VPtr<T, Allocator> get(Handle h) const
+    {
+        VPtr<T, Allocator> ret;
+        ret.setRawNum(readEntry(h));
+        return ret;
+    }
+
+    //! Frees all memory blocks and the table itself.
+    void reset(void)
+    {
+        while (chunk)
+        {
+            for (VPtrSize i=1; i<=chunkSize; ++i)
+            {
+                const VPtrNum p = readEntry(chunk + i * sizeof(VPtrNum));
+                if (!(p & FREE_ENTRY))
+                    allocator->freeRaw(p);
+            }
+
+            const VPtrNum prev = readEntry(chunk);
+            allocator->freeRaw(chunk);
+            chunk = prev;
+        }
+        freeEntries = 0;
+    }
+};
+
+}
+
+#endif // VIRTMEM_HANDLE_H
@@ -0,0 +1,309 @@
+#ifndef VIRTMEM_PAGE_POLICY_H
+#define VIRTMEM_PAGE_POLICY_H
+
+/**
+  @file
+  @brief Replacement policies for *big* memory pages
+*/
+
+#include "base_alloc.h"
+#include "config/config.h"
+
+#include <stdint.h>
+
+namespace virtmem {
+
+/**
+ * @brief Base class for replacement policies of *big* memory pages.
+ *
+ * A replacement policy decides which cached *big* page is swapped out when data is accessed that
+ * is not in any page yet. The allocator informs the policy when pages start or stop caching data,
+ * and when data of a cached page is accessed. Locked pages are never tracked by a policy.
+ *
+ * Policies are selected by declaring a `PagePolicy` type in the allocator properties, for example:
+ * @code{.cpp}
+struct AllocProperties
+{
+    static const uint8_t smallPageCount = 4, smallPageSize = 64;
+    static const uint8_t mediumPageCount = 4, mediumPageSize = 128;
+    static const uint8_t bigPageCount = 8;
+    static const uint16_t bigPageSize = 512;
+    typedef virtmem::TwoQueuePagePolicy<bigPageCount> PagePolicy;
+};
+ * @endcode
+ * If no policy is declared, pages are swapped in a FIFO way, where clean pages are preferred.
+ * This default needs no extra RAM.
+ *
+ * @sa LRUPagePolicy, ClockPagePolicy and TwoQueuePagePolicy
+ */
+class BasePagePolicy
+{
+public:
+    /**
+     * @name Policy hooks
+     * The following functions should be defined by derived policy classes.
+     * @{
+     */
+    virtual void reset(void) = 0; //!< Called when the allocator starts or clears all pages
+    //! Called when a page starts caching data starting at address `start`
+    virtual void pageInserted(VirtPageIndex index, VPtrNum start) = 0;
+    virtual void pageRemoved(VirtPageIndex index) = 0; //!< Called when a page stops caching data (e.g. locked or invalidated)
+    virtual void pageAccessed(VirtPageIndex index) = 0; //!< Called when data of a cached page was accessed
+    //! Selects a cached page to swap out, pageRemoved() is called afterwards. Returns -1 if none is available.
+    virtual VirtPageIndex getVictim(void) = 0;
+    //! @}
+};
+
+// \cond HIDDEN_SYMBOLS
+namespace private_utils {
+
+// Doubly linked lists of page indices, which share their nodes
+template <VirtPageCount pageCount> class PageLists
+{
+    VirtPageIndex nextPage[pageCount], prevPage[pageCount];
+
+public:
+    struct List
+    {
+        VirtPageIndex head, tail; // most and least recently inserted
+        VirtPageCount size;
+    };
+
+    static void clear(List &l) { l.head = l.tail = -1; l.size = 0; }
+
+    void pushFront(List &l, VirtPageIndex index)
+    {
+        prevPage[index] = -1;
+        nextPage[index] = l.head;
+        if (l.head != -1)
+            prevPage[l.head] = index;
+        else
+            l.tail = index;
+        l.head = index;
+        ++l.size;
+    }
+
+    void remove(List &l, VirtPageIndex index)
+    {
+        if (prevPage[index] != -1)
+            nextPage[prevPage[index]] = nextPage[index];
+        else
+            l.head = nextPage[index];
+        if (nextPage[index] != -1)
+            prevPage[nextPage[index]] = prevPage[index];
+        else
+            l.tail = prevPage[index];
+        --l.size;
+    }
+};
+
+}
+// \endcond
+
+/**
+ * @brief Least recently used (LRU) replacement policy.
+ *
+ * Swaps out the page that was accessed longest ago. This policy works well for workloads with
+ * good temporal locality, but a single scan over a large data set flushes the whole cache.
+ * @tparam pageCount The amount of *big* pages of the allocator.
+ */
+template <VirtPageCount pageCount> class LRUPagePolicy : public BasePagePolicy
+{
+    typedef private_utils::PageLists<pageCount> Lists;
+
+    Lists lists;
+    typename Lists::List lruList;
+    bool cached[pageCount];
+
+public:
+    LRUPagePolicy(void) { reset(); }
+
+    void reset(void)
+    {
+        Lists::clear(lruList);
+        for (VirtPageCount i=0; i<pageCount; ++i)
+            cached[i] = false;
+    }
+    void pageInserted(VirtPageIndex index, VPtrNum)
+    {
+        lists.pushFront(lruList, index);
+        cached[index] = true;
+    }
+    void pageRemoved(VirtPageIndex index)
+    {
+        if (cached[index])
+        {
+            lists.remove(lruList, index);
+            cached[index] = false;
+        }
+    }
+    void pageAccessed(VirtPageIndex index)
+    {
+        if (cached[index] && lruList.head != index)
+        {
+            lists.remove(lruList, index);
+            lists.pushFront(lruList, index);
+        }
+    }
+    VirtPageIndex getVictim(void) { return lruList.tail; }
+};
+
+/**
+ * @brief CLOCK (second chance) replacement policy.
+ *
+ * Approximates LRU by using a single reference bit per page, which makes accesses cheaper
+ * to track than with LRUPagePolicy.
+ * @tparam pageCount The amount of *big* pages of the allocator.
+ */
+template <VirtPageCount pageCount> class ClockPagePolicy : public BasePagePolicy
+{
+    bool cached[pageCount], referenced[pageCount];
+    VirtPageCount hand;
+
+public:
+    ClockPagePolicy(void) { reset(); }
+
+    void reset(void)
+    {
+        hand = 0;
+        for (VirtPageCount i=0; i<pageCount; ++i)
+            cached[i] = referenced[i] = false;
+    }
+    void pageInserted(VirtPageIndex index, VPtrNum) { cached[index] = true; referenced[index] = false; }
+    void pageRemoved(VirtPageIndex index) { cached[index] = false; }
+    void pageAccessed(VirtPageIndex index) { referenced[index] = true; }
+    VirtPageIndex getVictim(void)
+    {
+        // two rounds: the first may only clear reference bits
+        for (VirtPageCount n=0; n<(pageCount * 2); ++n)
+        {
+            const VirtPageIndex index = hand;
+            hand = (hand + 1) % pageCount;
+
+            if (!cached[index])
+                continue;
+            if (referenced[index])
+                referenced[index] = false; // second chance
+            else
+                return index;
+        }
+
+        return -1;
+    }
+};
+
+/**
+ * @brief Scan resistant replacement policy based on the *2Q* algorithm.
+ *
+ * Newly loaded pages enter a small FIFO queue. Pages are only promoted to the main LRU queue
+ * when they are loaded again shortly after they were swapped out from the FIFO queue, which is
+ * tracked by a list of recently swapped out page addresses (the *ghost* list). This way data that
+ * is only used once, for instance during a scan over a large data set, cannot flush frequently
+ * used pages from the cache.
+ *
+ * @tparam pageCount The amount of *big* pages of the allocator.
+ * @tparam inPercentage Size of the FIFO queue relative to the total amount of pages.
+ * @tparam ghostPercentage Size of the ghost list relative to the total amount of pages.
+ * @note This policy works best when VIRTMEM_ALIGNED_PAGES is defined, as pages then always map
+ * the same addresses.
+ */
+template <VirtPageCount pageCount, uint8_t inPercentage=25, uint8_t ghostPercentage=50>
+class TwoQueuePagePolicy : public BasePagePolicy
+{
+    typedef private_utils::PageLists<pageCount> Lists;
+
+    enum
+    {
+        IN_SIZE = ((pageCount * inPercentage / 100) > 0) ? (pageCount * inPercentage / 100) : 1,
+        GHOST_SIZE = ((pageCount * ghostPercentage / 100) > 0) ? (pageCount * ghostPercentage / 100) : 1
+    };
+
+    enum { QUEUE_NONE, QUEUE_IN, QUEUE_MAIN };
+
+    Lists lists;
+    typename Lists::List inList, mainList;
+    uint8_t queue[pageCount];
+    VPtrNum pageStarts[pageCount];
+    VPtrNum ghosts[GHOST_SIZE]; // ring buffer with start addresses of pages swapped from inList
+    VirtPageCount ghostHead;
+
+    bool takeGhost(VPtrNum start)
+    {
+        for (VirtPageCount i=0; i<GHOST_SIZE; ++i)
+        {
+            if (ghosts[i] == start)
+            {
+                ghosts[i] = 0;
+                return true;
+            }
+        }
+        return false;
+    }
+
+public:
+    TwoQueuePagePolicy(void) { reset(); }
+
+    void reset(void)
+    {
+        Lists::clear(inList);
+        Lists::clear(mainList);
+        for (VirtPageCount i=0; i<pageCount; ++i)
+            queue[i] = QUEUE_NONE;
+        for (VirtPageCount i=0; i<GHOST_SIZE; ++i)
+            ghosts[i] = 0;
+        ghostHead = 0;
+    }
+    void pageInserted(VirtPageIndex index, VPtrNum start)
+    {
+        pageStarts[index] = start;
+        if (takeGhost(start))
+        {
+            lists.pushFront(mainList, index);
+            queue[index] = QUEUE_MAIN;
+        }
+        else
+        {
+            lists.pushFront(inList, index);
+            queue[index] = QUEUE_IN;
+        }
+    }
+    void pageRemoved(VirtPageIndex index)
+    {
+        if (queue[index] == QUEUE_IN)
+            lists.remove(inList, index);
+        else if (queue[index] == QUEUE_MAIN)
+            lists.remove(mainList, index);
+        queue[index] = QUEUE_NONE;
+    }
+    void pageAccessed(VirtPageIndex index)
+    {
+        // NOTE: accesses to pages in the FIFO queue are deliberately ignored
+        if (queue[index] == QUEUE_MAIN && mainList.head != index)
+        {
+            lists.remove(mainList, index);
+            lists.pushFront(mainList, index);
+        }
+    }
+    VirtPageIndex getVictim(void)
+    {
+        VirtPageIndex ret;
+        if (inList.size > IN_SIZE || mainList.size == 0)
+        {
+            ret = inList.tail;
+            if (ret != -1)
+            {
+                // remember it, so it is promoted if it is needed again soon
+                ghosts[ghostHead] = pageStarts[ret];
+                ghostHead = (ghostHead + 1) % GHOST_SIZE;
+            }
+        }
+        else
+            ret = mainList.tail;
+
+        return ret;
+    }
+};
+
+}
+
+#endif // VIRTMEM_PAGE_POLICY_H
@@ -57,6 +57,25 @@ template <typename T> T maximal(const T &v1, const T &v2) { return (v1 > v2) ? v
 template <typename T> struct AntiConst { typedef T type; };
 template <typename T> struct AntiConst<const T> { typedef T type; };
 
+// Smallest power of two that is >= N, evaluated at compile time
+template <unsigned long N, unsigned long P=1, bool done=(P >= N)> struct CeilPowerOfTwo
+{ static const unsigned long value = CeilPowerOfTwo<N, P * 2>::value; };
+template <unsigned long N, unsigned long P> struct CeilPowerOfTwo<N, P, true>
+{ static const unsigned long value = P; };
+
+// Index of the highest set bit of N (N > 0), evaluated at compile time
+template <unsigned long N> struct FloorLog2 { static const unsigned char value = FloorLog2<N / 2>::value + 1; };
+template <> struct FloorLog2<1> { static const unsigned char value = 0; };
+
+// Index of the highest set bit of v (v > 0)
+template <typename T> unsigned char floorLog2(T v)
+{
+    unsigned char ret = 0;
+    while (v >>= 1)
+        ++ret;
+    return ret;
+}
+
 }
 
 }
@@ -89,6 +89,22 @@ public:
         ValueWrapper(PtrNum p) : ptr(p) { }
         ValueWrapper(const ValueWrapper &);
 
+#ifdef VIRTMEM_THREAD_SAFE
+        // copies data while the allocator is locked, as other threads may swap out its page afterwards
+        static T value(PtrNum p)
+        {
+#ifdef VIRTMEM_WRAP_CPOINTERS
+            if (isWrapped(p))
+                return *static_cast<T *>(BaseVPtr::unwrap(p));
+#endif
+            typename private_utils::AntiConst<T>::type ret;
+            getAlloc()->read(p, &ret, sizeof(T));
+            return ret;
+        }
+#else
+        static T value(PtrNum p) { return *read(p); }
+#endif
+
         template <typename, typename> friend class VPtr;
 
     public:
@@ -96,7 +112,7 @@ public:
          * @name Proxy operators
          * @{
          */
-        inline operator T(void) const { return *read(ptr); }
+        inline operator T(void) const { return value(ptr); }
         template <typename T2> VIRTMEM_EXPLICIT inline operator T2(void) const { return static_cast<T2>(operator T()); }
 
 //        ValueWrapper &operator=(const ValueWrapper &v)
@@ -107,7 +123,7 @@ public:
             ASSERT(ptr != 0);
             if (ptr != v.ptr)
             {
-                const T val = *read(v.ptr);
+                const T val = value(v.ptr);
                 write(ptr, &val);
             }
             return *this;
@@ -118,7 +134,7 @@ public:
             ASSERT(ptr != 0);
             if (ptr != v.ptr)
             {
-                const T val = *read(v.ptr);
+                const T val = value(v.ptr);
                 write(ptr, &val);
             }
             return *this;
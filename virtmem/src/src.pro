@@ -13,6 +13,7 @@ CONFIG += staticlib
 SOURCES += \
     base_alloc.cpp \
     utils.cpp \
+    async_io.cpp \
 
 HEADERS += \
     virtmem.h \
@@ -20,6 +21,7 @@ HEADERS += \
     internal/base_alloc.h \
     config/config.h \
     alloc/stdio_alloc.h \
+    alloc/mmap_alloc.h \
     internal/alloc.h \
     alloc/spiram_alloc.h \
     alloc/static_alloc.h \
@@ -30,7 +32,12 @@ HEADERS += \
     internal/vptr_utils.hpp \
     alloc/serial_alloc.h \
     internal/serial_utils.h \
-    internal/serial_utils.hpp
+    internal/serial_utils.hpp \
+    internal/page_policy.h \
+    internal/async_io.h \
+    internal/alloc_engine.h \
+    internal/arena.h \
+    internal/handle.h
 unix {
     target.path = /usr/lib
     INSTALLS += target
@@ -2,6 +2,8 @@
 #define VIRTMEM_VIRTMEM_H
 
 #include "config/config.h"
+#include "internal/arena.h"
+#include "internal/handle.h"
 #include "internal/utils.h"
 #include "internal/vptr.h"
 #include "internal/vptr_utils.h"